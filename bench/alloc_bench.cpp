@@ -0,0 +1,219 @@
+// Heap allocations per frame once the JPEG pipeline is warm, the same steps as encode_thread():
+// frame cache lookup, encode (fake M2M device) and cache put on a miss, copy to the last
+// frame, MJPEG fan-out to a client, WebSocket fan-out to a client.
+//   alloc_bench [frames] [width] [height] [screens] [framed]
+// The captures cycle through screens different images, more than the 16 cache entries
+// evict on every put. framed=1 sends WebSocket frames with the header, which copies them.
+// Counted: malloc/calloc/realloc/posix_memalign and us_memory_alloc() calls from this tree
+// (linked with --wrap) and every operator new. Whatever shared libraries allocate inside,
+// libjpeg in the fake device for one, is not. Exits with 1 if the steady state allocated.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "encode/frame.h"
+#include "encode/frame_cache.h"
+#include "encode/m2m.h"
+#include "encode/m2m_fake.h"
+#include "encode/memory.h"
+
+#include "stream/mjpeg_streamer.hpp"
+#include "stream/ws_publisher.hpp"
+
+namespace {
+std::atomic<bool> counting{false};
+std::atomic<uint64_t> allocations{0};
+std::atomic<uint64_t> allocated_bytes{0};
+
+void count(size_t size) {
+    if (counting.load(std::memory_order_relaxed)) {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    }
+}
+}  // namespace
+
+extern "C" {
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+int __real_posix_memalign(void** ptr, size_t alignment, size_t size);
+void* __real_us_memory_alloc(size_t size);
+void __real_free(void* ptr);
+
+void* __wrap_malloc(size_t size) {
+    count(size);
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count_, size_t size) {
+    count(count_ * size);
+    return __real_calloc(count_, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+    count(size);
+    return __real_realloc(ptr, size);
+}
+
+int __wrap_posix_memalign(void** ptr, size_t alignment, size_t size) {
+    count(size);
+    return __real_posix_memalign(ptr, alignment, size);
+}
+
+void* __wrap_us_memory_alloc(size_t size) {
+    count(size);
+    return __real_us_memory_alloc(size);
+}
+
+// Only so operator delete has a free() that pairs with __real_malloc()
+void __wrap_free(void* ptr) { __real_free(ptr); }
+}
+
+void* operator new(size_t size) {
+    count(size);
+    void* ptr = __real_malloc(size == 0 ? 1 : size);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept { __real_free(ptr); }
+
+void operator delete(void* ptr, size_t) noexcept { __real_free(ptr); }
+
+int main(int argc, char* argv[]) {
+    const unsigned frames = (argc > 1 ? atoi(argv[1]) : 500);
+    const unsigned width = (argc > 2 ? atoi(argv[2]) : 1280);
+    const unsigned height = (argc > 3 ? atoi(argv[3]) : 720);
+    const unsigned screens = std::max(argc > 4 ? atoi(argv[4]) : 1, 1);
+    const bool framed = (argc > 5 && atoi(argv[5]) == 1);
+    const unsigned warmup = 50;
+
+    US_LOGGING_INIT;
+    us_frame_pool_s* pool = us_frame_pool_init("bench_pool", 64 << 20);
+
+    std::vector<us_frame_s*> srcs;
+    for (unsigned screen = 0; screen < screens; ++screen) {
+        us_frame_s* src = us_frame_init();
+        us_frame_realloc_data(src, static_cast<size_t>(width) * height * 4);
+        for (size_t i = 0; i < src->allocated; ++i) {
+            src->data[i] = static_cast<uint8_t>(i * (7 + screen));
+        }
+        src->used = static_cast<size_t>(width) * height * 4;
+        src->width = width;
+        src->height = height;
+        src->format = V4L2_PIX_FMT_BGR32;
+        src->stride = width * 4;
+        src->dma_fd = -1;
+        srcs.push_back(src);
+    }
+    const unsigned quality = 80;
+
+    us_m2m_encoder_s* enc = us_m2m_mjpeg_encoder_init("bench", US_M2M_FAKE_PATH_PREFIX, quality);
+    if (us_m2m_encoder_warmup(enc, width, height, V4L2_PIX_FMT_BGR32, false) != 0) {
+        return 1;
+    }
+    us_frame_cache_s* cache = us_frame_cache_init("bench_cache", 16, 32 << 20, pool);
+    us_frame_s* encoded = us_frame_init_pooled(pool);
+    us_frame_s last_encoded = {};
+    last_encoded.pool = pool;
+    last_encoded.dma_fd = -1;
+
+    // One MJPEG client on a socketpair, drained by a plain reader
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+        perror("socketpair()");
+        return 1;
+    }
+    nadjieb::net::setSocketNonblock(fds[0]);
+    std::atomic<uint64_t> mjpeg_bytes{0};
+    std::thread reader([&]() {
+        static char buffer[1 << 16];
+        ssize_t n;
+        while ((n = read(fds[1], buffer, sizeof(buffer))) > 0) {
+            mjpeg_bytes += n;
+        }
+    });
+    nadjieb::net::Publisher publisher;
+    publisher.start(2);
+    auto& topic = publisher.getTopicHandle("/stream");
+    publisher.add(fds[0], "/stream");
+
+    // One WebSocket client that takes every frame at once
+    WsPublisher ws_publisher;
+    ws_publisher.setFramed(framed);
+    std::atomic<uint64_t> ws_frames{0};
+    int ws_client;
+    ws_publisher.add(&ws_client, "bench", [&](const char*, size_t size) {
+        ++ws_frames;
+        return static_cast<long>(size);
+    });
+
+    uint64_t begin_allocations = 0;
+    for (unsigned index = 0; index < warmup + frames; ++index) {
+        if (index == warmup) {
+            // Lets the senders finish the warm-up frames first
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            begin_allocations = allocations.load();
+            counting = true;
+        }
+        const us_frame_s* src = srcs[index % screens];
+        const uint64_t hash = us_frame_hash(src->data, src->stride, src->width * 4, src->height);
+        if (!us_frame_cache_get(cache, hash, src, quality, encoded)) {
+            if (us_m2m_encoder_compress(enc, src, encoded, false) != 0 || encoded->used == 0) {
+                fprintf(stderr, "Can't compress frame %u\n", index);
+                return 1;
+            }
+            us_frame_cache_put(cache, hash, src, quality, encoded);
+        }
+        us_frame_copy(encoded, &last_encoded);
+        publisher.enqueue(topic, reinterpret_cast<char*>(encoded->data), encoded->used);
+        auto frame = topic.getFrame();
+        WsPublisher::FrameInfo info;
+        info.key = true;
+        info.width = width;
+        info.height = height;
+        ws_publisher.publish(WsPublisher::Data(frame, &frame->body), info);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    counting = false;
+    const uint64_t steady = allocations.load() - begin_allocations;
+
+    us_frame_cache_stats_s stats;
+    us_frame_cache_get_stats(cache, &stats);
+    printf("%ux%u, %u frames after %u warm-up frames, %u screens, framed=%d\n", width, height, frames, warmup,
+        screens, framed);
+    printf("cache hits %llu, misses %llu, evictions %llu\n", static_cast<unsigned long long>(stats.hits),
+        static_cast<unsigned long long>(stats.misses), static_cast<unsigned long long>(stats.evictions));
+    printf("MJPEG bytes received %llu, WebSocket frames sent %llu\n",
+        static_cast<unsigned long long>(mjpeg_bytes.load()), static_cast<unsigned long long>(ws_frames.load()));
+    printf("allocations %llu (%.3f per frame), %llu bytes\n", static_cast<unsigned long long>(steady),
+        static_cast<double>(steady) / frames, static_cast<unsigned long long>(allocated_bytes.load()));
+
+    ws_publisher.remove(&ws_client);
+    publisher.removeClient(fds[0]);
+    publisher.stop();
+    shutdown(fds[0], SHUT_RDWR);
+    close(fds[0]);
+    reader.join();
+    close(fds[1]);
+    us_m2m_encoder_destroy(enc);
+    us_frame_cache_destroy(cache);
+    us_frame_destroy(encoded);
+    for (us_frame_s* src : srcs) {
+        us_frame_destroy(src);
+    }
+    return (steady == 0 ? 0 : 1);
+}
@@ -0,0 +1,171 @@
+// MJPEG fan-out over loopback through MJPEGStreamer, the worker pool against the sharded
+// reactors, by the number of clients and publisher threads:
+//   fanout_bench [seconds] [frame_kb] [fps] [max_clients] [max_threads]
+// Frames are published at fps (0 for as fast as the publisher takes them), every client
+// reads everything it gets on one epoll thread. Reported per run: what the clients received
+// per second and the CPU the streamer used for it, the reader thread left out. At full speed
+// the reader is the limit on small boxes, the CPU at a fixed rate is the comparison.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stream/mjpeg_streamer.hpp"
+
+namespace {
+const char* const PATH = "/stream";
+
+struct Result {
+    double mb_per_s = 0;
+    double frames_per_s = 0; // Per client
+    double cpu = 0; // Streamer cores
+};
+
+double getCpuSeconds(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int connectClient(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0) {
+        perror("Can't connect a client");
+        exit(1);
+    }
+    const std::string request = std::string("GET ") + PATH + " HTTP/1.1\r\nHost: bench\r\n\r\n";
+    if (write(fd, request.data(), request.size()) != static_cast<ssize_t>(request.size())) {
+        perror("Can't send the request");
+        exit(1);
+    }
+    nadjieb::net::setSocketNonblock(fd);
+    return fd;
+}
+
+Result run(nadjieb::net::PublisherMode mode, int threads, int clients, int port, double seconds,
+    const std::string& frame, unsigned fps) {
+    nadjieb::MJPEGStreamer streamer;
+    streamer.start(port, threads, mode);
+    auto& topic = streamer.getTopic(PATH);
+    // The path exists for the clients from the first frame on
+    streamer.publish(topic, frame.data(), frame.size());
+
+    std::vector<int> fds;
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    for (int i = 0; i < clients; ++i) {
+        fds.push_back(connectClient(port));
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = fds.back();
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds.back(), &event);
+    }
+
+    std::atomic<bool> end{false};
+    std::atomic<uint64_t> received{0};
+    std::atomic<double> reader_cpu{0}; // Updated by the reader as it goes
+    std::thread reader([&]() {
+        static char buffer[1 << 18];
+        struct epoll_event events[64];
+        while (!end) {
+            int count = epoll_wait(epoll_fd, events, 64, 50);
+            for (int i = 0; i < count; ++i) {
+                ssize_t size;
+                while ((size = read(events[i].data.fd, buffer, sizeof(buffer))) > 0) {
+                    received += size;
+                }
+            }
+            reader_cpu = getCpuSeconds(CLOCK_THREAD_CPUTIME_ID);
+        }
+    });
+
+    const auto interval = (fps > 0 ? std::chrono::microseconds(1000000 / fps) : std::chrono::microseconds(0));
+    auto publish_for = [&](double duration) {
+        const auto end_at = std::chrono::steady_clock::now() + std::chrono::duration<double>(duration);
+        auto next = std::chrono::steady_clock::now();
+        while (std::chrono::steady_clock::now() < end_at) {
+            streamer.publish(topic, frame.data(), frame.size());
+            next += interval;
+            if (fps > 0) {
+                std::this_thread::sleep_until(next);
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    };
+
+    publish_for(0.5);
+    const uint64_t begin_received = received;
+    const double begin_cpu = getCpuSeconds(CLOCK_PROCESS_CPUTIME_ID);
+    const double begin_main_cpu = getCpuSeconds(CLOCK_THREAD_CPUTIME_ID);
+    const double begin_reader_cpu = reader_cpu;
+    const auto begin = std::chrono::steady_clock::now();
+
+    publish_for(seconds);
+
+    const double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    const uint64_t bytes = received - begin_received;
+    const double process_cpu = getCpuSeconds(CLOCK_PROCESS_CPUTIME_ID) - begin_cpu;
+    const double main_cpu = getCpuSeconds(CLOCK_THREAD_CPUTIME_ID) - begin_main_cpu;
+    const double client_cpu = reader_cpu - begin_reader_cpu;
+
+    end = true;
+    reader.join();
+    for (int fd : fds) {
+        close(fd);
+    }
+    close(epoll_fd);
+    streamer.stop();
+
+    Result result;
+    result.mb_per_s = bytes / wall / (1 << 20);
+    result.frames_per_s = bytes / static_cast<double>(frame.size()) / clients / wall;
+    result.cpu = std::max(0.0, process_cpu - main_cpu - client_cpu) / wall;
+    return result;
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    const double seconds = (argc > 1 ? atof(argv[1]) : 2);
+    const size_t frame_kb = (argc > 2 ? atoi(argv[2]) : 256);
+    const unsigned fps = (argc > 3 ? atoi(argv[3]) : 60);
+    const int max_clients = (argc > 4 ? atoi(argv[4]) : 64);
+    const int max_threads = (argc > 5 ? atoi(argv[5]) : 4);
+
+    // Some JPEG-looking bytes, the content doesn't matter to the publisher
+    std::string frame(frame_kb * 1024, '\0');
+    for (size_t i = 0; i < frame.size(); ++i) {
+        frame[i] = static_cast<char>(i * 31);
+    }
+
+    const std::string rate = (fps > 0 ? std::to_string(fps) + " fps" : "full speed");
+    printf("%zuKb frames at %s, %.1fs per run\n", frame_kb, rate.c_str(), seconds);
+    printf("%-9s %8s %8s %10s %14s %8s\n", "mode", "threads", "clients", "MB/s", "fps/client", "cores");
+    int port = 19400;
+    for (auto mode : {nadjieb::net::PublisherMode::WORKERS, nadjieb::net::PublisherMode::REACTORS}) {
+        for (int threads = 1; threads <= max_threads; threads *= 2) {
+            for (int clients = 1; clients <= max_clients; clients *= 4) {
+                auto result = run(mode, threads, clients, port++, seconds, frame, fps);
+                printf("%-9s %8d %8d %10.1f %14.1f %8.2f\n",
+                    (mode == nadjieb::net::PublisherMode::WORKERS ? "workers" : "reactors"), threads, clients,
+                    result.mb_per_s, result.frames_per_s, result.cpu);
+                fflush(stdout);
+            }
+        }
+    }
+    return 0;
+}
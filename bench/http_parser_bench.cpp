@@ -0,0 +1,114 @@
+// Request parsing in the listener, HTTPRequestParser against the std::string accumulation
+// and istringstream HTTPRequest it replaced:
+//   http_parser_bench [requests] [reads per request]
+// Each request is a browser GET of about 450 bytes, handed over in that many reads. Per
+// request the listener looks at the target, the version and the Connection header.
+// Reported: ns and heap allocations per request.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "stream/mjpeg_streamer.hpp"
+
+namespace {
+std::atomic<uint64_t> allocations{0};
+
+const char REQUEST[]
+    = "GET /stream?quality=80 HTTP/1.1\r\n"
+      "Host: 192.168.1.10:9090\r\n"
+      "Connection: keep-alive\r\n"
+      "Cache-Control: max-age=0\r\n"
+      "Upgrade-Insecure-Requests: 1\r\n"
+      "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 "
+      "Safari/537.36\r\n"
+      "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+      "Accept-Encoding: gzip, deflate\r\n"
+      "Accept-Language: en-US,en;q=0.9\r\n"
+      "If-None-Match: \"1234567890\"\r\n"
+      "\r\n";
+
+struct Result {
+    double ns = 0;
+    double allocations = 0;
+};
+
+template <typename Parse>
+Result measure(unsigned requests, Parse parse) {
+    // Warm-up, and what the compiler may not drop
+    size_t checksum = parse();
+    const uint64_t begin_allocations = allocations;
+    const auto begin = std::chrono::steady_clock::now();
+    for (unsigned index = 0; index < requests; ++index) {
+        checksum += parse();
+    }
+    const double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+    if (checksum == 0) {
+        printf("\n");
+    }
+    return Result{ns / requests, static_cast<double>(allocations - begin_allocations) / requests};
+}
+}  // namespace
+
+void* operator new(size_t size) {
+    ++allocations;
+    void* ptr = malloc(size == 0 ? 1 : size);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept { free(ptr); }
+
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+
+int main(int argc, char* argv[]) {
+    const unsigned requests = (argc > 1 ? atoi(argv[1]) : 200000);
+    const size_t reads = std::max(argc > 2 ? atoi(argv[2]) : 1, 1);
+
+    const size_t request_size = sizeof(REQUEST) - 1;
+    std::vector<std::pair<const char*, size_t>> chunks;
+    for (size_t offset = 0; offset < request_size;) {
+        const size_t size = std::min(request_size - offset, (request_size + reads - 1) / reads);
+        chunks.emplace_back(REQUEST + offset, size);
+        offset += size;
+    }
+
+    // Before: the reads appended to a std::string, that went through HTTPRequest once complete
+    auto old_result = measure(requests, [&]() {
+        std::string data;
+        for (const auto& [chunk, size] : chunks) {
+            data.append(chunk, size);
+        }
+        nadjieb::net::HTTPRequest req(data);
+        return req.getTarget().size() + req.getVersion().size() + req.getValue("Connection").size();
+    });
+
+    // After: one parser per connection, the reads go into its buffer
+    auto parser = std::make_unique<nadjieb::net::HTTPRequestParser>();
+    auto new_result = measure(requests, [&]() {
+        size_t checksum = 0;
+        for (const auto& [chunk, size] : chunks) {
+            if (parser->feed(chunk, size) == nadjieb::net::HTTPRequestParser::State::COMPLETE) {
+                checksum = parser->getTarget().size() + parser->getVersion().size()
+                           + parser->getValue("Connection").size();
+                parser->consume();
+            }
+        }
+        return checksum;
+    });
+
+    printf("%u requests of %zu bytes in %zu reads\n", requests, request_size, chunks.size());
+    printf("%-20s %10s %14s\n", "parser", "ns/req", "allocs/req");
+    printf("%-20s %10.0f %14.1f\n", "HTTPRequest", old_result.ns, old_result.allocations);
+    printf("%-20s %10.0f %14.1f\n", "HTTPRequestParser", new_result.ns, new_result.allocations);
+    return (new_result.allocations == 0 ? 0 : 1);
+}
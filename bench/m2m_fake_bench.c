@@ -0,0 +1,122 @@
+// What the M2M encoder state machine costs on top of the encoding itself, run against the
+// fake device on any Linux box:
+//   m2m_fake_bench [frames] [width] [height] [fake options]
+// Every frame goes through us_m2m_encoder_compress() once with INPUT buffers the frame is
+// copied into, once with INPUT-DMA buffers (a memfd standing in for the capture dma-buf,
+// nothing is copied), and is encoded by libjpeg directly as the baseline. The overhead is
+// the difference per frame.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "encode/tools.h"
+#include "encode/logging.h"
+#include "encode/frame.h"
+#include "encode/m2m.h"
+#include "encode/m2m_fake.h"
+#include "encode/cpu_jpeg.h"
+
+
+#define _QUALITY	80
+#define _FORMAT		V4L2_PIX_FMT_BGR32
+
+
+static void _fill(uint8_t *pixels, unsigned width, unsigned height) {
+	// Gradients, so libjpeg gets some real work
+	for (unsigned y = 0; y < height; ++y) {
+		for (unsigned x = 0; x < width; ++x) {
+			uint8_t *const pixel = pixels + ((size_t)y * width + x) * 4;
+			pixel[0] = x;
+			pixel[1] = y * 2;
+			pixel[2] = x ^ y;
+			pixel[3] = 0xff;
+		}
+	}
+}
+
+static double _run_m2m(const char *path, us_frame_s *src, unsigned frames, bool dma) {
+	us_m2m_encoder_s *const enc = us_m2m_mjpeg_encoder_init("bench", path, _QUALITY);
+	us_frame_s *const dest = us_frame_init();
+	double total = -1;
+
+	if (us_m2m_encoder_warmup(enc, src->width, src->height, _FORMAT, dma) == 0) {
+		const uint64_t begin_us = us_get_now_monotonic_u64();
+		for (unsigned index = 0; index < frames; ++index) {
+			if (us_m2m_encoder_compress(enc, src, dest, false) < 0 || dest->used == 0) {
+				US_LOG_ERROR("Can't compress frame %u", index);
+				goto done;
+			}
+		}
+		total = us_get_now_monotonic_u64() - begin_us;
+	}
+
+done:
+	us_frame_destroy(dest);
+	us_m2m_encoder_destroy(enc);
+	return total;
+}
+
+static double _run_cpu(const us_frame_s *src, const uint8_t *pixels, unsigned frames) {
+	us_frame_s *const dest = us_frame_init();
+	const uint64_t begin_us = us_get_now_monotonic_u64();
+	for (unsigned index = 0; index < frames; ++index) {
+		dest->used = 0;
+		us_cpu_jpeg_compress(pixels, src->stride, src->width, src->height, _FORMAT, _QUALITY, dest);
+	}
+	const double total = us_get_now_monotonic_u64() - begin_us;
+	us_frame_destroy(dest);
+	return total;
+}
+
+int main(int argc, char *argv[]) {
+	const unsigned frames = (argc > 1 ? (unsigned)atoi(argv[1]) : 200);
+	const unsigned width = (argc > 2 ? (unsigned)atoi(argv[2]) : 1280);
+	const unsigned height = (argc > 3 ? (unsigned)atoi(argv[3]) : 720);
+	char path[256];
+	snprintf(path, sizeof(path), "%s%s", US_M2M_FAKE_PATH_PREFIX, (argc > 4 ? argv[4] : ""));
+
+	US_LOGGING_INIT;
+
+	const size_t size = (size_t)width * height * 4;
+	const int fd = memfd_create("bench-frame", MFD_CLOEXEC);
+	if (fd < 0 || ftruncate(fd, size) < 0) {
+		perror("Can't create the frame memfd");
+		return 1;
+	}
+	uint8_t *const pixels = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (pixels == MAP_FAILED) {
+		perror("Can't map the frame memfd");
+		return 1;
+	}
+	_fill(pixels, width, height);
+
+	us_frame_s *const src = us_frame_init();
+	us_frame_set_data(src, pixels, size);
+	src->width = width;
+	src->height = height;
+	src->format = _FORMAT;
+	src->stride = width * 4;
+	src->dma_fd = -1;
+
+	const double cpu = _run_cpu(src, pixels, frames);
+	const double copy = _run_m2m(path, src, frames, false);
+	src->dma_fd = fd;
+	const double dma = _run_m2m(path, src, frames, true);
+	if (copy < 0 || dma < 0) {
+		return 1;
+	}
+
+	printf("%ux%u, %u frames, %s\n", width, height, frames, path);
+	printf("%-12s %12s %14s\n", "mode", "us/frame", "overhead us");
+	printf("%-12s %12.1f %14s\n", "libjpeg", cpu / frames, "-");
+	printf("%-12s %12.1f %14.1f\n", "INPUT", copy / frames, (copy - cpu) / frames);
+	printf("%-12s %12.1f %14.1f\n", "INPUT-DMA", dma / frames, (dma - cpu) / frames);
+
+	us_frame_destroy(src);
+	munmap(pixels, size);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,294 @@
+// Syscalls per frame in each publisher mode, by the number of clients:
+//   uring_syscall_bench [frames] [frame_kb] [fps] [max_clients] [threads]
+// The publisher runs in a child process traced with ptrace, every syscall of every one of its
+// threads between two markers is counted. The clients are socketpairs drained by another,
+// untraced process. Only the sleeps of the thread publishing at fps are left out, the
+// wake-ups it sends count. uring-sendmsg is the io_uring publisher without registered
+// buffers. Reported per frame: all syscalls, the sends and writes, the waits (poll, epoll,
+// futex) and io_uring_enter/register, plus the frames each client received.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "stream/mjpeg_streamer.hpp"
+
+namespace {
+const char* const PATH = "/stream";
+const unsigned WARMUP_FRAMES = 10;
+
+#ifdef __GLIBC__
+using SyscallInfo = struct __ptrace_syscall_info;
+#else
+using SyscallInfo = struct ptrace_syscall_info;
+#endif
+
+enum class Mode { WORKERS, REACTORS, URING_SENDMSG, URING };
+
+const char* getName(Mode mode) {
+    switch (mode) {
+        case Mode::WORKERS:
+            return "workers";
+        case Mode::REACTORS:
+            return "reactors";
+        case Mode::URING_SENDMSG:
+            return "uring-sendmsg";
+        default:
+            return "uring";
+    }
+}
+
+struct Counts {
+    uint64_t total = 0;
+    uint64_t sends = 0;
+    uint64_t waits = 0;
+    uint64_t uring = 0;
+};
+
+void countSyscall(Counts& counts, long nr) {
+    ++counts.total;
+    switch (nr) {
+        case SYS_sendmsg:
+        case SYS_sendmmsg:
+        case SYS_sendto:
+        case SYS_write:
+        case SYS_writev:
+        case SYS_splice:
+        case SYS_vmsplice:
+            ++counts.sends;
+            break;
+#ifdef SYS_poll
+        case SYS_poll:
+#endif
+#ifdef SYS_epoll_wait
+        case SYS_epoll_wait:
+#endif
+        case SYS_ppoll:
+        case SYS_epoll_pwait:
+        case SYS_futex:
+            ++counts.waits;
+            break;
+        case SYS_io_uring_enter:
+        case SYS_io_uring_register:
+            ++counts.uring;
+            break;
+        default:
+            break;
+    }
+}
+
+// Marks where counting starts and stops, a syscall the publishers never make
+void mark() { ::syscall(SYS_getppid); }
+
+void drain(const std::vector<int>& fds, int result_fd) {
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    for (int fd : fds) {
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    }
+    static char buffer[1 << 18];
+    uint64_t received = 0;
+    size_t open = fds.size();
+    struct epoll_event events[64];
+    while (open > 0) {
+        int count = epoll_wait(epoll_fd, events, 64, -1);
+        for (int i = 0; i < count; ++i) {
+            ssize_t size = read(events[i].data.fd, buffer, sizeof(buffer));
+            if (size > 0) {
+                received += size;
+            } else {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, events[i].data.fd, nullptr);
+                --open;
+            }
+        }
+    }
+    (void)!write(result_fd, &received, sizeof(received));
+}
+
+// The traced child, exits with 2 when the mode is unavailable
+void serve(Mode mode, int clients, unsigned frames, const std::string& frame, unsigned fps, int threads,
+    int result_fd) {
+    std::vector<int> server_fds;
+    std::vector<int> client_fds;
+    for (int i = 0; i < clients; ++i) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+            perror("socketpair()");
+            _exit(1);
+        }
+        nadjieb::net::setSocketNonblock(fds[0]);
+        server_fds.push_back(fds[0]);
+        client_fds.push_back(fds[1]);
+    }
+    pid_t reader = fork();
+    if (reader == 0) {
+        for (int fd : server_fds) {
+            close(fd);
+        }
+        drain(client_fds, result_fd);
+        _exit(0);
+    }
+    for (int fd : client_fds) {
+        close(fd);
+    }
+    close(result_fd);
+
+    // Traced from here on, the reader above is not
+    ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
+    raise(SIGSTOP);
+
+    std::unique_ptr<nadjieb::net::PublisherBase> publisher;
+    if (mode == Mode::WORKERS) {
+        auto workers = std::make_unique<nadjieb::net::Publisher>();
+        workers->start(threads);
+        publisher = std::move(workers);
+    } else if (mode == Mode::REACTORS) {
+        auto reactors = std::make_unique<nadjieb::net::ReactorPublisher>();
+        reactors->start(threads);
+        publisher = std::move(reactors);
+    } else {
+        auto uring = std::make_unique<nadjieb::net::UringPublisher>();
+        if (!uring->start(mode == Mode::URING)) {
+            _exit(2);
+        }
+        publisher = std::move(uring);
+    }
+    auto& topic = publisher->getTopicHandle(PATH);
+    for (int fd : server_fds) {
+        publisher->add(fd, PATH);
+    }
+
+    const auto interval = std::chrono::microseconds(1000000 / std::max(fps, 1U));
+    auto next = std::chrono::steady_clock::now();
+    for (unsigned index = 0; index < WARMUP_FRAMES + frames; ++index) {
+        if (index == WARMUP_FRAMES) {
+            mark();
+        }
+        publisher->enqueue(topic, frame.data(), frame.size());
+        next += interval;
+        std::this_thread::sleep_until(next);
+    }
+    // The last frame reaches the clients before counting stops
+    std::this_thread::sleep_for(interval);
+    mark();
+
+    for (int fd : server_fds) {
+        publisher->removeClient(fd);
+        shutdown(fd, SHUT_RDWR);
+        close(fd);
+    }
+    publisher->stop();
+    waitpid(reader, nullptr, 0);
+    _exit(0);
+}
+
+// Runs the child to its end, false if it didn't get through
+bool trace(pid_t child, Counts& counts) {
+    int status;
+    if (waitpid(child, &status, 0) != child || !WIFSTOPPED(status)) {
+        return false;
+    }
+    ptrace(PTRACE_SETOPTIONS, child, nullptr,
+        PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL);
+    ptrace(PTRACE_SYSCALL, child, nullptr, nullptr);
+
+    bool counting = false;
+    while (true) {
+        pid_t pid = waitpid(-1, &status, __WALL);
+        if (pid < 0) {
+            return false;
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            if (pid == child) {
+                return (WIFEXITED(status) && WEXITSTATUS(status) == 0);
+            }
+            continue;
+        }
+
+        int signal = 0;
+        const int stop = WSTOPSIG(status);
+        if (stop == (SIGTRAP | 0x80)) {
+            SyscallInfo info;
+            if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(info), &info) > 0
+                && info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+                const long nr = static_cast<long>(info.entry.nr);
+                const bool sleep = (pid == child && (nr == SYS_clock_nanosleep || nr == SYS_nanosleep));
+                if (nr == SYS_getppid && pid == child) {
+                    counting = !counting;
+                } else if (counting && !sleep) {
+                    countSyscall(counts, nr);
+                }
+            }
+        } else if (stop != SIGTRAP && stop != SIGSTOP) {
+            // The clone events and the first stop of every new thread are ours, the rest not
+            signal = stop;
+        }
+        ptrace(PTRACE_SYSCALL, pid, nullptr, signal);
+    }
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    const unsigned frames = (argc > 1 ? atoi(argv[1]) : 60);
+    const size_t frame_kb = (argc > 2 ? atoi(argv[2]) : 256);
+    const unsigned fps = (argc > 3 ? atoi(argv[3]) : 30);
+    const int max_clients = (argc > 4 ? atoi(argv[4]) : 64);
+    const int threads = (argc > 5 ? atoi(argv[5]) : 2);
+
+    std::string frame(frame_kb * 1024, '\0');
+    for (size_t i = 0; i < frame.size(); ++i) {
+        frame[i] = static_cast<char>(i * 31);
+    }
+
+    printf("%u %zuKb frames at %u fps, %d publisher threads\n", frames, frame_kb, fps, threads);
+    printf("%-14s %8s %10s %8s %8s %8s %12s\n", "mode", "clients", "syscalls", "sends", "waits", "uring",
+        "recv/client");
+    for (auto mode : {Mode::WORKERS, Mode::REACTORS, Mode::URING_SENDMSG, Mode::URING}) {
+        for (int clients = 1; clients <= max_clients; clients *= 4) {
+            int result[2];
+            if (pipe2(result, O_CLOEXEC) != 0) {
+                perror("pipe2()");
+                return 1;
+            }
+            fflush(stdout);
+            pid_t child = fork();
+            if (child == 0) {
+                close(result[0]);
+                serve(mode, clients, frames, frame, fps, threads, result[1]);
+            }
+            close(result[1]);
+
+            Counts counts;
+            const bool ok = trace(child, counts);
+            uint64_t received = 0;
+            (void)!read(result[0], &received, sizeof(received));
+            close(result[0]);
+            if (!ok) {
+                printf("%-14s %8d %10s\n", getName(mode), clients, "n/a");
+                continue;
+            }
+            printf("%-14s %8d %10.2f %8.2f %8.2f %8.2f %12.1f\n", getName(mode), clients,
+                static_cast<double>(counts.total) / frames, static_cast<double>(counts.sends) / frames,
+                static_cast<double>(counts.waits) / frames, static_cast<double>(counts.uring) / frames,
+                static_cast<double>(received) / frame.size() / clients);
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
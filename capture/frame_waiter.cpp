@@ -5,7 +5,11 @@ FrameWaiter::waitForFrame() {
     std::unique_lock<std::mutex> lock(mMutex);
 
     while (!mStopped) {
-        if (mCondition.wait_for(lock, mTimeout, [this] { return mPendingFrames > 0; })) {
+        if (mCondition.wait_for(lock, mTimeout, [this] { return mPendingFrames > 0 || mInterrupted; })) {
+            if (mInterrupted) {
+                mInterrupted = false;
+                return -1;
+            }
             return mPendingFrames--;
         }
     }
@@ -26,6 +30,21 @@ FrameWaiter::onFrameAvailable() {
     mCondition.notify_one();
 }
 
+// Makes the current or next waitForFrame() return -1 without a frame
+void
+FrameWaiter::interrupt() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mInterrupted = true;
+    mCondition.notify_one();
+}
+
+// Forgets the frames of a consumer that is gone
+void
+FrameWaiter::reset() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mPendingFrames = 0;
+}
+
 void
 FrameWaiter::stop() {
     mStopped = true;
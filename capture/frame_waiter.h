@@ -10,10 +10,13 @@ class FrameWaiter : public Minicap::FrameAvailableListener {
 public:
     FrameWaiter(): mTimeout(std::chrono::milliseconds(100)), 
       mPendingFrames(0),
-      mStopped(false) {}
+      mStopped(false),
+      mInterrupted(false) {}
     int waitForFrame();
     void reportExtraConsumption(int count);
     void onFrameAvailable();
+    void interrupt();
+    void reset();
     void stop();
     bool isStopped();
 
@@ -23,4 +26,5 @@ private:
     std::chrono::milliseconds mTimeout;
     int mPendingFrames;
     bool mStopped;
+    bool mInterrupted;
 };
@@ -0,0 +1,162 @@
+#include "cpu_jpeg.h"
+
+#include <stdio.h>
+#include <setjmp.h>
+
+#include <jpeglib.h>
+
+
+typedef struct {
+	struct jpeg_destination_mgr	mgr;
+	us_frame_s					*frame;
+} _jpeg_dest_manager_s;
+
+typedef struct {
+	struct jpeg_error_mgr	mgr;
+	jmp_buf					jmp;
+} _jpeg_error_manager_s;
+
+
+static void _jpeg_set_dest_frame(j_compress_ptr jpeg, us_frame_s *frame);
+
+static void _jpeg_init_destination(j_compress_ptr jpeg);
+static boolean _jpeg_empty_output_buffer(j_compress_ptr jpeg);
+static void _jpeg_term_destination(j_compress_ptr jpeg);
+
+static void _jpeg_error_exit(j_common_ptr jpeg);
+
+
+#define _JPEG_OUTPUT_BUFFER_SIZE ((size_t)4096)
+
+
+int us_cpu_jpeg_compress(
+	const uint8_t *pixels, unsigned stride, unsigned width, unsigned height,
+	unsigned format, unsigned quality, us_frame_s *dest) {
+
+	int components;
+	J_COLOR_SPACE color_space;
+	unsigned bytes_per_pixel;
+	bool convert = false;
+	switch (format) {
+		// Minicap buffers are RGBA_8888 in memory, the capture path tags them
+		// as BGR32 (or its ABGR32/XBGR32 aliases) for the M2M encoder.
+		case V4L2_PIX_FMT_BGR32:
+		case V4L2_PIX_FMT_ABGR32:
+		case V4L2_PIX_FMT_XBGR32:
+#		ifdef JCS_EXTENSIONS
+			components = 4;
+			color_space = JCS_EXT_RGBX;
+#		else
+			components = 3;
+			color_space = JCS_RGB;
+			convert = true;
+#		endif
+			bytes_per_pixel = 4;
+			break;
+		case V4L2_PIX_FMT_RGB24:
+			components = 3;
+			color_space = JCS_RGB;
+			bytes_per_pixel = 3;
+			break;
+		default: {
+			char fourcc_str[8];
+			US_LOG_ERROR("CPU JPEG: unsupported input format %s", us_fourcc_to_string(format, fourcc_str, 8));
+			return -1;
+		}
+	}
+
+	// Allocated before setjmp(), so it survives longjmp() intact
+	uint8_t *const line_buf = (convert ? malloc(width * 3) : NULL);
+
+	struct jpeg_compress_struct jpeg;
+	_jpeg_error_manager_s jerr;
+
+	jpeg.err = jpeg_std_error(&jerr.mgr);
+	jerr.mgr.error_exit = _jpeg_error_exit;
+	if (setjmp(jerr.jmp)) {
+		jpeg_destroy_compress(&jpeg);
+		US_DELETE(line_buf, free);
+		return -1;
+	}
+	jpeg_create_compress(&jpeg);
+
+	_jpeg_set_dest_frame(&jpeg, dest);
+
+	jpeg.image_width = width;
+	jpeg.image_height = height;
+	jpeg.input_components = components;
+	jpeg.in_color_space = color_space;
+
+	jpeg_set_defaults(&jpeg);
+	jpeg_set_quality(&jpeg, quality, TRUE);
+	jpeg_start_compress(&jpeg, TRUE);
+
+	while (jpeg.next_scanline < height) {
+		const uint8_t *line = pixels + (size_t)jpeg.next_scanline * stride;
+		if (line_buf != NULL) {
+			for (unsigned x = 0; x < width; ++x) {
+				line_buf[x * 3] = line[x * bytes_per_pixel];
+				line_buf[x * 3 + 1] = line[x * bytes_per_pixel + 1];
+				line_buf[x * 3 + 2] = line[x * bytes_per_pixel + 2];
+			}
+			line = line_buf;
+		}
+		JSAMPROW row = (JSAMPROW)line;
+		jpeg_write_scanlines(&jpeg, &row, 1);
+	}
+
+	jpeg_finish_compress(&jpeg);
+	jpeg_destroy_compress(&jpeg);
+	US_DELETE(line_buf, free);
+	return 0;
+}
+
+static void _jpeg_set_dest_frame(j_compress_ptr jpeg, us_frame_s *frame) {
+	if (jpeg->dest == NULL) {
+		jpeg->dest = (struct jpeg_destination_mgr *)(*jpeg->mem->alloc_small)(
+			(j_common_ptr) jpeg, JPOOL_PERMANENT, sizeof(_jpeg_dest_manager_s));
+		assert(jpeg->dest != NULL);
+	}
+
+	_jpeg_dest_manager_s *const dest = (_jpeg_dest_manager_s *)jpeg->dest;
+	dest->mgr.init_destination = _jpeg_init_destination;
+	dest->mgr.empty_output_buffer = _jpeg_empty_output_buffer;
+	dest->mgr.term_destination = _jpeg_term_destination;
+	dest->frame = frame;
+}
+
+static void _jpeg_init_destination(j_compress_ptr jpeg) {
+	_jpeg_dest_manager_s *const dest = (_jpeg_dest_manager_s *)jpeg->dest;
+	us_frame_s *const frame = dest->frame;
+
+	us_frame_realloc_data(frame, frame->used + _JPEG_OUTPUT_BUFFER_SIZE);
+	dest->mgr.next_output_byte = frame->data + frame->used;
+	dest->mgr.free_in_buffer = frame->allocated - frame->used;
+}
+
+static boolean _jpeg_empty_output_buffer(j_compress_ptr jpeg) {
+	// Called when the whole buffer is full, so the frame grows twice
+	_jpeg_dest_manager_s *const dest = (_jpeg_dest_manager_s *)jpeg->dest;
+	us_frame_s *const frame = dest->frame;
+
+	frame->used = frame->allocated;
+	us_frame_realloc_data(frame, frame->allocated * 2);
+	dest->mgr.next_output_byte = frame->data + frame->used;
+	dest->mgr.free_in_buffer = frame->allocated - frame->used;
+	return TRUE;
+}
+
+static void _jpeg_term_destination(j_compress_ptr jpeg) {
+	_jpeg_dest_manager_s *const dest = (_jpeg_dest_manager_s *)jpeg->dest;
+	us_frame_s *const frame = dest->frame;
+
+	frame->used = dest->mgr.next_output_byte - frame->data;
+}
+
+static void _jpeg_error_exit(j_common_ptr jpeg) {
+	_jpeg_error_manager_s *const jerr = (_jpeg_error_manager_s *)jpeg->err;
+	char msg[JMSG_LENGTH_MAX];
+	(*jerr->mgr.format_message)(jpeg, msg);
+	US_LOG_ERROR("CPU JPEG error: %s", msg);
+	longjmp(jerr->jmp, -1);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include <linux/videodev2.h>
+
+#include "tools.h"
+#include "logging.h"
+#include "frame.h"
+
+
+// Software JPEG encoder (libjpeg) for sub-rectangles of raw frames.
+// The result is appended to dest starting at dest->used.
+int us_cpu_jpeg_compress(
+	const uint8_t *pixels, unsigned stride, unsigned width, unsigned height,
+	unsigned format, unsigned quality, us_frame_s *dest);
+
+#ifdef __cplusplus
+}
+#endif
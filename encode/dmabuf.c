@@ -0,0 +1,51 @@
+#include "dmabuf.h"
+
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+
+#include <linux/dma-buf.h>
+
+#include "xioctl.h"
+
+
+static void _dmabuf_sync(int fd, uint64_t flags);
+
+
+int us_dmabuf_map(us_dmabuf_map_s *map, int fd, size_t size) {
+	map->fd = -1;
+	map->data = NULL;
+	map->size = 0;
+
+	uint8_t *const data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		US_LOG_PERROR("Can't map DMA-BUF fd=%d", fd);
+		return -1;
+	}
+
+	map->fd = fd;
+	map->data = data;
+	map->size = size;
+	_dmabuf_sync(fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+	return 0;
+}
+
+void us_dmabuf_unmap(us_dmabuf_map_s *map) {
+	if (map->data != NULL) {
+		_dmabuf_sync(map->fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+		if (munmap(map->data, map->size) < 0) {
+			US_LOG_PERROR("Can't unmap DMA-BUF fd=%d", map->fd);
+		}
+	}
+	map->fd = -1;
+	map->data = NULL;
+	map->size = 0;
+}
+
+static void _dmabuf_sync(int fd, uint64_t flags) {
+	struct dma_buf_sync sync = {0};
+	sync.flags = flags;
+	if (us_xioctl(fd, DMA_BUF_IOCTL_SYNC, &sync) < 0) {
+		// Not every exporter implements it, the mapping is still usable
+		US_LOG_VERBOSE_PERROR("Can't sync DMA-BUF fd=%d", fd);
+	}
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "tools.h"
+#include "logging.h"
+
+
+typedef struct {
+	int		fd;
+	uint8_t	*data;
+	size_t	size;
+} us_dmabuf_map_s;
+
+
+// Maps a DMA-BUF for CPU reading and brackets the access with DMA_BUF_IOCTL_SYNC
+int us_dmabuf_map(us_dmabuf_map_s *map, int fd, size_t size);
+void us_dmabuf_unmap(us_dmabuf_map_s *map);
+
+#ifdef __cplusplus
+}
+#endif
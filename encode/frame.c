@@ -1,22 +1,151 @@
 #include "frame.h"
 
+#include <inttypes.h>
+
+
+static int _frame_pool_get_class(size_t size);
+
+
+us_frame_pool_s *us_frame_pool_init(const char *name, size_t max_idle) {
+	us_frame_pool_s *pool = calloc(1, sizeof(us_frame_pool_s));
+	pool->name = us_strdup(name);
+	pool->max_idle = max_idle;
+	US_MUTEX_INIT(pool->mutex);
+	return pool;
+}
+
+void us_frame_pool_destroy(us_frame_pool_s *pool) {
+	US_LOG_INFO("%s: Destroying frame pool: hits=%" PRIu64 ", heap=%" PRIu64 ", idle=%zu",
+		pool->name, pool->hits, pool->misses, pool->idle_bytes);
+	for (unsigned cls = 0; cls < US_FRAME_POOL_N_CLASSES; ++cls) {
+		for (unsigned index = 0; index < pool->n_idle[cls]; ++index) {
+			us_memory_free(pool->idle[cls][index], (size_t)1 << (US_FRAME_POOL_MIN_SHIFT + cls));
+		}
+	}
+	US_MUTEX_DESTROY(pool->mutex);
+	free(pool->name);
+	free(pool);
+}
+
+uint8_t *us_frame_pool_get(us_frame_pool_s *pool, size_t size, size_t *allocated) {
+	const int cls = _frame_pool_get_class(size);
+	uint8_t *data = NULL;
+
+	US_MUTEX_LOCK(pool->mutex);
+	if (cls >= 0 && pool->n_idle[cls] > 0) {
+		--pool->n_idle[cls];
+		data = pool->idle[cls][pool->n_idle[cls]];
+		pool->idle_bytes -= ((size_t)1 << (US_FRAME_POOL_MIN_SHIFT + cls));
+		++pool->hits;
+	} else {
+		++pool->misses;
+	}
+	US_MUTEX_UNLOCK(pool->mutex);
+
+	*allocated = (cls >= 0 ? (size_t)1 << (US_FRAME_POOL_MIN_SHIFT + cls) : size);
+	if (data == NULL) {
+		data = us_memory_alloc(*allocated);
+		assert(data != NULL);
+	}
+	return data;
+}
+
+void us_frame_pool_put(us_frame_pool_s *pool, uint8_t *data, size_t allocated) {
+	const int cls = _frame_pool_get_class(allocated);
+	if (cls >= 0 && ((size_t)1 << (US_FRAME_POOL_MIN_SHIFT + cls)) == allocated) {
+		US_MUTEX_LOCK(pool->mutex);
+		if (pool->n_idle[cls] < US_FRAME_POOL_DEPTH && pool->idle_bytes + allocated <= pool->max_idle) {
+			pool->idle[cls][pool->n_idle[cls]] = data;
+			++pool->n_idle[cls];
+			pool->idle_bytes += allocated;
+			data = NULL;
+		}
+		US_MUTEX_UNLOCK(pool->mutex);
+	}
+	us_memory_free(data, allocated);
+}
+
+void us_frame_pool_prefill(us_frame_pool_s *pool, size_t size, unsigned count) {
+	uint8_t *bufs[US_FRAME_POOL_DEPTH];
+	size_t allocated = 0;
+	count = us_min_u(count, US_FRAME_POOL_DEPTH);
+	for (unsigned index = 0; index < count; ++index) {
+		bufs[index] = us_frame_pool_get(pool, size, &allocated);
+	}
+	for (unsigned index = 0; index < count; ++index) {
+		us_frame_pool_put(pool, bufs[index], allocated);
+	}
+}
+
+void us_frame_pool_log_stats(us_frame_pool_s *pool) {
+	US_MUTEX_LOCK(pool->mutex);
+	const uint64_t hits = pool->hits;
+	const uint64_t misses = pool->misses;
+	const uint64_t new_misses = misses - pool->reported_misses;
+	const size_t idle_bytes = pool->idle_bytes;
+	pool->reported_misses = misses;
+	US_MUTEX_UNLOCK(pool->mutex);
+
+	if (new_misses > 0) {
+		US_LOG_INFO("%s: Frame pool: hits=%" PRIu64 ", heap=%" PRIu64 " (+%" PRIu64 "), idle=%zu",
+			pool->name, hits, misses, new_misses, idle_bytes);
+	}
+}
+
+static int _frame_pool_get_class(size_t size) {
+	for (int cls = 0; cls < US_FRAME_POOL_N_CLASSES; ++cls) {
+		if (size <= ((size_t)1 << (US_FRAME_POOL_MIN_SHIFT + cls))) {
+			return cls;
+		}
+	}
+	return -1;
+}
 
 us_frame_s *us_frame_init(void) {
-	us_frame_s *frame = calloc(1, sizeof(frame));
+	return us_frame_init_pooled(NULL);
+}
+
+us_frame_s *us_frame_init_pooled(us_frame_pool_s *pool) {
+	us_frame_s *frame = calloc(1, sizeof(us_frame_s));
+	frame->pool = pool;
 	us_frame_realloc_data(frame, 512 * 1024);
 	frame->dma_fd = -1;
 	return frame;
 }
 
 void us_frame_destroy(us_frame_s *frame) {
-	US_DELETE(frame->data, free);
+	us_frame_release_data(frame);
 	free(frame);
 }
 
+void us_frame_release_data(us_frame_s *frame) {
+	if (frame->data != NULL) {
+		if (frame->pool != NULL) {
+			us_frame_pool_put(frame->pool, frame->data, frame->allocated);
+		} else {
+			free(frame->data);
+		}
+		frame->data = NULL;
+	}
+	frame->used = 0;
+	frame->allocated = 0;
+}
+
 void us_frame_realloc_data(us_frame_s *frame, size_t size) {
 	if (frame->allocated < size) {
-		frame->data = realloc(frame->data, size);
-		frame->allocated = size;
+		if (frame->pool != NULL) {
+			size_t allocated;
+			uint8_t *data = us_frame_pool_get(frame->pool, size, &allocated);
+			if (frame->data != NULL) {
+				memcpy(data, frame->data, (frame->used < frame->allocated ? frame->used : frame->allocated));
+				us_frame_pool_put(frame->pool, frame->data, frame->allocated);
+			}
+			frame->data = data;
+			frame->allocated = allocated;
+		} else {
+			frame->data = realloc(frame->data, size);
+			frame->allocated = size;
+		}
 	}
 }
 
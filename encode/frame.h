@@ -11,16 +11,43 @@ extern "C" {
 #include <string.h>
 #include <assert.h>
 
+#include <pthread.h>
+
 #include <linux/videodev2.h>
 
 #include "tools.h"
 #include "logging.h"
+#include "threading.h"
+#include "memory.h"
+
+
+// Power-of-two size classes from 64Kb up to 16Mb, which covers JPEG and H.264
+// frames up to raw RGBA at 2K. Larger buffers go straight to the allocator.
+// Buffers are from us_memory_alloc(), so the big classes may be huge pages.
+#define US_FRAME_POOL_MIN_SHIFT		16
+#define US_FRAME_POOL_N_CLASSES		9
+#define US_FRAME_POOL_DEPTH			8
+
+typedef struct {
+	char			*name;
+	size_t			max_idle; // Idle memory above this cap is returned to the heap
+	pthread_mutex_t	mutex;
+
+	uint8_t			*idle[US_FRAME_POOL_N_CLASSES][US_FRAME_POOL_DEPTH];
+	unsigned		n_idle[US_FRAME_POOL_N_CLASSES];
+	size_t			idle_bytes;
+
+	uint64_t		hits;
+	uint64_t		misses; // Heap allocations
+	uint64_t		reported_misses;
+} us_frame_pool_s;
 
 typedef struct {
 	uint8_t		*data;
 	size_t		used;
 	size_t		allocated;
 	int			dma_fd;
+	us_frame_pool_s	*pool; // NULL for plain heap buffers
 
 	unsigned	width;
 	unsigned	height;
@@ -87,9 +114,27 @@ static inline void us_frame_encoding_end(us_frame_s *dest) {
 }
 
 
+us_frame_pool_s *us_frame_pool_init(const char *name, size_t max_idle);
+void us_frame_pool_destroy(us_frame_pool_s *pool);
+
+// Thread-safe. The buffer is at least size bytes, its real capacity goes to *allocated.
+uint8_t *us_frame_pool_get(us_frame_pool_s *pool, size_t size, size_t *allocated);
+void us_frame_pool_put(us_frame_pool_s *pool, uint8_t *data, size_t allocated);
+
+// Allocates buffers up front so they are faulted in before the first frame
+void us_frame_pool_prefill(us_frame_pool_s *pool, size_t size, unsigned count);
+
+// Logs only when there were heap allocations since the last call,
+// so a warmed up pipeline stays silent.
+void us_frame_pool_log_stats(us_frame_pool_s *pool);
+
 us_frame_s *us_frame_init(void);
+us_frame_s *us_frame_init_pooled(us_frame_pool_s *pool);
 void us_frame_destroy(us_frame_s *frame);
 
+// Gives the data back to the pool or to the heap, the frame itself stays for the next one
+void us_frame_release_data(us_frame_s *frame);
+
 void us_frame_realloc_data(us_frame_s *frame, size_t size);
 void us_frame_set_data(us_frame_s *frame, const uint8_t *data, size_t size);
 void us_frame_append_data(us_frame_s *frame, const uint8_t *data, size_t size);
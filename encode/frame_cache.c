@@ -0,0 +1,222 @@
+#include "frame_cache.h"
+
+#include <inttypes.h>
+
+
+// GCC and Clang vector extensions, NEON or SSE without per-architecture code
+typedef uint32_t _u32x4 __attribute__((vector_size(16)));
+
+#define _PRIME32_1	0x9E3779B1u
+#define _PRIME32_2	0x85EBCA77u
+#define _HASH_LANES	4 // Vectors per step, 64 bytes
+
+static _u32x4 _hash_load(const uint8_t *ptr);
+static _u32x4 _hash_round(_u32x4 acc, _u32x4 input);
+static uint64_t _hash_mix(uint64_t value);
+
+static us_frame_cache_entry_s *_frame_cache_find(
+	us_frame_cache_s *cache, uint64_t hash, const us_frame_s *src, unsigned quality);
+static void _frame_cache_evict(us_frame_cache_s *cache, us_frame_cache_entry_s *entry);
+static void _frame_cache_evict_oldest(us_frame_cache_s *cache);
+
+
+us_frame_cache_s *us_frame_cache_init(const char *name, unsigned capacity, size_t max_bytes, us_frame_pool_s *pool) {
+	US_LOG_INFO("%s: Initializing frame cache: capacity=%u, max_bytes=%zu ...", name, capacity, max_bytes);
+
+	assert(capacity > 0);
+	us_frame_cache_s *cache = calloc(1, sizeof(us_frame_cache_s));
+	cache->name = us_strdup(name);
+	cache->capacity = capacity;
+	cache->max_bytes = max_bytes;
+	cache->pool = pool;
+	// The frames are allocated once here, a put only takes the data from the pool
+	cache->entries = calloc(capacity, sizeof(us_frame_cache_entry_s));
+	for (unsigned index = 0; index < capacity; ++index) {
+		cache->entries[index].encoded.pool = pool;
+		cache->entries[index].encoded.dma_fd = -1;
+	}
+	US_MUTEX_INIT(cache->mutex);
+	return cache;
+}
+
+void us_frame_cache_destroy(us_frame_cache_s *cache) {
+	US_LOG_INFO("%s: Destroying frame cache: hits=%" PRIu64 ", misses=%" PRIu64 ", evictions=%" PRIu64,
+		cache->name, cache->hits, cache->misses, cache->evictions);
+	for (unsigned index = 0; index < cache->capacity; ++index) {
+		us_frame_release_data(&cache->entries[index].encoded);
+	}
+	US_MUTEX_DESTROY(cache->mutex);
+	free(cache->entries);
+	free(cache->name);
+	free(cache);
+}
+
+uint64_t us_frame_hash(const uint8_t *pixels, unsigned stride, unsigned row_size, unsigned height) {
+	_u32x4 acc[_HASH_LANES];
+	for (unsigned lane = 0; lane < _HASH_LANES; ++lane) {
+		const uint32_t seed = _PRIME32_1 * (lane * 4 + 1);
+		acc[lane] = (_u32x4){seed, seed + _PRIME32_2, seed ^ _PRIME32_2, seed - _PRIME32_1};
+	}
+	uint64_t tail = 0;
+
+	for (unsigned y = 0; y < height; ++y) {
+		const uint8_t *row = pixels + (size_t)y * stride;
+		unsigned x = 0;
+		// Independent lanes, so the multiplies of a step don't wait for each other
+		for (; x + 16 * _HASH_LANES <= row_size; x += 16 * _HASH_LANES) {
+			for (unsigned lane = 0; lane < _HASH_LANES; ++lane) {
+				acc[lane] = _hash_round(acc[lane], _hash_load(row + x + 16 * lane));
+			}
+		}
+		// Only rows that aren't a multiple of 16 pixels get here
+		for (; x < row_size; ++x) {
+			tail = (tail ^ row[x]) * 0x100000001B3ull;
+		}
+	}
+
+	uint64_t hash = _hash_mix(((uint64_t)row_size << 32) | height);
+	for (unsigned lane = 0; lane < _HASH_LANES; ++lane) {
+		for (unsigned index = 0; index < 4; ++index) {
+			hash = _hash_mix(hash ^ acc[lane][index]);
+		}
+	}
+	return _hash_mix(hash ^ tail);
+}
+
+bool us_frame_cache_get(us_frame_cache_s *cache, uint64_t hash, const us_frame_s *src, unsigned quality, us_frame_s *dest) {
+	US_MUTEX_LOCK(cache->mutex);
+	us_frame_cache_entry_s *const entry = _frame_cache_find(cache, hash, src, quality);
+	if (entry == NULL) {
+		++cache->misses;
+		US_MUTEX_UNLOCK(cache->mutex);
+		return false;
+	}
+	++cache->hits;
+	entry->last_used = ++cache->clock;
+
+	const us_frame_s *const encoded = &entry->encoded;
+	us_frame_set_data(dest, encoded->data, encoded->used);
+	dest->width = encoded->width;
+	dest->height = encoded->height;
+	dest->format = encoded->format;
+	dest->stride = encoded->stride;
+	dest->key = encoded->key;
+	US_MUTEX_UNLOCK(cache->mutex);
+	return true;
+}
+
+void us_frame_cache_put(
+	us_frame_cache_s *cache, uint64_t hash, const us_frame_s *src, unsigned quality, const us_frame_s *encoded) {
+
+	if (encoded->used == 0 || encoded->used > cache->max_bytes) {
+		return;
+	}
+
+	US_MUTEX_LOCK(cache->mutex);
+	us_frame_cache_entry_s *entry = _frame_cache_find(cache, hash, src, quality);
+	if (entry != NULL) {
+		_frame_cache_evict(cache, entry);
+	}
+	if (cache->n_entries >= cache->capacity) {
+		_frame_cache_evict_oldest(cache);
+	}
+	for (unsigned index = 0; index < cache->capacity; ++index) {
+		if (!cache->entries[index].busy) {
+			entry = &cache->entries[index];
+			break;
+		}
+	}
+	assert(entry != NULL);
+
+	// Sized to the bitstream, not to the 512Kb a new frame starts with. The byte limit
+	// is checked against what that took from the pool, as it is accounted.
+	us_frame_copy(encoded, &entry->encoded);
+	const size_t allocated = entry->encoded.allocated;
+	if (allocated > cache->max_bytes) {
+		us_frame_release_data(&entry->encoded);
+		US_MUTEX_UNLOCK(cache->mutex);
+		return;
+	}
+	while (cache->n_entries > 0 && cache->bytes + allocated > cache->max_bytes) {
+		_frame_cache_evict_oldest(cache);
+	}
+
+	entry->hash = hash;
+	entry->width = src->width;
+	entry->height = src->height;
+	entry->format = src->format;
+	entry->quality = quality;
+	entry->last_used = ++cache->clock;
+	entry->busy = true;
+	cache->bytes += allocated;
+	++cache->n_entries;
+	US_MUTEX_UNLOCK(cache->mutex);
+}
+
+void us_frame_cache_get_stats(us_frame_cache_s *cache, us_frame_cache_stats_s *stats) {
+	US_MUTEX_LOCK(cache->mutex);
+	stats->hits = cache->hits;
+	stats->misses = cache->misses;
+	stats->evictions = cache->evictions;
+	stats->entries = cache->n_entries;
+	stats->bytes = cache->bytes;
+	US_MUTEX_UNLOCK(cache->mutex);
+}
+
+static _u32x4 _hash_load(const uint8_t *ptr) {
+	_u32x4 value;
+	memcpy(&value, ptr, sizeof(value)); // Rows aren't always 16-byte aligned
+	return value;
+}
+
+static _u32x4 _hash_round(_u32x4 acc, _u32x4 input) {
+	acc += input * _PRIME32_2;
+	acc = (acc << 13) | (acc >> 19);
+	return acc * _PRIME32_1;
+}
+
+static uint64_t _hash_mix(uint64_t value) {
+	value ^= value >> 30;
+	value *= 0xBF58476D1CE4E5B9ull;
+	value ^= value >> 27;
+	value *= 0x94D049BB133111EBull;
+	return value ^ (value >> 31);
+}
+
+static us_frame_cache_entry_s *_frame_cache_find(
+	us_frame_cache_s *cache, uint64_t hash, const us_frame_s *src, unsigned quality) {
+
+	for (unsigned index = 0; index < cache->capacity; ++index) {
+		us_frame_cache_entry_s *const entry = &cache->entries[index];
+		if (
+			entry->busy
+			&& entry->hash == hash
+			&& entry->width == src->width
+			&& entry->height == src->height
+			&& entry->format == src->format
+			&& entry->quality == quality
+		) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static void _frame_cache_evict(us_frame_cache_s *cache, us_frame_cache_entry_s *entry) {
+	cache->bytes -= entry->encoded.allocated;
+	--cache->n_entries;
+	us_frame_release_data(&entry->encoded);
+	entry->busy = false;
+}
+
+static void _frame_cache_evict_oldest(us_frame_cache_s *cache) {
+	us_frame_cache_entry_s *oldest = NULL;
+	for (unsigned index = 0; index < cache->capacity; ++index) {
+		us_frame_cache_entry_s *const candidate = &cache->entries[index];
+		if (candidate->busy && (oldest == NULL || candidate->last_used < oldest->last_used)) {
+			oldest = candidate;
+		}
+	}
+	_frame_cache_evict(cache, oldest);
+	++cache->evictions;
+}
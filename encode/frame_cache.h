@@ -0,0 +1,78 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <pthread.h>
+
+#include "tools.h"
+#include "logging.h"
+#include "threading.h"
+#include "frame.h"
+
+
+// Encoded frames by the content of the captured frame they came from, so a screen that
+// comes back (home, navigation, media) is not encoded again. The least recently used
+// entry goes first once either limit is reached. Only for codecs where every frame stands
+// alone, a cached frame can't be spliced into a delta stream.
+typedef struct {
+	uint64_t	hash;
+	unsigned	width;
+	unsigned	height;
+	unsigned	format;
+	unsigned	quality;
+	uint64_t	last_used;
+	bool		busy;
+	us_frame_s	encoded; // Holds no data in a free slot
+} us_frame_cache_entry_s;
+
+typedef struct {
+	char			*name;
+	unsigned		capacity;
+	size_t			max_bytes;
+	us_frame_pool_s	*pool;
+	pthread_mutex_t	mutex;
+
+	us_frame_cache_entry_s	*entries;
+	unsigned		n_entries;
+	size_t			bytes; // Allocated by the cached frames
+	uint64_t		clock;
+
+	uint64_t		hits;
+	uint64_t		misses;
+	uint64_t		evictions;
+} us_frame_cache_s;
+
+typedef struct {
+	uint64_t	hits;
+	uint64_t	misses;
+	uint64_t	evictions;
+	unsigned	entries;
+	size_t		bytes;
+} us_frame_cache_stats_s;
+
+
+// A NULL pool keeps the cached frames on the plain heap
+us_frame_cache_s *us_frame_cache_init(const char *name, unsigned capacity, size_t max_bytes, us_frame_pool_s *pool);
+void us_frame_cache_destroy(us_frame_cache_s *cache);
+
+// Non-cryptographic 64-bit hash of row_size bytes from each row, the padding up to the
+// stride is left out. Sixteen 32-bit lanes in vector registers, about memory bandwidth.
+uint64_t us_frame_hash(const uint8_t *pixels, unsigned stride, unsigned row_size, unsigned height);
+
+// Thread-safe. The key is the hash with the size and format of src and the encoder quality.
+// On a hit dest gets the cached data, size, format and key flag, its timestamps are kept.
+bool us_frame_cache_get(us_frame_cache_s *cache, uint64_t hash, const us_frame_s *src, unsigned quality, us_frame_s *dest);
+void us_frame_cache_put(
+	us_frame_cache_s *cache, uint64_t hash, const us_frame_s *src, unsigned quality, const us_frame_s *encoded);
+
+void us_frame_cache_get_stats(us_frame_cache_s *cache, us_frame_cache_stats_s *stats);
+
+#ifdef __cplusplus
+}
+#endif
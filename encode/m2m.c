@@ -6,6 +6,12 @@ static us_m2m_encoder_s *_m2m_encoder_init(
 	unsigned fps, unsigned bitrate, unsigned gop, unsigned quality, bool allow_dma);
 
 static void _m2m_encoder_prepare(us_m2m_encoder_s *enc, const us_frame_s *frame);
+static int _m2m_encoder_set_controls(us_m2m_encoder_s *enc, unsigned mask);
+static void _m2m_encoder_set_low_latency(us_m2m_encoder_s *enc);
+static bool _m2m_encoder_try_set_option(us_m2m_encoder_s *enc, uint32_t cid, int value, const char *cid_name);
+static int _m2m_encoder_get_option_max(us_m2m_encoder_s *enc, uint32_t cid, int *value);
+static void _m2m_encoder_apply_pending_controls(us_m2m_encoder_s *enc, const us_frame_s *frame);
+static void _m2m_encoder_request_controls(us_m2m_encoder_s *enc, unsigned mask);
 
 static int _m2m_encoder_init_buffers(
 	us_m2m_encoder_s *enc, const char *name, enum v4l2_buf_type type,
@@ -24,6 +30,30 @@ static int _m2m_encoder_compress_raw(us_m2m_encoder_s *enc, const us_frame_s *sr
 
 #define _RUN(x_next) enc->run->x_next
 
+#define _DEV(x_op, ...)		enc->io->x_op(enc->io->ctx, ##__VA_ARGS__)
+#define _DEV_XIOCTL(...)		us_xioctl_with(enc->io->ioctl, enc->io->ctx, ##__VA_ARGS__)
+
+#define _CTL_BITRATE	((unsigned)1 << 0)
+#define _CTL_GOP		((unsigned)1 << 1)
+#define _CTL_QUALITY	((unsigned)1 << 2)
+#define _CTL_QP_RANGE	((unsigned)1 << 3)
+#define _CTL_VBV		((unsigned)1 << 4)
+#define _CTL_ALL		(_CTL_BITRATE | _CTL_GOP | _CTL_QUALITY | _CTL_QP_RANGE | _CTL_VBV)
+
+#define _TRY_SET_OPTION(x_cid, x_value) _m2m_encoder_try_set_option(enc, x_cid, x_value, #x_cid)
+
+
+static unsigned _m2m_mjpeg_quality_to_bitrate(unsigned quality) {
+	const double b_min = 25;
+	const double b_max = 20000;
+	const double step = 25;
+	double bitrate = log10(quality) * (b_max - b_min) / 2 + b_min;
+	bitrate = step * round(bitrate / step);
+	bitrate *= 1000; // From Kbps
+	assert(bitrate > 0);
+	return bitrate;
+}
+
 
 us_m2m_encoder_s *us_m2m_h264_encoder_init(const char *name, const char *path, unsigned bitrate, unsigned gop) {
 	// FIXME: 30 or 0? https://github.com/6by9/yavta/blob/master/yavta.c#L2100
@@ -33,16 +63,20 @@ us_m2m_encoder_s *us_m2m_h264_encoder_init(const char *name, const char *path, u
 	return _m2m_encoder_init(name, path, V4L2_PIX_FMT_H264, 30, bitrate, gop, 0, false);
 }
 
-us_m2m_encoder_s *us_m2m_mjpeg_encoder_init(const char *name, const char *path, unsigned quality) {
-	const double b_min = 25;
-	const double b_max = 20000;
-	const double step = 25;
-	double bitrate = log10(quality) * (b_max - b_min) / 2 + b_min;
-	bitrate = step * round(bitrate / step);
+us_m2m_encoder_s *us_m2m_h264_low_latency_encoder_init(const char *name, const char *path, unsigned bitrate, unsigned fps) {
 	bitrate *= 1000; // From Kbps
-	assert(bitrate > 0);
+	us_m2m_encoder_s *enc = _m2m_encoder_init(name, path, V4L2_PIX_FMT_H264, fps, bitrate, 0, 0, false);
+	enc->profile = US_M2M_PROFILE_LOW_LATENCY;
+	enc->intra_refresh_period = fps; // The whole picture is refreshed once per second
+	enc->slice_mb_rows = 4;
+	enc->min_qp = 20;
+	enc->max_qp = 40;
+	return enc;
+}
+
+us_m2m_encoder_s *us_m2m_mjpeg_encoder_init(const char *name, const char *path, unsigned quality) {
 	// FIXME: То же самое про 30 or 0, но еще даже не проверено на низких разрешениях
-	return _m2m_encoder_init(name, path, V4L2_PIX_FMT_MJPEG, 30, bitrate, 0, 0, true);
+	return _m2m_encoder_init(name, path, V4L2_PIX_FMT_MJPEG, 30, _m2m_mjpeg_quality_to_bitrate(quality), 0, quality, true);
 }
 
 us_m2m_encoder_s *us_m2m_jpeg_encoder_init(const char *name, const char *path, unsigned quality) {
@@ -53,11 +87,84 @@ us_m2m_encoder_s *us_m2m_jpeg_encoder_init(const char *name, const char *path, u
 void us_m2m_encoder_destroy(us_m2m_encoder_s *enc) {
 	_E_LOG_INFO("Destroying encoder ...");
 	_m2m_encoder_cleanup(enc);
+	if (enc->io->destroy != NULL) {
+		_DEV(destroy);
+	}
+	US_MUTEX_DESTROY(_RUN(ctl_mutex));
+	free(enc->run);
 	free(enc->path);
 	free(enc->name);
 	free(enc);
 }
 
+void us_m2m_encoder_set_io(us_m2m_encoder_s *enc, const us_m2m_io_s *io) {
+	_m2m_encoder_cleanup(enc);
+	if (enc->io->destroy != NULL) {
+		_DEV(destroy);
+	}
+	enc->io = io;
+}
+
+void us_m2m_encoder_set_quality(us_m2m_encoder_s *enc, unsigned quality) {
+	if (enc->output_format == V4L2_PIX_FMT_H264) {
+		_E_LOG_VERBOSE("Quality is not applicable to H264, use bitrate instead");
+		return;
+	}
+	US_MUTEX_LOCK(_RUN(ctl_mutex));
+	enc->quality = quality;
+	if (enc->output_format == V4L2_PIX_FMT_MJPEG) {
+		enc->bitrate = _m2m_mjpeg_quality_to_bitrate(quality);
+	}
+	US_MUTEX_UNLOCK(_RUN(ctl_mutex));
+	_m2m_encoder_request_controls(enc, (enc->output_format == V4L2_PIX_FMT_MJPEG ? _CTL_BITRATE : _CTL_QUALITY));
+}
+
+void us_m2m_encoder_set_bitrate(us_m2m_encoder_s *enc, unsigned bitrate) {
+	US_MUTEX_LOCK(_RUN(ctl_mutex));
+	enc->bitrate = bitrate * 1000; // From Kbps
+	US_MUTEX_UNLOCK(_RUN(ctl_mutex));
+	_m2m_encoder_request_controls(enc, _CTL_BITRATE);
+}
+
+void us_m2m_encoder_set_gop(us_m2m_encoder_s *enc, unsigned gop) {
+	US_MUTEX_LOCK(_RUN(ctl_mutex));
+	enc->gop = gop;
+	US_MUTEX_UNLOCK(_RUN(ctl_mutex));
+	_m2m_encoder_request_controls(enc, _CTL_GOP);
+}
+
+void us_m2m_encoder_set_qp_range(us_m2m_encoder_s *enc, unsigned min_qp, unsigned max_qp) {
+	assert(min_qp <= max_qp);
+	US_MUTEX_LOCK(_RUN(ctl_mutex));
+	enc->min_qp = min_qp;
+	enc->max_qp = max_qp;
+	US_MUTEX_UNLOCK(_RUN(ctl_mutex));
+	_m2m_encoder_request_controls(enc, _CTL_QP_RANGE);
+}
+
+void us_m2m_encoder_set_vbv_size(us_m2m_encoder_s *enc, unsigned vbv_size) {
+	US_MUTEX_LOCK(_RUN(ctl_mutex));
+	enc->vbv_size = vbv_size;
+	US_MUTEX_UNLOCK(_RUN(ctl_mutex));
+	_m2m_encoder_request_controls(enc, _CTL_VBV);
+}
+
+void us_m2m_encoder_force_key(us_m2m_encoder_s *enc) {
+	US_MUTEX_LOCK(_RUN(ctl_mutex));
+	_RUN(force_key_pending) = true;
+	US_MUTEX_UNLOCK(_RUN(ctl_mutex));
+}
+
+int us_m2m_encoder_warmup(us_m2m_encoder_s *enc, unsigned width, unsigned height, unsigned format, bool dma) {
+	us_frame_s frame = {0};
+	frame.width = width;
+	frame.height = height;
+	frame.format = format;
+	frame.dma_fd = (dma ? 0 : -1); // Only the sign matters for prepare
+	_m2m_encoder_prepare(enc, &frame);
+	return (_RUN(ready) ? 0 : -1);
+}
+
 int us_m2m_encoder_compress(us_m2m_encoder_s *enc, const us_frame_s *src, us_frame_s *dest, bool force_key) {
 	us_frame_encoding_begin(src, dest, (enc->output_format == V4L2_PIX_FMT_MJPEG ? V4L2_PIX_FMT_JPEG : enc->output_format));
 
@@ -74,6 +181,16 @@ int us_m2m_encoder_compress(us_m2m_encoder_s *enc, const us_frame_s *src, us_fra
 		return -1;
 	}
 
+	_m2m_encoder_apply_pending_controls(enc, src);
+	if (!_RUN(ready)) { // Live update failed and re-prepare failed too
+		return -1;
+	}
+
+	US_MUTEX_LOCK(_RUN(ctl_mutex));
+	force_key = (force_key || _RUN(force_key_pending));
+	_RUN(force_key_pending) = false;
+	US_MUTEX_UNLOCK(_RUN(ctl_mutex));
+
 	force_key = (enc->output_format == V4L2_PIX_FMT_H264 && (force_key || _RUN(last_online) != src->online));
 
 	if (_m2m_encoder_compress_raw(enc, src, dest, force_key) < 0) {
@@ -101,11 +218,19 @@ static us_m2m_encoder_s *_m2m_encoder_init(
 
 	run->last_online = -1;
 	run->fd = -1;
+	US_MUTEX_INIT(run->ctl_mutex);
 
 	us_m2m_encoder_s *enc = calloc(1, sizeof(us_m2m_encoder_s));
 	enc->name = us_strdup(name);
 	if (path == NULL) {
-		enc->path = us_strdup(output_format == V4L2_PIX_FMT_JPEG ? "/dev/video31" : "/dev/video11");
+		us_m2m_probe_s *probe = us_m2m_probe();
+		const us_m2m_device_s *dev = us_m2m_probe_select(probe, output_format, NULL, 0, 0, 0, NULL);
+		if (dev != NULL) {
+			enc->path = us_strdup(dev->path);
+		} else {
+			enc->path = us_strdup(output_format == V4L2_PIX_FMT_JPEG ? "/dev/video31" : "/dev/video11");
+		}
+		us_m2m_probe_destroy(probe);
 	} else {
 		enc->path = us_strdup(path);
 	}
@@ -114,13 +239,19 @@ static us_m2m_encoder_s *_m2m_encoder_init(
 	enc->bitrate = bitrate;
 	enc->gop = gop;
 	enc->quality = quality;
+	enc->min_qp = 16;
+	enc->max_qp = 32;
 	enc->allow_dma = allow_dma;
+	enc->io = &us_g_m2m_io_system;
+	if (!strncmp(enc->path, US_M2M_FAKE_PATH_PREFIX, strlen(US_M2M_FAKE_PATH_PREFIX))) {
+		enc->io = us_m2m_fake_init(enc->path + strlen(US_M2M_FAKE_PATH_PREFIX));
+	}
 	enc->run = run;
 	return enc;
 }
 
 #define _E_XIOCTL(x_request, x_value, x_msg, ...) { \
-		if (us_xioctl(_RUN(fd), x_request, x_value) < 0) { \
+		if (_DEV_XIOCTL(_RUN(fd), x_request, x_value) < 0) { \
 			_E_LOG_PERROR(x_msg, ##__VA_ARGS__); \
 			goto error; \
 		} \
@@ -128,6 +259,7 @@ static us_m2m_encoder_s *_m2m_encoder_init(
 
 static void _m2m_encoder_prepare(us_m2m_encoder_s *enc, const us_frame_s *frame) {
 	const bool dma = (enc->allow_dma && frame->dma_fd >= 0);
+	const long double prepare_begin_ts = us_get_now_monotonic();
 
 	_E_LOG_INFO("Configuring encoder: DMA=%d ...", dma);
 
@@ -139,7 +271,7 @@ static void _m2m_encoder_prepare(us_m2m_encoder_s *enc, const us_frame_s *frame)
 //	_RUN(stride) = frame->stride;
 	_RUN(dma) = dma;
 
-	if ((_RUN(fd) = open(enc->path, O_RDWR)) < 0) {
+	if ((_RUN(fd) = _DEV(open, enc->path, O_RDWR)) < 0) {
 		_E_LOG_PERROR("Can't open encoder device");
 		goto error;
 	}
@@ -153,9 +285,16 @@ static void _m2m_encoder_prepare(us_m2m_encoder_s *enc, const us_frame_s *frame)
 			_E_XIOCTL(VIDIOC_S_CTRL, &m_ctl, "Can't set option " #x_cid); \
 		}
 
+	// Everything pending is applied right here, so there is nothing left to do live
+	US_MUTEX_LOCK(_RUN(ctl_mutex));
+	_RUN(ctl_pending) = 0;
+	US_MUTEX_UNLOCK(_RUN(ctl_mutex));
+
+	if (_m2m_encoder_set_controls(enc, _CTL_ALL) < 0) {
+		goto error;
+	}
+
 	if (enc->output_format == V4L2_PIX_FMT_H264) {
-		SET_OPTION(V4L2_CID_MPEG_VIDEO_BITRATE,				enc->bitrate);
-		SET_OPTION(V4L2_CID_MPEG_VIDEO_H264_I_PERIOD,		enc->gop);
 		SET_OPTION(V4L2_CID_MPEG_VIDEO_H264_PROFILE,		V4L2_MPEG_VIDEO_H264_PROFILE_CONSTRAINED_BASELINE);
 		if (_RUN(width) * _RUN(height) <= 1920 * 1080) { // https://forums.raspberrypi.com/viewtopic.php?t=291447#p1762296
 			SET_OPTION(V4L2_CID_MPEG_VIDEO_H264_LEVEL,		V4L2_MPEG_VIDEO_H264_LEVEL_4_0);
@@ -163,12 +302,9 @@ static void _m2m_encoder_prepare(us_m2m_encoder_s *enc, const us_frame_s *frame)
 			SET_OPTION(V4L2_CID_MPEG_VIDEO_H264_LEVEL,		V4L2_MPEG_VIDEO_H264_LEVEL_5_1);
 		}
 		SET_OPTION(V4L2_CID_MPEG_VIDEO_REPEAT_SEQ_HEADER,	1);
-		SET_OPTION(V4L2_CID_MPEG_VIDEO_H264_MIN_QP,			16);
-		SET_OPTION(V4L2_CID_MPEG_VIDEO_H264_MAX_QP,			32);
-	} else if (enc->output_format == V4L2_PIX_FMT_MJPEG) {
-		SET_OPTION(V4L2_CID_MPEG_VIDEO_BITRATE,				enc->bitrate);
-	} else if (enc->output_format == V4L2_PIX_FMT_JPEG) {
-		SET_OPTION(V4L2_CID_JPEG_COMPRESSION_QUALITY,		enc->quality);
+		if (enc->profile == US_M2M_PROFILE_LOW_LATENCY) {
+			_m2m_encoder_set_low_latency(enc);
+		}
 	}
 
 #	undef SET_OPTION
@@ -242,6 +378,8 @@ static void _m2m_encoder_prepare(us_m2m_encoder_s *enc, const us_frame_s *frame)
 	}
 
 	_RUN(ready) = true;
+	_RUN(last_prepare_stall) = us_get_now_monotonic() - prepare_begin_ts;
+	_E_LOG_INFO("Encoder prepared in %.3Lf sec", _RUN(last_prepare_stall));
 	_E_LOG_DEBUG("Encoder state: *** READY ***");
 	return;
 
@@ -250,6 +388,141 @@ static void _m2m_encoder_prepare(us_m2m_encoder_s *enc, const us_frame_s *frame)
 		_E_LOG_ERROR("Encoder destroyed due an error (prepare)");
 }
 
+static int _m2m_encoder_set_controls(us_m2m_encoder_s *enc, unsigned mask) {
+	US_MUTEX_LOCK(_RUN(ctl_mutex));
+	const unsigned bitrate = enc->bitrate;
+	const unsigned gop = enc->gop;
+	const unsigned quality = enc->quality;
+	const unsigned min_qp = enc->min_qp;
+	const unsigned max_qp = enc->max_qp;
+	const unsigned vbv_size = enc->vbv_size;
+	US_MUTEX_UNLOCK(_RUN(ctl_mutex));
+
+#	define SET_OPTION(x_cid, x_value) { \
+			struct v4l2_control m_ctl = {0}; \
+			m_ctl.id = x_cid; \
+			m_ctl.value = x_value; \
+			_E_LOG_DEBUG("Configuring option " #x_cid "=%d ...", m_ctl.value); \
+			_E_XIOCTL(VIDIOC_S_CTRL, &m_ctl, "Can't set option " #x_cid); \
+		}
+
+	if (enc->output_format == V4L2_PIX_FMT_H264) {
+		if (mask & _CTL_BITRATE) {
+			SET_OPTION(V4L2_CID_MPEG_VIDEO_BITRATE,			bitrate);
+		}
+		if (mask & _CTL_GOP) {
+			int i_period = gop;
+			if (gop == 0 && enc->profile == US_M2M_PROFILE_LOW_LATENCY) {
+				// No periodic IDRs at all, keyframes are forced on demand
+				if (_m2m_encoder_get_option_max(enc, V4L2_CID_MPEG_VIDEO_H264_I_PERIOD, &i_period) < 0) {
+					goto error;
+				}
+			}
+			SET_OPTION(V4L2_CID_MPEG_VIDEO_H264_I_PERIOD,	i_period);
+		}
+		if (mask & _CTL_QP_RANGE) {
+			SET_OPTION(V4L2_CID_MPEG_VIDEO_H264_MIN_QP,		min_qp);
+			SET_OPTION(V4L2_CID_MPEG_VIDEO_H264_MAX_QP,		max_qp);
+		}
+		if ((mask & _CTL_VBV) && enc->profile == US_M2M_PROFILE_LOW_LATENCY) {
+			const unsigned fps = us_max_u(enc->fps, 1);
+			const unsigned size = (vbv_size > 0 ? vbv_size : us_max_u(bitrate / 8 / 1024 * 2 / fps, 1));
+			_TRY_SET_OPTION(V4L2_CID_MPEG_VIDEO_VBV_SIZE, size);
+		}
+	} else if (enc->output_format == V4L2_PIX_FMT_MJPEG) {
+		if (mask & _CTL_BITRATE) {
+			SET_OPTION(V4L2_CID_MPEG_VIDEO_BITRATE,			bitrate);
+		}
+	} else if (enc->output_format == V4L2_PIX_FMT_JPEG) {
+		if (mask & _CTL_QUALITY) {
+			SET_OPTION(V4L2_CID_JPEG_COMPRESSION_QUALITY,	quality);
+		}
+	}
+
+#	undef SET_OPTION
+
+	return 0;
+	error:
+		return -1;
+}
+
+static void _m2m_encoder_set_low_latency(us_m2m_encoder_s *enc) {
+	// Everything here is optional: drivers support different subsets,
+	// and the stream is still valid without any of them.
+	_TRY_SET_OPTION(V4L2_CID_MPEG_VIDEO_BITRATE_MODE, V4L2_MPEG_VIDEO_BITRATE_MODE_CBR);
+
+	const unsigned mb_width = (_RUN(width) + 15) / 16;
+	const unsigned mb_height = (_RUN(height) + 15) / 16;
+
+	if (enc->intra_refresh_period > 0) {
+		bool done = false;
+#		ifdef V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD
+		done = _TRY_SET_OPTION(V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD, enc->intra_refresh_period);
+#		endif
+		if (!done) {
+			const unsigned mbs = mb_width * mb_height;
+			_TRY_SET_OPTION(V4L2_CID_MPEG_VIDEO_CYCLIC_INTRA_REFRESH_MB,
+				(mbs + enc->intra_refresh_period - 1) / enc->intra_refresh_period);
+		}
+	}
+
+	if (enc->slice_mb_rows > 0 && enc->slice_mb_rows < mb_height) {
+		if (_TRY_SET_OPTION(V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MODE, V4L2_MPEG_VIDEO_MULTI_SLICE_MODE_MAX_MB)) {
+			_TRY_SET_OPTION(V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MAX_MB, mb_width * enc->slice_mb_rows);
+		}
+	}
+}
+
+static bool _m2m_encoder_try_set_option(us_m2m_encoder_s *enc, uint32_t cid, int value, const char *cid_name) {
+	struct v4l2_control ctl = {0};
+	ctl.id = cid;
+	ctl.value = value;
+	_E_LOG_DEBUG("Configuring optional option %s=%d ...", cid_name, value);
+	if (_DEV_XIOCTL(_RUN(fd), VIDIOC_S_CTRL, &ctl) < 0) {
+		_E_LOG_INFO("Optional option %s is not supported, ignored", cid_name);
+		return false;
+	}
+	return true;
+}
+
+static int _m2m_encoder_get_option_max(us_m2m_encoder_s *enc, uint32_t cid, int *value) {
+	struct v4l2_queryctrl query = {0};
+	query.id = cid;
+	_E_XIOCTL(VIDIOC_QUERYCTRL, &query, "Can't query option range");
+	*value = query.maximum;
+	return 0;
+	error:
+		return -1;
+}
+
+static void _m2m_encoder_request_controls(us_m2m_encoder_s *enc, unsigned mask) {
+	US_MUTEX_LOCK(_RUN(ctl_mutex));
+	_RUN(ctl_pending) |= mask;
+	US_MUTEX_UNLOCK(_RUN(ctl_mutex));
+}
+
+static void _m2m_encoder_apply_pending_controls(us_m2m_encoder_s *enc, const us_frame_s *frame) {
+	US_MUTEX_LOCK(_RUN(ctl_mutex));
+	const unsigned mask = _RUN(ctl_pending);
+	_RUN(ctl_pending) = 0;
+	US_MUTEX_UNLOCK(_RUN(ctl_mutex));
+
+	if (mask == 0) {
+		return;
+	}
+
+	const long double begin_ts = us_get_now_monotonic();
+	if (_m2m_encoder_set_controls(enc, mask) < 0) {
+		// Some drivers refuse to change controls while streaming
+		_E_LOG_INFO("Can't update controls live, falling back to full re-prepare ...");
+		_m2m_encoder_prepare(enc, frame);
+		_RUN(last_ctl_stall) = _RUN(last_prepare_stall);
+	} else {
+		_RUN(last_ctl_stall) = us_get_now_monotonic() - begin_ts;
+		_E_LOG_INFO("Controls updated live in %.3Lf sec", _RUN(last_ctl_stall));
+	}
+}
+
 static int _m2m_encoder_init_buffers(
 	us_m2m_encoder_s *enc, const char *name, enum v4l2_buf_type type,
 	us_m2m_buffer_s **bufs_ptr, unsigned *n_bufs_ptr, bool dma) {
@@ -286,8 +559,7 @@ static int _m2m_encoder_init_buffers(
 			_E_XIOCTL(VIDIOC_QUERYBUF, &buf, "Can't query %s buffer=%u", name, *n_bufs_ptr);
 
 			_E_LOG_DEBUG("Mapping %s buffer=%u ...", name, *n_bufs_ptr);
-			if (((*bufs_ptr)[*n_bufs_ptr].data = mmap(
-				NULL,
+			if (((*bufs_ptr)[*n_bufs_ptr].data = _DEV(mmap,
 				plane.length,
 				PROT_READ | PROT_WRITE,
 				MAP_SHARED,
@@ -315,7 +587,7 @@ static void _m2m_encoder_cleanup(us_m2m_encoder_s *enc) {
 #		define STOP_STREAM(x_name, x_type) { \
 				enum v4l2_buf_type m_type_var = x_type; \
 				_E_LOG_DEBUG("Stopping %s ...", x_name); \
-				if (us_xioctl(_RUN(fd), VIDIOC_STREAMOFF, &m_type_var) < 0) { \
+				if (_DEV_XIOCTL(_RUN(fd), VIDIOC_STREAMOFF, &m_type_var) < 0) { \
 					_E_LOG_PERROR("Can't stop %s", x_name); \
 				} \
 			}
@@ -330,7 +602,7 @@ static void _m2m_encoder_cleanup(us_m2m_encoder_s *enc) {
 		if (_RUN(x_target##_bufs) != NULL) { \
 			for (unsigned m_index = 0; m_index < _RUN(n_##x_target##_bufs); ++m_index) { \
 				if (_RUN(x_target##_bufs[m_index].allocated) > 0 && _RUN(x_target##_bufs[m_index].data) != NULL) { \
-					if (munmap(_RUN(x_target##_bufs[m_index].data), _RUN(x_target##_bufs[m_index].allocated)) < 0) { \
+					if (_DEV(munmap, _RUN(x_target##_bufs[m_index].data), _RUN(x_target##_bufs[m_index].allocated)) < 0) { \
 						_E_LOG_PERROR("Can't unmap %s buffer=%u", #x_name, m_index); \
 					} \
 				} \
@@ -347,7 +619,7 @@ static void _m2m_encoder_cleanup(us_m2m_encoder_s *enc) {
 #	undef DESTROY_BUFFERS
 
 	if (_RUN(fd) >= 0) {
-		if (close(_RUN(fd)) < 0) {
+		if (_DEV(close, _RUN(fd)) < 0) {
 			_E_LOG_PERROR("Can't close encoder device");
 		}
 		_RUN(fd) = -1;
@@ -422,7 +694,7 @@ static int _m2m_encoder_compress_raw(us_m2m_encoder_s *enc, const us_frame_s *sr
 		struct pollfd enc_poll = {_RUN(fd), POLLIN, 0};
 
 		_E_LOG_DEBUG("Polling encoder ...");
-		if (poll(&enc_poll, 1, 1000) < 0 && errno != EINTR) {
+		if (_DEV(poll, &enc_poll, 1, 1000) < 0 && errno != EINTR) {
 			_E_LOG_PERROR("Can't poll encoder");
 			goto error;
 		}
@@ -22,6 +22,9 @@ extern "C" {
 #include "logging.h"
 #include "frame.h"
 #include "xioctl.h"
+#include "m2m_io.h"
+#include "m2m_fake.h"
+#include "m2m_probe.h"
 
 
 typedef struct {
@@ -44,8 +47,20 @@ typedef struct {
 	bool			ready;
 
 	int				last_online;
+
+	pthread_mutex_t	ctl_mutex;
+	unsigned		ctl_pending;
+	bool			force_key_pending;
+	long double		last_ctl_stall;
+	long double		last_prepare_stall;
 } us_m2m_encoder_runtime_s;
 
+typedef enum {
+	US_M2M_PROFILE_DEFAULT = 0,
+	// H264 without periodic IDRs: cyclic intra refresh, multiple slices, CBR with a small VBV
+	US_M2M_PROFILE_LOW_LATENCY,
+} us_m2m_profile_e;
+
 typedef struct {
 	char			*name;
 	char			*path;
@@ -54,14 +69,24 @@ typedef struct {
 	unsigned		bitrate;
 	unsigned		gop;
 	unsigned		quality;
+	unsigned		min_qp;
+	unsigned		max_qp;
 	bool			allow_dma;
 
+	us_m2m_profile_e profile;
+	unsigned		intra_refresh_period;	// Frames per full intra refresh cycle
+	unsigned		slice_mb_rows;			// Macroblock rows per slice, 0 = one slice per frame
+	unsigned		vbv_size;				// In KB, 0 = two frames at the target bitrate
+
+	const us_m2m_io_s *io;
+
 	us_m2m_encoder_runtime_s *run;
 } us_m2m_encoder_s;
 
 typedef struct {
     us_m2m_encoder_s *h264_encoder;
     us_m2m_encoder_s *jpeg_encoder;
+    us_m2m_encoder_s *jpeg_lo_encoder; // The half size simulcast tier, NULL without it
 } us_encoder_set;
 
 typedef struct {
@@ -70,10 +95,28 @@ typedef struct {
 } us_encoded_frame_set;
 
 us_m2m_encoder_s *us_m2m_h264_encoder_init(const char *name, const char *path, unsigned bitrate, unsigned gop);
+us_m2m_encoder_s *us_m2m_h264_low_latency_encoder_init(const char *name, const char *path, unsigned bitrate, unsigned fps);
 us_m2m_encoder_s *us_m2m_mjpeg_encoder_init(const char *name, const char *path, unsigned quality);
 us_m2m_encoder_s *us_m2m_jpeg_encoder_init(const char *name, const char *path, unsigned quality);
 void us_m2m_encoder_destroy(us_m2m_encoder_s *enc);
 
+// Replaces the device backend, the encoder takes ownership of it.
+// A path like "fake:latency=5,garbage_first=1" selects the fake device as well.
+void us_m2m_encoder_set_io(us_m2m_encoder_s *enc, const us_m2m_io_s *io);
+
+// Thread-safe. Controls are applied with VIDIOC_S_CTRL on the encoder thread
+// right before the next frame; only geometry changes cause a full re-prepare.
+void us_m2m_encoder_set_quality(us_m2m_encoder_s *enc, unsigned quality);
+void us_m2m_encoder_set_bitrate(us_m2m_encoder_s *enc, unsigned bitrate);
+void us_m2m_encoder_set_gop(us_m2m_encoder_s *enc, unsigned gop);
+void us_m2m_encoder_set_qp_range(us_m2m_encoder_s *enc, unsigned min_qp, unsigned max_qp);
+void us_m2m_encoder_set_vbv_size(us_m2m_encoder_s *enc, unsigned vbv_size);
+void us_m2m_encoder_force_key(us_m2m_encoder_s *enc);
+
+// Prepares the device for the given geometry up front so the first frame
+// doesn't pay for it and an unusable encoder is detected at startup.
+int us_m2m_encoder_warmup(us_m2m_encoder_s *enc, unsigned width, unsigned height, unsigned format, bool dma);
+
 int us_m2m_encoder_compress(us_m2m_encoder_s *enc, const us_frame_s *src, us_frame_s *dest, bool force_key);
 
 #ifdef __cplusplus
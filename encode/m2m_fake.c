@@ -0,0 +1,473 @@
+#include "m2m_fake.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include <linux/videodev2.h>
+
+#include "frame.h"
+#include "cpu_jpeg.h"
+#include "dmabuf.h"
+
+
+#define _MAX_BUFS		4
+#define _MAX_RESULTS	4
+#define _OFFSET_CAPTURE	((unsigned)1 << 20)
+#define _OFFSET_STEP	((unsigned)1 << 12)
+
+
+typedef struct {
+	uint8_t		*data;
+	size_t		allocated;
+	size_t		used;
+	bool		queued;
+	uint64_t	ready_ts;
+	struct timeval timestamp;
+} _fake_buffer_s;
+
+typedef enum {
+	_RESULT_REAL,
+	_RESULT_GARBAGE,
+	_RESULT_MISMATCH,
+} _fake_result_e;
+
+typedef struct {
+	us_m2m_io_s				io;
+	us_m2m_fake_config_s	config;
+	int						fd;
+
+	unsigned				width;
+	unsigned				height;
+	unsigned				input_format;
+	unsigned				input_stride;
+	unsigned				output_format;
+	unsigned				quality;
+
+	_fake_buffer_s			inputs[_MAX_BUFS];
+	unsigned				n_inputs;
+	bool					inputs_dma;
+	_fake_buffer_s			outputs[_MAX_BUFS];
+	unsigned				n_outputs;
+
+	_fake_result_e			results[_MAX_RESULTS];
+	unsigned				n_results;
+	struct timeval			result_timestamp;
+	uint64_t				ready_ts;
+	us_frame_s				*encoded;
+	bool					produced;
+
+	unsigned long long		n_ioctls;
+	unsigned long long		n_frames;
+	long double				encode_time;
+} _fake_s;
+
+
+static int _fake_open(void *ctx, const char *path, int flags);
+static int _fake_close(void *ctx, int fd);
+static int _fake_ioctl(void *ctx, int fd, int request, void *arg);
+static int _fake_poll(void *ctx, struct pollfd *fds, nfds_t n_fds, int timeout);
+static void *_fake_mmap(void *ctx, size_t length, int prot, int flags, int fd, off_t offset);
+static int _fake_munmap(void *ctx, void *addr, size_t length);
+static void _fake_destroy(void *ctx);
+
+static int _fake_s_fmt(_fake_s *fake, struct v4l2_format *fmt);
+static int _fake_reqbufs(_fake_s *fake, struct v4l2_requestbuffers *req);
+static int _fake_querybuf(_fake_s *fake, struct v4l2_buffer *buf);
+static int _fake_qbuf(_fake_s *fake, struct v4l2_buffer *buf);
+static int _fake_dqbuf(_fake_s *fake, struct v4l2_buffer *buf);
+static int _fake_encode(_fake_s *fake, const uint8_t *pixels, size_t size);
+static void _fake_push_result(_fake_s *fake, _fake_result_e result);
+static void _fake_free_buffers(_fake_buffer_s *bufs, unsigned *n_bufs);
+
+static int _fake_fail(int error);
+
+
+const us_m2m_io_s *us_m2m_fake_init(const char *options) {
+	us_m2m_fake_config_s config = {0};
+	char *const opts = us_strdup(options);
+	char *saveptr = NULL;
+	for (char *opt = strtok_r(opts, ",", &saveptr); opt != NULL; opt = strtok_r(NULL, ",", &saveptr)) {
+		unsigned value = 0;
+#		define PARSE(x_name, x_dest) \
+			if (sscanf(opt, x_name "=%u", &value) == 1) { config.x_dest = value; continue; }
+		PARSE("latency", latency);
+		PARSE("garbage_first", garbage_first);
+		PARSE("ts_mismatch", ts_mismatch);
+		PARSE("eagain", eagain);
+#		undef PARSE
+		US_LOG_ERROR("fake: Unknown option: %s", opt);
+	}
+	free(opts);
+	return us_m2m_fake_init_config(&config);
+}
+
+const us_m2m_io_s *us_m2m_fake_init_config(const us_m2m_fake_config_s *config) {
+	US_LOG_INFO("fake: Initializing fake M2M device: latency=%u, garbage_first=%d, ts_mismatch=%u, eagain=%u ...",
+		config->latency, config->garbage_first, config->ts_mismatch, config->eagain);
+
+	_fake_s *fake = calloc(1, sizeof(_fake_s));
+	fake->config = *config;
+	fake->fd = -1;
+	fake->quality = 80;
+	fake->encoded = us_frame_init();
+
+	fake->io.open = _fake_open;
+	fake->io.close = _fake_close;
+	fake->io.ioctl = _fake_ioctl;
+	fake->io.poll = _fake_poll;
+	fake->io.mmap = _fake_mmap;
+	fake->io.munmap = _fake_munmap;
+	fake->io.destroy = _fake_destroy;
+	fake->io.ctx = fake;
+	return &fake->io;
+}
+
+static int _fake_open(void *ctx, UNUSED const char *path, UNUSED int flags) {
+	_fake_s *const fake = ctx;
+	if (fake->fd >= 0) {
+		return _fake_fail(EBUSY);
+	}
+	// A real descriptor, so nothing breaks if it leaks into a real syscall
+	fake->fd = eventfd(0, EFD_CLOEXEC);
+	return fake->fd;
+}
+
+static int _fake_close(void *ctx, int fd) {
+	_fake_s *const fake = ctx;
+	if (fd != fake->fd) {
+		return _fake_fail(EBADF);
+	}
+	_fake_free_buffers(fake->inputs, &fake->n_inputs);
+	_fake_free_buffers(fake->outputs, &fake->n_outputs);
+	fake->n_results = 0;
+	fake->produced = false;
+	fake->fd = -1;
+	return close(fd);
+}
+
+static int _fake_ioctl(void *ctx, int fd, int request, void *arg) {
+	_fake_s *const fake = ctx;
+	if (fd != fake->fd) {
+		return _fake_fail(EBADF);
+	}
+
+	++fake->n_ioctls;
+	if (fake->config.eagain > 0 && fake->n_ioctls % fake->config.eagain == 0) {
+		return _fake_fail(EAGAIN);
+	}
+
+	switch ((unsigned)request) {
+		case VIDIOC_S_FMT: return _fake_s_fmt(fake, arg);
+		case VIDIOC_REQBUFS: return _fake_reqbufs(fake, arg);
+		case VIDIOC_QUERYBUF: return _fake_querybuf(fake, arg);
+		case VIDIOC_QBUF: return _fake_qbuf(fake, arg);
+		case VIDIOC_DQBUF: return _fake_dqbuf(fake, arg);
+		case VIDIOC_S_PARM: return 0;
+
+		case VIDIOC_STREAMON:
+			if (*(enum v4l2_buf_type *)arg == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+				fake->produced = false;
+			}
+			return 0;
+
+		case VIDIOC_STREAMOFF:
+			if (*(enum v4l2_buf_type *)arg == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+				fake->n_results = 0;
+			}
+			return 0;
+
+		case VIDIOC_S_CTRL: {
+			const struct v4l2_control *const ctl = arg;
+			if (ctl->id == V4L2_CID_JPEG_COMPRESSION_QUALITY) {
+				fake->quality = ctl->value;
+			}
+			return 0;
+		}
+
+		case VIDIOC_QUERYCTRL: {
+			struct v4l2_queryctrl *const query = arg;
+			query->minimum = 0;
+			query->maximum = INT32_MAX;
+			query->step = 1;
+			return 0;
+		}
+
+		default: break;
+	}
+	return _fake_fail(ENOTTY);
+}
+
+static int _fake_poll(void *ctx, struct pollfd *fds, nfds_t n_fds, int timeout) {
+	_fake_s *const fake = ctx;
+	assert(n_fds == 1);
+	fds[0].revents = 0;
+
+	if (fake->n_results == 0) {
+		usleep((useconds_t)timeout * 1000);
+		return 0;
+	}
+
+	const uint64_t now = us_get_now_monotonic_u64();
+	if (fake->ready_ts > now) {
+		const uint64_t wait = fake->ready_ts - now;
+		if (timeout >= 0 && wait > (uint64_t)timeout * 1000) {
+			usleep((useconds_t)timeout * 1000);
+			return 0;
+		}
+		usleep(wait);
+	}
+	fds[0].revents = POLLIN;
+	return 1;
+}
+
+static void *_fake_mmap(void *ctx, UNUSED size_t length, UNUSED int prot, UNUSED int flags, int fd, off_t offset) {
+	_fake_s *const fake = ctx;
+	if (fd != fake->fd) {
+		errno = EBADF;
+		return MAP_FAILED;
+	}
+	_fake_buffer_s *bufs = fake->inputs;
+	unsigned n_bufs = fake->n_inputs;
+	if (offset >= _OFFSET_CAPTURE) {
+		offset -= _OFFSET_CAPTURE;
+		bufs = fake->outputs;
+		n_bufs = fake->n_outputs;
+	}
+	const unsigned index = offset / _OFFSET_STEP;
+	if (index >= n_bufs || bufs[index].data == NULL) {
+		errno = EINVAL;
+		return MAP_FAILED;
+	}
+	return bufs[index].data;
+}
+
+static int _fake_munmap(UNUSED void *ctx, UNUSED void *addr, UNUSED size_t length) {
+	return 0; // Buffers are owned by the device and freed on close or REQBUFS(0)
+}
+
+static void _fake_destroy(void *ctx) {
+	_fake_s *const fake = ctx;
+	US_LOG_INFO("fake: Destroying fake M2M device: ioctls=%llu, frames=%llu, avg_encode=%.3Lf",
+		fake->n_ioctls, fake->n_frames, (fake->n_frames > 0 ? fake->encode_time / fake->n_frames : 0));
+	if (fake->fd >= 0) {
+		_fake_close(fake, fake->fd);
+	}
+	us_frame_destroy(fake->encoded);
+	free(fake);
+}
+
+static int _fake_s_fmt(_fake_s *fake, struct v4l2_format *fmt) {
+	struct v4l2_pix_format_mplane *const pix = &fmt->fmt.pix_mp;
+	if (fmt->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) {
+		unsigned bpp;
+		switch (pix->pixelformat) {
+			case V4L2_PIX_FMT_BGR32:
+			case V4L2_PIX_FMT_ABGR32:
+			case V4L2_PIX_FMT_XBGR32: bpp = 4; break;
+			case V4L2_PIX_FMT_RGB24: bpp = 3; break;
+			default: return _fake_fail(EINVAL);
+		}
+		fake->width = pix->width;
+		fake->height = pix->height;
+		fake->input_format = pix->pixelformat;
+		fake->input_stride = pix->width * bpp;
+		pix->plane_fmt[0].bytesperline = fake->input_stride;
+		pix->plane_fmt[0].sizeimage = fake->input_stride * pix->height;
+		return 0;
+	} else if (fmt->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+		if (!us_is_jpeg(pix->pixelformat)) {
+			pix->pixelformat = V4L2_PIX_FMT_JPEG; // Like a real driver falling back to what it can do
+		}
+		fake->output_format = pix->pixelformat;
+		pix->plane_fmt[0].bytesperline = 0;
+		pix->plane_fmt[0].sizeimage = us_max_u(pix->plane_fmt[0].sizeimage, pix->width * pix->height * 4);
+		return 0;
+	}
+	return _fake_fail(EINVAL);
+}
+
+static int _fake_reqbufs(_fake_s *fake, struct v4l2_requestbuffers *req) {
+	const bool capture = (req->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+	_fake_buffer_s *const bufs = (capture ? fake->outputs : fake->inputs);
+	unsigned *const n_bufs = (capture ? &fake->n_outputs : &fake->n_inputs);
+
+	_fake_free_buffers(bufs, n_bufs);
+	if (req->count == 0) {
+		return 0;
+	}
+
+	req->count = us_min_u(req->count, _MAX_BUFS);
+	const size_t size = (size_t)fake->width * fake->height * 4;
+	for (unsigned index = 0; index < req->count; ++index) {
+		if (req->memory == V4L2_MEMORY_MMAP) {
+			bufs[index].data = calloc(1, size);
+			if (bufs[index].data == NULL) {
+				*n_bufs = index;
+				_fake_free_buffers(bufs, n_bufs);
+				return _fake_fail(ENOMEM);
+			}
+			bufs[index].allocated = size;
+		}
+	}
+	*n_bufs = req->count;
+	if (!capture) {
+		fake->inputs_dma = (req->memory == V4L2_MEMORY_DMABUF);
+	}
+	return 0;
+}
+
+static int _fake_querybuf(_fake_s *fake, struct v4l2_buffer *buf) {
+	const bool capture = (buf->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+	_fake_buffer_s *const bufs = (capture ? fake->outputs : fake->inputs);
+	if (buf->index >= (capture ? fake->n_outputs : fake->n_inputs)) {
+		return _fake_fail(EINVAL);
+	}
+	buf->m.planes[0].length = bufs[buf->index].allocated;
+	buf->m.planes[0].m.mem_offset = (capture ? _OFFSET_CAPTURE : 0) + buf->index * _OFFSET_STEP;
+	return 0;
+}
+
+static int _fake_qbuf(_fake_s *fake, struct v4l2_buffer *buf) {
+	const bool capture = (buf->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+	_fake_buffer_s *const bufs = (capture ? fake->outputs : fake->inputs);
+	if (buf->index >= (capture ? fake->n_outputs : fake->n_inputs)) {
+		return _fake_fail(EINVAL);
+	}
+	_fake_buffer_s *const b = &bufs[buf->index];
+	if (b->queued) {
+		return _fake_fail(EINVAL);
+	}
+	b->queued = true;
+	b->ready_ts = 0;
+
+	const size_t used = buf->m.planes[0].bytesused;
+	if (capture || used == 0) {
+		return 0; // Empty INPUT buffers are just returned to the driver
+	}
+
+	int retval;
+	if (fake->inputs_dma) {
+		us_dmabuf_map_s map;
+		if (us_dmabuf_map(&map, buf->m.planes[0].m.fd, used) < 0) {
+			b->queued = false;
+			return -1;
+		}
+		retval = _fake_encode(fake, map.data, used);
+		us_dmabuf_unmap(&map);
+	} else {
+		retval = _fake_encode(fake, b->data, us_min_u(used, b->allocated));
+	}
+	if (retval < 0) {
+		b->queued = false;
+		return _fake_fail(EIO);
+	}
+
+	fake->result_timestamp = buf->timestamp;
+	fake->ready_ts = us_get_now_monotonic_u64() + (uint64_t)fake->config.latency * 1000;
+	b->ready_ts = fake->ready_ts;
+
+	if (fake->config.garbage_first && !fake->produced) {
+		_fake_push_result(fake, _RESULT_GARBAGE);
+	}
+	if (fake->config.ts_mismatch > 0 && fake->n_frames % fake->config.ts_mismatch == 0) {
+		_fake_push_result(fake, _RESULT_MISMATCH);
+	}
+	_fake_push_result(fake, _RESULT_REAL);
+	fake->produced = true;
+	return 0;
+}
+
+static int _fake_dqbuf(_fake_s *fake, struct v4l2_buffer *buf) {
+	const uint64_t now = us_get_now_monotonic_u64();
+
+	if (buf->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) {
+		for (unsigned index = 0; index < fake->n_inputs; ++index) {
+			if (fake->inputs[index].queued && fake->inputs[index].ready_ts <= now) {
+				fake->inputs[index].queued = false;
+				buf->index = index;
+				return 0;
+			}
+		}
+		return _fake_fail(EAGAIN);
+	}
+
+	if (fake->n_results == 0 || fake->ready_ts > now) {
+		return _fake_fail(EAGAIN);
+	}
+	unsigned index = 0;
+	for (; index < fake->n_outputs && !fake->outputs[index].queued; ++index);
+	if (index >= fake->n_outputs) {
+		return _fake_fail(EAGAIN);
+	}
+
+	_fake_buffer_s *const b = &fake->outputs[index];
+	const _fake_result_e result = fake->results[0];
+	memmove(fake->results, fake->results + 1, (fake->n_results - 1) * sizeof(_fake_result_e));
+	--fake->n_results;
+
+	b->queued = false;
+	b->timestamp = fake->result_timestamp;
+	switch (result) {
+		case _RESULT_GARBAGE:
+			b->used = us_min_u(4096, b->allocated);
+			for (size_t offset = 0; offset < b->used; ++offset) {
+				b->data[offset] = us_triple_u32(offset);
+			}
+			b->timestamp.tv_sec = 0;
+			b->timestamp.tv_usec = 0;
+			break;
+		case _RESULT_MISMATCH:
+		case _RESULT_REAL:
+			b->used = us_min_u(fake->encoded->used, b->allocated);
+			memcpy(b->data, fake->encoded->data, b->used);
+			if (result == _RESULT_MISMATCH) {
+				b->timestamp.tv_sec -= 1;
+			}
+			break;
+	}
+
+	buf->index = index;
+	buf->flags = V4L2_BUF_FLAG_KEYFRAME;
+	buf->timestamp = b->timestamp;
+	buf->m.planes[0].bytesused = b->used;
+	return 0;
+}
+
+static int _fake_encode(_fake_s *fake, const uint8_t *pixels, size_t size) {
+	if (size < (size_t)fake->input_stride * fake->height) {
+		US_LOG_ERROR("fake: Too small INPUT buffer: %zu", size);
+		return -1;
+	}
+	const long double begin_ts = us_get_now_monotonic();
+	fake->encoded->used = 0;
+	if (us_cpu_jpeg_compress(
+		pixels, fake->input_stride, fake->width, fake->height,
+		fake->input_format, fake->quality, fake->encoded) < 0) {
+		return -1;
+	}
+	fake->encode_time += us_get_now_monotonic() - begin_ts;
+	++fake->n_frames;
+	return 0;
+}
+
+static void _fake_push_result(_fake_s *fake, _fake_result_e result) {
+	assert(fake->n_results < _MAX_RESULTS);
+	fake->results[fake->n_results] = result;
+	++fake->n_results;
+}
+
+static void _fake_free_buffers(_fake_buffer_s *bufs, unsigned *n_bufs) {
+	for (unsigned index = 0; index < *n_bufs; ++index) {
+		US_DELETE(bufs[index].data, free);
+		memset(&bufs[index], 0, sizeof(_fake_buffer_s));
+	}
+	*n_bufs = 0;
+}
+
+static int _fake_fail(int error) {
+	errno = error;
+	return -1;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+#include "tools.h"
+#include "logging.h"
+#include "m2m_io.h"
+
+
+#define US_M2M_FAKE_PATH_PREFIX "fake:"
+
+
+// In-process M2M JPEG encoder backed by libjpeg, for running and measuring
+// the encoder state machine without hardware. Knobs are set from a string
+// like "latency=5,garbage_first=1,ts_mismatch=10,eagain=7".
+typedef struct {
+	unsigned	latency;			// Msecs between QBUF and the result being pollable
+	bool		garbage_first;		// The first result after STREAMON is junk with a zero timestamp
+	unsigned	ts_mismatch;		// Every Nth frame is preceded by a result with a wrong timestamp
+	unsigned	eagain;				// Every Nth ioctl fails with EAGAIN
+} us_m2m_fake_config_s;
+
+
+const us_m2m_io_s *us_m2m_fake_init(const char *options);
+const us_m2m_io_s *us_m2m_fake_init_config(const us_m2m_fake_config_s *config);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,44 @@
+#include "m2m_io.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+
+
+static int _io_open(UNUSED void *ctx, const char *path, int flags) {
+	return open(path, flags);
+}
+
+static int _io_close(UNUSED void *ctx, int fd) {
+	return close(fd);
+}
+
+static int _io_ioctl(UNUSED void *ctx, int fd, int request, void *arg) {
+	return ioctl(fd, request, arg);
+}
+
+static int _io_poll(UNUSED void *ctx, struct pollfd *fds, nfds_t n_fds, int timeout) {
+	return poll(fds, n_fds, timeout);
+}
+
+static void *_io_mmap(UNUSED void *ctx, size_t length, int prot, int flags, int fd, off_t offset) {
+	return mmap(NULL, length, prot, flags, fd, offset);
+}
+
+static int _io_munmap(UNUSED void *ctx, void *addr, size_t length) {
+	return munmap(addr, length);
+}
+
+
+const us_m2m_io_s us_g_m2m_io_system = {
+	.open = _io_open,
+	.close = _io_close,
+	.ioctl = _io_ioctl,
+	.poll = _io_poll,
+	.mmap = _io_mmap,
+	.munmap = _io_munmap,
+	.destroy = NULL,
+	.ctx = NULL,
+};
@@ -0,0 +1,35 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <poll.h>
+
+#include <sys/types.h>
+
+#include "tools.h"
+#include "xioctl.h"
+
+
+// Everything the M2M encoder does with its device goes through this table,
+// so the device can be replaced with an in-process one (see m2m_fake.h).
+typedef struct {
+	int		(*open)(void *ctx, const char *path, int flags);
+	int		(*close)(void *ctx, int fd);
+	us_ioctl_f ioctl;
+	int		(*poll)(void *ctx, struct pollfd *fds, nfds_t n_fds, int timeout);
+	void	*(*mmap)(void *ctx, size_t length, int prot, int flags, int fd, off_t offset);
+	int		(*munmap)(void *ctx, void *addr, size_t length);
+	void	(*destroy)(void *ctx); // Optional, called when the encoder is destroyed
+
+	void	*ctx;
+} us_m2m_io_s;
+
+
+extern const us_m2m_io_s us_g_m2m_io_system;
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,228 @@
+#include "m2m_probe.h"
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "xioctl.h"
+
+
+static bool _probe_device(const char *path, us_m2m_device_s *dev);
+static unsigned _probe_formats(int fd, enum v4l2_buf_type type, bool compressed, unsigned *formats);
+static void _probe_max_size(int fd, const us_m2m_device_s *dev, unsigned *width, unsigned *height);
+static bool _probe_control(int fd, uint32_t cid);
+static bool _probe_dma_import(int fd);
+static void _probe_log_device(const us_m2m_device_s *dev);
+static bool _has_format(const unsigned *formats, unsigned n_formats, unsigned format);
+
+
+us_m2m_probe_s *us_m2m_probe(void) {
+	const long double begin_ts = us_get_now_monotonic();
+	us_m2m_probe_s *probe = calloc(1, sizeof(us_m2m_probe_s));
+
+	for (unsigned index = 0; index < US_M2M_PROBE_MAX_DEVICES; ++index) {
+		char path[32];
+		snprintf(path, sizeof(path), "/dev/video%u", index);
+		if (access(path, F_OK) < 0) {
+			continue;
+		}
+		us_m2m_device_s *const dev = &probe->devices[probe->n_devices];
+		if (_probe_device(path, dev)) {
+			_probe_log_device(dev);
+			++probe->n_devices;
+		}
+	}
+
+	US_LOG_INFO("Found %u M2M encoder(s) in %.3Lf sec", probe->n_devices, us_get_now_monotonic() - begin_ts);
+	return probe;
+}
+
+void us_m2m_probe_destroy(us_m2m_probe_s *probe) {
+	free(probe);
+}
+
+const us_m2m_device_s *us_m2m_probe_select(
+	const us_m2m_probe_s *probe, unsigned output_format,
+	const unsigned *input_formats, unsigned n_input_formats,
+	unsigned width, unsigned height, unsigned *input_format) {
+
+	const us_m2m_device_s *best = NULL;
+	unsigned best_score = 0;
+
+	for (unsigned index = 0; index < probe->n_devices; ++index) {
+		const us_m2m_device_s *const dev = &probe->devices[index];
+
+		if (!_has_format(dev->output_formats, dev->n_output_formats, output_format)) {
+			continue;
+		}
+		// The encoder can't be configured without its rate control
+		if (output_format == V4L2_PIX_FMT_JPEG ? !dev->has_jpeg_quality : !dev->has_bitrate) {
+			continue;
+		}
+		if (dev->max_width > 0 && width > 0 && (width > dev->max_width || height > dev->max_height)) {
+			continue;
+		}
+
+		unsigned format = 0;
+		unsigned rank = 0;
+		if (input_formats == NULL) {
+			format = (dev->n_input_formats > 0 ? dev->input_formats[0] : 0);
+		} else {
+			for (; rank < n_input_formats; ++rank) {
+				if (_has_format(dev->input_formats, dev->n_input_formats, input_formats[rank])) {
+					format = input_formats[rank];
+					break;
+				}
+			}
+		}
+		if (format == 0) {
+			continue;
+		}
+
+		// Zero-copy first, then the input format preference
+		const unsigned score = (dev->dma_import ? 1000 : 0) + (US_M2M_PROBE_MAX_FORMATS - rank);
+		if (score > best_score) {
+			best = dev;
+			best_score = score;
+			if (input_format != NULL) {
+				*input_format = format;
+			}
+		}
+	}
+
+	if (best != NULL) {
+		char fourcc_str[8];
+		US_LOG_INFO("Selected M2M encoder %s (%s) for %s", best->path, best->card,
+			us_fourcc_to_string(output_format, fourcc_str, 8));
+	}
+	return best;
+}
+
+static bool _probe_device(const char *path, us_m2m_device_s *dev) {
+	memset(dev, 0, sizeof(us_m2m_device_s));
+
+	const int fd = open(path, O_RDWR | O_NONBLOCK);
+	if (fd < 0) {
+		US_LOG_VERBOSE_PERROR("Can't open %s for probing", path);
+		return false;
+	}
+
+	bool ok = false;
+	struct v4l2_capability cap = {0};
+	if (us_xioctl(fd, VIDIOC_QUERYCAP, &cap) < 0) {
+		US_LOG_VERBOSE_PERROR("Can't query capabilities of %s", path);
+		goto done;
+	}
+	const uint32_t caps = ((cap.capabilities & V4L2_CAP_DEVICE_CAPS) ? cap.device_caps : cap.capabilities);
+	if (!(caps & V4L2_CAP_VIDEO_M2M_MPLANE) || !(caps & V4L2_CAP_STREAMING)) {
+		goto done;
+	}
+
+	snprintf(dev->path, sizeof(dev->path), "%s", path);
+	snprintf(dev->card, sizeof(dev->card), "%s", (const char *)cap.card);
+
+	// Decoders are M2M too, but their CAPTURE side is raw
+	dev->n_output_formats = _probe_formats(fd, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, true, dev->output_formats);
+	if (dev->n_output_formats == 0) {
+		goto done;
+	}
+	dev->n_input_formats = _probe_formats(fd, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, false, dev->input_formats);
+
+	_probe_max_size(fd, dev, &dev->max_width, &dev->max_height);
+	dev->has_bitrate = _probe_control(fd, V4L2_CID_MPEG_VIDEO_BITRATE);
+	dev->has_jpeg_quality = _probe_control(fd, V4L2_CID_JPEG_COMPRESSION_QUALITY);
+	dev->dma_import = _probe_dma_import(fd);
+	ok = true;
+
+	done:
+		close(fd);
+		return ok;
+}
+
+static unsigned _probe_formats(int fd, enum v4l2_buf_type type, bool compressed, unsigned *formats) {
+	unsigned count = 0;
+	for (unsigned index = 0; count < US_M2M_PROBE_MAX_FORMATS; ++index) {
+		struct v4l2_fmtdesc desc = {0};
+		desc.index = index;
+		desc.type = type;
+		if (us_xioctl(fd, VIDIOC_ENUM_FMT, &desc) < 0) {
+			break;
+		}
+		if (!!(desc.flags & V4L2_FMT_FLAG_COMPRESSED) == compressed) {
+			formats[count] = desc.pixelformat;
+			++count;
+		}
+	}
+	return count;
+}
+
+static void _probe_max_size(int fd, const us_m2m_device_s *dev, unsigned *width, unsigned *height) {
+	*width = 0;
+	*height = 0;
+	for (unsigned index = 0;; ++index) {
+		struct v4l2_frmsizeenum size = {0};
+		size.index = index;
+		size.pixel_format = dev->output_formats[0];
+		if (us_xioctl(fd, VIDIOC_ENUM_FRAMESIZES, &size) < 0) {
+			break;
+		}
+		if (size.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+			*width = us_max_u(*width, size.discrete.width);
+			*height = us_max_u(*height, size.discrete.height);
+		} else {
+			*width = size.stepwise.max_width;
+			*height = size.stepwise.max_height;
+			break;
+		}
+	}
+}
+
+static bool _probe_control(int fd, uint32_t cid) {
+	struct v4l2_queryctrl query = {0};
+	query.id = cid;
+	return (us_xioctl(fd, VIDIOC_QUERYCTRL, &query) == 0 && !(query.flags & V4L2_CTRL_FLAG_DISABLED));
+}
+
+static bool _probe_dma_import(int fd) {
+	// Zero buffers allocates nothing but still validates the memory type
+	struct v4l2_requestbuffers req = {0};
+	req.count = 0;
+	req.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	req.memory = V4L2_MEMORY_DMABUF;
+	if (us_xioctl(fd, VIDIOC_REQBUFS, &req) < 0) {
+		return false;
+	}
+#	ifdef V4L2_BUF_CAP_SUPPORTS_DMABUF
+	if (req.capabilities != 0) {
+		return (req.capabilities & V4L2_BUF_CAP_SUPPORTS_DMABUF);
+	}
+#	endif
+	return true;
+}
+
+static void _probe_log_device(const us_m2m_device_s *dev) {
+	char in_str[US_M2M_PROBE_MAX_FORMATS * 8] = {0};
+	char out_str[US_M2M_PROBE_MAX_FORMATS * 8] = {0};
+	char fourcc_str[8];
+	for (unsigned index = 0; index < dev->n_input_formats; ++index) {
+		strcat(in_str, us_fourcc_to_string(dev->input_formats[index], fourcc_str, 8));
+		strcat(in_str, " ");
+	}
+	for (unsigned index = 0; index < dev->n_output_formats; ++index) {
+		strcat(out_str, us_fourcc_to_string(dev->output_formats[index], fourcc_str, 8));
+		strcat(out_str, " ");
+	}
+	US_LOG_INFO("Found M2M encoder %s (%s): in=[ %s], out=[ %s], max=%ux%u, dma=%s, bitrate=%s, quality=%s",
+		dev->path, dev->card, in_str, out_str, dev->max_width, dev->max_height,
+		us_bool_to_string(dev->dma_import), us_bool_to_string(dev->has_bitrate),
+		us_bool_to_string(dev->has_jpeg_quality));
+}
+
+static bool _has_format(const unsigned *formats, unsigned n_formats, unsigned format) {
+	for (unsigned index = 0; index < n_formats; ++index) {
+		if (formats[index] == format) {
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <linux/videodev2.h>
+
+#include "tools.h"
+#include "logging.h"
+#include "frame.h"
+
+
+#define US_M2M_PROBE_MAX_DEVICES	64
+#define US_M2M_PROBE_MAX_FORMATS	32
+
+
+typedef struct {
+	char		path[32];
+	char		card[32];
+
+	unsigned	input_formats[US_M2M_PROBE_MAX_FORMATS]; // Raw, the OUTPUT queue
+	unsigned	n_input_formats;
+	unsigned	output_formats[US_M2M_PROBE_MAX_FORMATS]; // Compressed, the CAPTURE queue
+	unsigned	n_output_formats;
+
+	unsigned	max_width; // 0 if the driver doesn't report frame sizes
+	unsigned	max_height;
+	bool		dma_import;
+	bool		has_bitrate;
+	bool		has_jpeg_quality;
+} us_m2m_device_s;
+
+typedef struct {
+	us_m2m_device_s	devices[US_M2M_PROBE_MAX_DEVICES];
+	unsigned		n_devices;
+} us_m2m_probe_s;
+
+
+// Scans /dev/video* for M2M encoders with QUERYCAP, ENUM_FMT, ENUM_FRAMESIZES and QUERYCTRL
+us_m2m_probe_s *us_m2m_probe(void);
+void us_m2m_probe_destroy(us_m2m_probe_s *probe);
+
+// Picks the device that can produce output_format from the earliest possible
+// input format at the given resolution, preferring DMA import.
+// NULL input_formats means any; zero width/height skips the size check.
+const us_m2m_device_s *us_m2m_probe_select(
+	const us_m2m_probe_s *probe, unsigned output_format,
+	const unsigned *input_formats, unsigned n_input_formats,
+	unsigned width, unsigned height, unsigned *input_format);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,131 @@
+#include "memory.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+
+#include <sys/mman.h>
+
+// Pinned to 2Mb pages instead of the default huge page size, which is 1Gb or 512Mb on
+// some kernels, so mapped lengths stay multiples of the page size and munmap() takes them.
+// The pages are reserved in /sys/kernel/mm/hugepages/hugepages-2048kB/nr_hugepages.
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT) && !defined(MAP_HUGE_2MB)
+#	define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+
+
+typedef enum {
+	_BACKING_NONE = 0,
+	_BACKING_HUGETLB,
+	_BACKING_THP,
+	_BACKING_PAGES,
+} _backing_e;
+
+
+unsigned us_g_memory_flags = 0;
+
+static _backing_e _g_reported_backing = _BACKING_NONE;
+static bool _g_lock_failed = false;
+
+
+static size_t _memory_get_length(size_t size);
+static void *_memory_map(size_t length, _backing_e *backing);
+static void _memory_prefault(uint8_t *data, size_t length, _backing_e backing);
+static void _memory_report(size_t length, _backing_e backing, bool locked);
+
+
+void *us_memory_alloc(size_t size) {
+	if (size < US_MEMORY_MAP_THRESHOLD) {
+		// Mostly pages the heap has touched before, the pool keeps them around
+		return malloc(size);
+	}
+
+	const size_t length = _memory_get_length(size);
+	_backing_e backing;
+	uint8_t *const data = _memory_map(length, &backing);
+	if (data == NULL) {
+		return NULL;
+	}
+
+	_memory_prefault(data, length, backing);
+
+	bool locked = false;
+	if (us_g_memory_flags & US_MEMORY_LOCK) {
+		if (mlock(data, length) == 0) {
+			locked = true;
+		} else if (!__atomic_exchange_n(&_g_lock_failed, true, __ATOMIC_RELAXED)) {
+			US_LOG_PERROR("Can't mlock() frame memory, check RLIMIT_MEMLOCK");
+		}
+	}
+
+	_memory_report(length, backing, locked);
+	return data;
+}
+
+void us_memory_free(void *data, size_t size) {
+	if (data == NULL) {
+		return;
+	}
+	if (size < US_MEMORY_MAP_THRESHOLD) {
+		free(data);
+	} else {
+		munmap(data, _memory_get_length(size));
+	}
+}
+
+static size_t _memory_get_length(size_t size) {
+	return (size + US_MEMORY_MAP_THRESHOLD - 1) / US_MEMORY_MAP_THRESHOLD * US_MEMORY_MAP_THRESHOLD;
+}
+
+static void *_memory_map(size_t length, _backing_e *backing) {
+	void *data;
+
+#	ifdef MAP_HUGE_2MB
+	if (us_g_memory_flags & US_MEMORY_HUGE) {
+		data = mmap(NULL, length, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+		if (data != MAP_FAILED) {
+			*backing = _BACKING_HUGETLB;
+			return data;
+		}
+		// No 2Mb pages reserved or supported, try THP below
+	}
+#	endif
+
+	data = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (data == MAP_FAILED) {
+		US_LOG_PERROR("Can't map %zu bytes of frame memory", length);
+		return NULL;
+	}
+	*backing = _BACKING_PAGES;
+
+#	ifdef MADV_HUGEPAGE
+	if ((us_g_memory_flags & US_MEMORY_HUGE) && madvise(data, length, MADV_HUGEPAGE) == 0) {
+		*backing = _BACKING_THP;
+	}
+#	endif
+	return data;
+}
+
+static void _memory_prefault(uint8_t *data, size_t length, _backing_e backing) {
+	// Touch every page now, not on the hot path
+	const size_t page_size = (backing == _BACKING_HUGETLB ? US_MEMORY_MAP_THRESHOLD : (size_t)sysconf(_SC_PAGESIZE));
+	for (size_t offset = 0; offset < length; offset += page_size) {
+		data[offset] = 0;
+	}
+}
+
+static void _memory_report(size_t length, _backing_e backing, bool locked) {
+	// Only report changes, the same backing is normally chosen for every buffer
+	if (__atomic_exchange_n(&_g_reported_backing, backing, __ATOMIC_RELAXED) != backing) {
+		const char *name = "regular pages";
+		switch (backing) {
+			case _BACKING_HUGETLB: name = "hugetlb pages"; break;
+			case _BACKING_THP: name = "transparent huge pages"; break;
+			default: break;
+		}
+		US_LOG_INFO("Frame memory is backed by %s: buffer=%zu, locked=%s",
+			name, length, us_bool_to_string(locked));
+	}
+}
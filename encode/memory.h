@@ -0,0 +1,31 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "tools.h"
+#include "logging.h"
+
+
+#define US_MEMORY_HUGE		1 // MAP_HUGETLB, then transparent huge pages
+#define US_MEMORY_LOCK		2 // mlock() the buffers so they are never paged out
+
+// Smaller buffers stay on the heap. Mapped lengths are rounded up to it, the 2Mb huge page,
+// so us_memory_free() can tell the backing by the size alone.
+#define US_MEMORY_MAP_THRESHOLD	(2 << 20)
+
+extern unsigned us_g_memory_flags;
+
+
+// For frame sized and scratch buffers, mapped memory is pre-faulted
+void *us_memory_alloc(size_t size);
+void us_memory_free(void *data, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,30 @@
+#include "scale.h"
+
+
+void us_scale_half_32(
+	const uint8_t *pixels, unsigned stride, unsigned width, unsigned height,
+	unsigned format, us_frame_s *dest) {
+
+	const unsigned dest_width = width / 2;
+	const unsigned dest_height = height / 2;
+	const unsigned dest_stride = dest_width * 4;
+
+	us_frame_realloc_data(dest, (size_t)dest_stride * dest_height);
+	dest->width = dest_width;
+	dest->height = dest_height;
+	dest->stride = dest_stride;
+	dest->format = format;
+	dest->dma_fd = -1;
+	dest->used = (size_t)dest_stride * dest_height;
+
+	for (unsigned y = 0; y < dest_height; ++y) {
+		const uint8_t *top = pixels + (size_t)(y * 2) * stride;
+		const uint8_t *bottom = top + stride;
+		uint8_t *out = dest->data + (size_t)y * dest_stride;
+		// Per byte, so it vectorizes without knowing the channel layout
+		for (unsigned x = 0; x < dest_stride; ++x) {
+			const unsigned in = (x / 4) * 8 + (x % 4);
+			out[x] = (top[in] + top[in + 4] + bottom[in] + bottom[in + 4] + 2) >> 2;
+		}
+	}
+}
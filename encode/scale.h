@@ -0,0 +1,22 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include "tools.h"
+#include "frame.h"
+
+
+// Halves a frame of 32-bit pixels with a 2x2 box filter, the channel order doesn't matter.
+// dest gets the packed result with the given format and dma_fd = -1, so an M2M encoder
+// reads it from memory. An odd last row or column is dropped.
+void us_scale_half_32(
+	const uint8_t *pixels, unsigned stride, unsigned width, unsigned height,
+	unsigned format, us_frame_s *dest);
+
+#ifdef __cplusplus
+}
+#endif
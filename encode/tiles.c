@@ -0,0 +1,293 @@
+#include "tiles.h"
+
+#include "cpu_jpeg.h"
+
+
+static int _tile_encoder_prepare(us_tile_encoder_s *enc, const us_frame_s *src);
+static bool _tile_is_dirty(
+	const us_tile_encoder_s *enc, const uint8_t *pixels, unsigned stride,
+	const us_tile_rect_s *tile, const us_tile_rect_s *damage, unsigned n_damage);
+static void _tile_update_ref(us_tile_encoder_s *enc, const uint8_t *pixels, unsigned stride, const us_tile_rect_s *rect);
+
+static void _tiles_begin_message(us_tile_encoder_s *enc, us_frame_s *dest, bool key);
+static void _tiles_end_message(us_frame_s *dest, unsigned n_tiles);
+static int _tiles_append_tile(us_tile_encoder_s *enc, const us_tile_rect_s *rect, us_frame_s *dest);
+
+static void _write_u16(uint8_t *ptr, unsigned value);
+static void _write_u32(uint8_t *ptr, uint32_t value);
+
+
+#define _E_LOG_ERROR(x_msg, ...)	US_LOG_ERROR("%s: " x_msg, enc->name, ##__VA_ARGS__)
+#define _E_LOG_INFO(x_msg, ...)		US_LOG_INFO("%s: " x_msg, enc->name, ##__VA_ARGS__)
+#define _E_LOG_VERBOSE(x_msg, ...)	US_LOG_VERBOSE("%s: " x_msg, enc->name, ##__VA_ARGS__)
+
+
+us_tile_encoder_s *us_tile_encoder_init(const char *name, unsigned tile_size, unsigned quality, unsigned key_interval) {
+	US_LOG_INFO("%s: Initializing tile encoder: tile=%u, quality=%u, key_interval=%u ...",
+		name, tile_size, quality, key_interval);
+
+	assert(tile_size > 0);
+	us_tile_encoder_s *enc = calloc(1, sizeof(us_tile_encoder_s));
+	enc->name = us_strdup(name);
+	enc->tile_size = tile_size;
+	enc->quality = quality;
+	enc->key_interval = key_interval;
+	enc->force_key = true;
+	US_MUTEX_INIT(enc->mutex);
+	return enc;
+}
+
+void us_tile_encoder_destroy(us_tile_encoder_s *enc) {
+	US_MUTEX_DESTROY(enc->mutex);
+	US_DELETE(enc->dirty, free);
+	us_memory_free(enc->ref, enc->ref_allocated);
+	free(enc->name);
+	free(enc);
+}
+
+void us_tile_encoder_force_key(us_tile_encoder_s *enc) {
+	US_MUTEX_LOCK(enc->mutex);
+	enc->force_key = true;
+	US_MUTEX_UNLOCK(enc->mutex);
+}
+
+void us_tile_encoder_set_quality(us_tile_encoder_s *enc, unsigned quality) {
+	US_MUTEX_LOCK(enc->mutex);
+	enc->quality = quality;
+	US_MUTEX_UNLOCK(enc->mutex);
+}
+
+int us_tile_encoder_compress(
+	us_tile_encoder_s *enc, const us_frame_s *src, const uint8_t *pixels,
+	const us_tile_rect_s *damage, unsigned n_damage, us_frame_s *dest) {
+
+	const long double begin_ts = us_get_now_monotonic();
+	int n_tiles = 0;
+
+	US_MUTEX_LOCK(enc->mutex);
+
+	if (_tile_encoder_prepare(enc, src) < 0) {
+		goto error;
+	}
+
+	const unsigned stride = src->stride;
+	const bool key = (enc->force_key || (enc->key_interval > 0 && enc->since_key >= enc->key_interval));
+
+	if (key) {
+		const us_tile_rect_s all = {0, 0, enc->width, enc->height};
+		_tile_update_ref(enc, pixels, stride, &all);
+		_tiles_begin_message(enc, dest, true);
+		if (_tiles_append_tile(enc, &all, dest) < 0) {
+			goto error;
+		}
+		n_tiles = 1;
+		enc->force_key = false;
+		enc->since_key = 0;
+
+	} else {
+		_tiles_begin_message(enc, dest, false);
+
+		const unsigned ts = enc->tile_size;
+		const unsigned cols = (enc->width + ts - 1) / ts;
+		for (unsigned y = 0; y < enc->height; y += ts) {
+			const unsigned th = us_min_u(ts, enc->height - y);
+			for (unsigned col = 0; col < cols; ++col) {
+				const us_tile_rect_s tile = {col * ts, y, us_min_u(ts, enc->width - col * ts), th};
+				enc->dirty[col] = _tile_is_dirty(enc, pixels, stride, &tile, damage, n_damage);
+			}
+
+			// Adjacent dirty tiles in a row go as one JPEG to save on headers
+			for (unsigned col = 0; col < cols;) {
+				if (!enc->dirty[col]) {
+					++col;
+					continue;
+				}
+				unsigned end = col;
+				while (end < cols && enc->dirty[end]) {
+					++end;
+				}
+				const unsigned x = col * ts;
+				const us_tile_rect_s run = {x, y, us_min_u(end * ts, enc->width) - x, th};
+				_tile_update_ref(enc, pixels, stride, &run);
+				if (_tiles_append_tile(enc, &run, dest) < 0) {
+					goto error;
+				}
+				++n_tiles;
+				col = end;
+			}
+		}
+		++enc->since_key;
+	}
+
+	_tiles_end_message(dest, n_tiles);
+	if (n_tiles > 0) {
+		++enc->sequence;
+	}
+
+	US_MUTEX_UNLOCK(enc->mutex);
+
+	_E_LOG_VERBOSE("Compressed tiles: key=%d, n_tiles=%d, size=%zu, time=%0.3Lf",
+		key, n_tiles, dest->used, us_get_now_monotonic() - begin_ts);
+	return n_tiles;
+
+	error:
+		US_MUTEX_UNLOCK(enc->mutex);
+		_E_LOG_ERROR("Can't compress tiles");
+		return -1;
+}
+
+int us_tile_encoder_compress_ref_key(us_tile_encoder_s *enc, us_frame_s *dest) {
+	int retval = 0;
+	US_MUTEX_LOCK(enc->mutex);
+	if (enc->ref == NULL) {
+		retval = -1;
+	} else {
+		const us_tile_rect_s all = {0, 0, enc->width, enc->height};
+		_tiles_begin_message(enc, dest, true);
+		if (_tiles_append_tile(enc, &all, dest) < 0) {
+			retval = -1;
+		} else {
+			_tiles_end_message(dest, 1);
+		}
+	}
+	US_MUTEX_UNLOCK(enc->mutex);
+	return retval;
+}
+
+static int _tile_encoder_prepare(us_tile_encoder_s *enc, const us_frame_s *src) {
+	if (enc->ref != NULL && enc->width == src->width && enc->height == src->height && enc->format == src->format) {
+		return 0;
+	}
+
+	unsigned bytes_per_pixel;
+	switch (src->format) {
+		case V4L2_PIX_FMT_BGR32:
+		case V4L2_PIX_FMT_ABGR32:
+		case V4L2_PIX_FMT_XBGR32: bytes_per_pixel = 4; break;
+		case V4L2_PIX_FMT_RGB24: bytes_per_pixel = 3; break;
+		default: {
+			char fourcc_str[8];
+			_E_LOG_ERROR("Unsupported input format %s", us_fourcc_to_string(src->format, fourcc_str, 8));
+			return -1;
+		}
+	}
+
+	_E_LOG_INFO("Configuring tile encoder: %ux%u ...", src->width, src->height);
+
+	const size_t ref_size = (size_t)src->width * src->height * bytes_per_pixel;
+	if (enc->ref_allocated < ref_size) {
+		// The old content is useless, a keyframe follows
+		us_memory_free(enc->ref, enc->ref_allocated);
+		enc->ref = us_memory_alloc(ref_size);
+		assert(enc->ref != NULL);
+		enc->ref_allocated = ref_size;
+	}
+	const size_t cols = (src->width + enc->tile_size - 1) / enc->tile_size;
+	if (enc->dirty_allocated < cols) {
+		enc->dirty = realloc(enc->dirty, cols * sizeof(bool));
+		assert(enc->dirty != NULL);
+		enc->dirty_allocated = cols;
+	}
+
+	enc->width = src->width;
+	enc->height = src->height;
+	enc->format = src->format;
+	enc->bytes_per_pixel = bytes_per_pixel;
+	enc->force_key = true;
+	return 0;
+}
+
+static bool _tile_is_dirty(
+	const us_tile_encoder_s *enc, const uint8_t *pixels, unsigned stride,
+	const us_tile_rect_s *tile, const us_tile_rect_s *damage, unsigned n_damage) {
+
+	if (n_damage > 0) {
+		bool damaged = false;
+		for (unsigned index = 0; index < n_damage && !damaged; ++index) {
+			const us_tile_rect_s *const d = &damage[index];
+			damaged = (
+				tile->x < d->x + d->width && d->x < tile->x + tile->width
+				&& tile->y < d->y + d->height && d->y < tile->y + tile->height
+			);
+		}
+		if (!damaged) {
+			return false;
+		}
+	}
+
+	const size_t ref_stride = (size_t)enc->width * enc->bytes_per_pixel;
+	const size_t offset = (size_t)tile->x * enc->bytes_per_pixel;
+	const size_t size = (size_t)tile->width * enc->bytes_per_pixel;
+	for (unsigned y = tile->y; y < tile->y + tile->height; ++y) {
+		if (memcmp(pixels + y * (size_t)stride + offset, enc->ref + y * ref_stride + offset, size)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void _tile_update_ref(us_tile_encoder_s *enc, const uint8_t *pixels, unsigned stride, const us_tile_rect_s *rect) {
+	const size_t ref_stride = (size_t)enc->width * enc->bytes_per_pixel;
+	const size_t offset = (size_t)rect->x * enc->bytes_per_pixel;
+	const size_t size = (size_t)rect->width * enc->bytes_per_pixel;
+	for (unsigned y = rect->y; y < rect->y + rect->height; ++y) {
+		memcpy(enc->ref + y * ref_stride + offset, pixels + y * (size_t)stride + offset, size);
+	}
+}
+
+static void _tiles_begin_message(us_tile_encoder_s *enc, us_frame_s *dest, bool key) {
+	us_frame_realloc_data(dest, US_TILES_HEADER_SIZE);
+	uint8_t *const ptr = dest->data;
+	ptr[0] = US_TILES_MAGIC_0;
+	ptr[1] = US_TILES_MAGIC_1;
+	ptr[2] = US_TILES_VERSION;
+	ptr[3] = (key ? US_TILES_FLAG_KEY : 0);
+	_write_u32(ptr + 4, enc->sequence);
+	_write_u16(ptr + 8, enc->width);
+	_write_u16(ptr + 10, enc->height);
+	_write_u16(ptr + 12, 0);
+	_write_u16(ptr + 14, 0);
+	dest->used = US_TILES_HEADER_SIZE;
+	dest->width = enc->width;
+	dest->height = enc->height;
+	dest->format = V4L2_PIX_FMT_JPEG;
+	dest->stride = 0;
+	dest->key = key;
+}
+
+static void _tiles_end_message(us_frame_s *dest, unsigned n_tiles) {
+	_write_u16(dest->data + 12, n_tiles);
+}
+
+static int _tiles_append_tile(us_tile_encoder_s *enc, const us_tile_rect_s *rect, us_frame_s *dest) {
+	// Offsets, not pointers: the JPEG encoder may reallocate the frame
+	const size_t header_offset = dest->used;
+	us_frame_realloc_data(dest, header_offset + US_TILES_TILE_HEADER_SIZE);
+	dest->used = header_offset + US_TILES_TILE_HEADER_SIZE;
+
+	const size_t ref_stride = (size_t)enc->width * enc->bytes_per_pixel;
+	const uint8_t *const pixels = enc->ref + rect->y * ref_stride + (size_t)rect->x * enc->bytes_per_pixel;
+	if (us_cpu_jpeg_compress(pixels, ref_stride, rect->width, rect->height, enc->format, enc->quality, dest) < 0) {
+		return -1;
+	}
+
+	uint8_t *const ptr = dest->data + header_offset;
+	_write_u16(ptr, rect->x);
+	_write_u16(ptr + 2, rect->y);
+	_write_u16(ptr + 4, rect->width);
+	_write_u16(ptr + 6, rect->height);
+	_write_u32(ptr + 8, dest->used - header_offset - US_TILES_TILE_HEADER_SIZE);
+	return 0;
+}
+
+static void _write_u16(uint8_t *ptr, unsigned value) {
+	ptr[0] = value & 0xFF;
+	ptr[1] = (value >> 8) & 0xFF;
+}
+
+static void _write_u32(uint8_t *ptr, uint32_t value) {
+	ptr[0] = value & 0xFF;
+	ptr[1] = (value >> 8) & 0xFF;
+	ptr[2] = (value >> 16) & 0xFF;
+	ptr[3] = (value >> 24) & 0xFF;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <pthread.h>
+
+#include "tools.h"
+#include "logging.h"
+#include "threading.h"
+#include "frame.h"
+
+
+// Dirty-tile update message, little-endian:
+//   u8[2] magic "TU", u8 version, u8 flags, u32 sequence,
+//   u16 width, u16 height, u16 n_tiles, u16 reserved,
+//   n_tiles * { u16 x, u16 y, u16 width, u16 height, u32 size, u8[size] jpeg }
+// A keyframe is a single tile covering the whole frame.
+#define US_TILES_MAGIC_0		'T'
+#define US_TILES_MAGIC_1		'U'
+#define US_TILES_VERSION		1
+#define US_TILES_FLAG_KEY		((uint8_t)1 << 0)
+#define US_TILES_HEADER_SIZE	16
+#define US_TILES_TILE_HEADER_SIZE	12
+
+
+typedef struct {
+	unsigned	x;
+	unsigned	y;
+	unsigned	width;
+	unsigned	height;
+} us_tile_rect_s;
+
+typedef struct {
+	char			*name;
+	unsigned		tile_size;
+	unsigned		quality;
+	unsigned		key_interval;
+
+	pthread_mutex_t	mutex;
+
+	// What the clients currently show, packed without padding
+	uint8_t			*ref;
+	size_t			ref_allocated;
+	unsigned		width;
+	unsigned		height;
+	unsigned		format;
+	unsigned		bytes_per_pixel;
+
+	bool			*dirty;
+	size_t			dirty_allocated;
+
+	uint32_t		sequence;
+	unsigned		since_key;
+	bool			force_key;
+} us_tile_encoder_s;
+
+
+us_tile_encoder_s *us_tile_encoder_init(const char *name, unsigned tile_size, unsigned quality, unsigned key_interval);
+void us_tile_encoder_destroy(us_tile_encoder_s *enc);
+
+void us_tile_encoder_force_key(us_tile_encoder_s *enc);
+void us_tile_encoder_set_quality(us_tile_encoder_s *enc, unsigned quality);
+
+// Diffs the pixels against the reference (only inside the damage rects, if any)
+// and writes an update message to dest. Returns the number of tiles, 0 if
+// nothing has changed and there is nothing to send, or -1 on error.
+int us_tile_encoder_compress(
+	us_tile_encoder_s *enc, const us_frame_s *src, const uint8_t *pixels,
+	const us_tile_rect_s *damage, unsigned n_damage, us_frame_s *dest);
+
+// Writes a keyframe message of the current reference, for newly connected clients
+int us_tile_encoder_compress_ref_key(us_tile_encoder_s *enc, us_frame_s *dest);
+
+#ifdef __cplusplus
+}
+#endif
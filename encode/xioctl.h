@@ -15,12 +15,16 @@ extern "C" {
 #define _XIOCTL_RETRIES ((unsigned)(US_CFG_XIOCTL_RETRIES))
 
 
-INLINE int us_xioctl(int fd, int request, void *arg) {
+typedef int (*us_ioctl_f)(void *ctx, int fd, int request, void *arg);
+
+
+// The func is a replacement for ioctl(), NULL means the real one
+INLINE int us_xioctl_with(us_ioctl_f func, void *ctx, int fd, int request, void *arg) {
 	int retries = _XIOCTL_RETRIES;
 	int retval = -1;
 
 	do {
-		retval = ioctl(fd, request, arg);
+		retval = (func != NULL ? func(ctx, fd, request, arg) : ioctl(fd, request, arg));
 	} while (
 		retval
 		&& retries--
@@ -33,6 +37,10 @@ INLINE int us_xioctl(int fd, int request, void *arg) {
 	return retval;
 }
 
+INLINE int us_xioctl(int fd, int request, void *arg) {
+	return us_xioctl_with(NULL, NULL, fd, request, arg);
+}
+
 #ifdef __cplusplus
 }
 #endif
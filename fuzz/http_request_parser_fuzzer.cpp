@@ -0,0 +1,118 @@
+// HTTPRequestParser driven the way the listener drives it: the input arrives in reads of
+// varying size written into space(), every complete request is checked and consumed, the
+// pipelined bytes after it stay. The first byte picks how the input is split.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string_view>
+
+#include "stream/mjpeg_streamer.hpp"
+
+namespace {
+using nadjieb::net::HTTPRequestParser;
+
+void check(bool condition) {
+    if (!condition) {
+        abort();
+    }
+}
+
+bool isWithin(std::string_view view, std::string_view buffer) {
+    return (view.empty() || (view.data() >= buffer.data() && view.data() + view.size() <= buffer.data() + buffer.size()));
+}
+
+bool sameIgnoringCase(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); ++i) {
+        const char x = ((a[i] >= 'A' && a[i] <= 'Z') ? a[i] - 'A' + 'a' : a[i]);
+        const char y = ((b[i] >= 'A' && b[i] <= 'Z') ? b[i] - 'A' + 'a' : b[i]);
+        if (x != y) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Returns false once the listener would close the connection
+bool dispatch(HTTPRequestParser& parser) {
+    while (true) {
+        const auto buffered = parser.remaining();
+        const bool terminated = (buffered.find("\r\n\r\n") != std::string_view::npos);
+        const auto state = parser.parse();
+
+        if (state == HTTPRequestParser::State::INCOMPLETE) {
+            check(!terminated && parser.spaceSize() > 0);
+            return true;
+        }
+        if (state == HTTPRequestParser::State::TOO_LARGE) {
+            return false;
+        }
+        if (state == HTTPRequestParser::State::INVALID) {
+            check(terminated);
+            return false;
+        }
+
+        check(terminated);
+        // Parsing again doesn't change the result
+        check(parser.parse() == HTTPRequestParser::State::COMPLETE);
+        check(!parser.getMethod().empty() && !parser.getTarget().empty());
+        check(parser.getVersion().substr(0, 5) == "HTTP/");
+        check(isWithin(parser.getMethod(), buffered));
+        check(isWithin(parser.getTarget(), buffered));
+        check(isWithin(parser.getVersion(), buffered));
+        for (const auto key : {"Host", "Connection", "Upgrade", "Sec-WebSocket-Key"}) {
+            const auto value = parser.getValue(key);
+            check(isWithin(value, buffered));
+            check(value.empty() || (value.front() != ' ' && value.back() != ' '));
+        }
+        check(parser.getValue("host") == parser.getValue("HOST"));
+        check(sameIgnoringCase(parser.getValue("connection"), parser.getValue("Connection")));
+
+        parser.consume();
+        check(parser.remaining().size() < buffered.size());
+        check(parser.getMethod().empty() && parser.getTarget().empty());
+    }
+}
+}  // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    if (size == 0) {
+        return 0;
+    }
+    // 0 for reads as large as the buffer takes, otherwise up to that many bytes per read
+    uint32_t split = data[0];
+    ++data;
+    --size;
+
+    auto parser_ptr = std::make_unique<HTTPRequestParser>(); // 8Kb, not on the stack
+    auto& parser = *parser_ptr;
+
+    uint32_t seed = split * 2654435761u + 1;
+    while (size > 0) {
+        size_t chunk = parser.spaceSize();
+        if (split > 0) {
+            seed = seed * 1103515245u + 12345u;
+            chunk = std::min<size_t>(chunk, 1 + (seed >> 16) % split);
+        }
+        chunk = std::min(chunk, size);
+        if (chunk == 0) {
+            // Full without a request, the listener answers 431
+            check(parser.parse() == HTTPRequestParser::State::TOO_LARGE);
+            break;
+        }
+        std::memcpy(parser.space(), data, chunk);
+        parser.commit(chunk);
+        data += chunk;
+        size -= chunk;
+        if (!dispatch(parser)) {
+            break;
+        }
+    }
+    return 0;
+}
@@ -110,6 +110,152 @@ class HTTPRequest {
 }  // namespace net
 }  // namespace nadjieb
 
+// #include <nadjieb/net/http_request_parser.hpp>
+
+
+#include <array>
+#include <cstring>
+#include <string_view>
+
+namespace nadjieb {
+namespace net {
+// Incremental, allocation-free alternative to HTTPRequest. Bytes are read straight
+// into the fixed buffer of the connection, the request is parsed once the header
+// block is complete and all the accessors are views into that buffer.
+class HTTPRequestParser {
+   public:
+    enum class State { INCOMPLETE, COMPLETE, INVALID, TOO_LARGE };
+
+    const static size_t LIMIT_REQUEST_SIZE = 8192;
+    const static size_t LIMIT_HEADERS = 32;
+
+    char* space() { return buffer_ + size_; }
+
+    size_t spaceSize() const { return LIMIT_REQUEST_SIZE - size_; }
+
+    // Accounts for the bytes written into space()
+    State commit(size_t size) {
+        size_ += size;
+        return parse();
+    }
+
+    State feed(const char* data, size_t size) {
+        if (size > spaceSize()) {
+            return State::TOO_LARGE;
+        }
+        std::memcpy(space(), data, size);
+        return commit(size);
+    }
+
+    State parse() {
+        if (request_size_ > 0) {
+            return State::COMPLETE;
+        }
+
+        // Don't rescan what was already checked, the terminator may straddle two reads
+        const std::string_view data(buffer_, size_);
+        const auto end = data.find("\r\n\r\n", scanned_ > 3 ? scanned_ - 3 : 0);
+        if (end == std::string_view::npos) {
+            scanned_ = size_;
+            return (size_ == LIMIT_REQUEST_SIZE ? State::TOO_LARGE : State::INCOMPLETE);
+        }
+
+        auto line_end = data.find("\r\n");
+        auto line = data.substr(0, line_end);
+        auto method_end = line.find(' ');
+        auto target_end = (method_end == std::string_view::npos ? method_end : line.find(' ', method_end + 1));
+        if (target_end == std::string_view::npos) {
+            return State::INVALID;
+        }
+        method_ = line.substr(0, method_end);
+        target_ = line.substr(method_end + 1, target_end - method_end - 1);
+        version_ = line.substr(target_end + 1);
+        if (method_.empty() || target_.empty() || version_.substr(0, 5) != "HTTP/") {
+            return State::INVALID;
+        }
+
+        n_headers_ = 0;
+        while (line_end < end) {
+            const auto begin = line_end + 2;
+            line_end = data.find("\r\n", begin);
+            line = data.substr(begin, line_end - begin);
+
+            const auto colon = line.find(':');
+            if (colon == std::string_view::npos || colon == 0) {
+                return State::INVALID;
+            }
+            if (n_headers_ == LIMIT_HEADERS) {
+                return State::TOO_LARGE;
+            }
+            headers_[n_headers_].first = line.substr(0, colon);
+            headers_[n_headers_].second = trim(line.substr(colon + 1));
+            ++n_headers_;
+        }
+
+        request_size_ = end + 4;
+        return State::COMPLETE;
+    }
+
+    // Drops the parsed request and keeps the pipelined bytes after it
+    void consume() {
+        std::memmove(buffer_, buffer_ + request_size_, size_ - request_size_);
+        size_ -= request_size_;
+        request_size_ = 0;
+        scanned_ = 0;
+        n_headers_ = 0;
+        method_ = target_ = version_ = std::string_view();
+    }
+
+    // What follows the consumed requests, e.g. the first frames after a WebSocket upgrade
+    std::string_view remaining() const { return std::string_view(buffer_, size_); }
+
+    std::string_view getMethod() const { return method_; }
+
+    std::string_view getTarget() const { return target_; }
+
+    std::string_view getVersion() const { return version_; }
+
+    // Header names are case-insensitive, an absent header is an empty view
+    std::string_view getValue(std::string_view key) const {
+        for (size_t i = 0; i < n_headers_; ++i) {
+            const auto& name = headers_[i].first;
+            if (name.size() == key.size()
+                && std::equal(name.begin(), name.end(), key.begin(), [](char a, char b) {
+                       return (toLower(a) == toLower(b));
+                   })) {
+                return headers_[i].second;
+            }
+        }
+        return std::string_view();
+    }
+
+   private:
+    char buffer_[LIMIT_REQUEST_SIZE];
+    size_t size_ = 0;
+    size_t scanned_ = 0;
+    size_t request_size_ = 0;
+
+    std::string_view method_;
+    std::string_view target_;
+    std::string_view version_;
+    std::array<std::pair<std::string_view, std::string_view>, LIMIT_HEADERS> headers_;
+    size_t n_headers_ = 0;
+
+    static char toLower(char ch) { return ((ch >= 'A' && ch <= 'Z') ? ch - 'A' + 'a' : ch); }
+
+    static std::string_view trim(std::string_view value) {
+        while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) {
+            value.remove_prefix(1);
+        }
+        while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) {
+            value.remove_suffix(1);
+        }
+        return value;
+    }
+};
+}  // namespace net
+}  // namespace nadjieb
+
 // #include <nadjieb/net/http_response.hpp>
 
 
@@ -185,8 +331,10 @@ class HTTPResponse {
 #include <errno.h>
 #include <poll.h>
 #include <signal.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #elif defined NADJIEB_MJPEG_STREAMER_PLATFORM_DARWIN
 #include <arpa/inet.h>
@@ -195,6 +343,7 @@ class HTTPResponse {
 #include <signal.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #else
 #error "Unsupported OS, please commit an issue."
@@ -307,6 +456,13 @@ static SocketFD acceptNewSocket(SocketFD sockfd) {
     return ::accept(sockfd, nullptr, nullptr);
 }
 
+#ifdef NADJIEB_MJPEG_STREAMER_PLATFORM_LINUX
+// Saves the separate FIONBIO ioctl per connection
+static SocketFD acceptNewNonblockSocket(SocketFD sockfd) {
+    return ::accept4(sockfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+#endif
+
 static int readFromSocket(SocketFD socket, char* buffer, size_t length, int flags) {
 #ifdef NADJIEB_MJPEG_STREAMER_PLATFORM_WINDOWS
     return ::recv(socket, buffer, (int)length, flags);
@@ -323,6 +479,77 @@ static int sendViaSocket(SocketFD socket, const char* buffer, size_t length, int
 #endif
 }
 
+// Sends the tail of two consecutive buffers, starting at offset into the first one
+static long sendVectorViaSocket(
+    SocketFD socket,
+    const char* first,
+    size_t first_length,
+    const char* second,
+    size_t second_length,
+    size_t offset) {
+#ifdef NADJIEB_MJPEG_STREAMER_PLATFORM_WINDOWS
+    WSABUF bufs[2];
+    DWORD count = 0;
+    if (offset < first_length) {
+        bufs[count++] = WSABUF{(ULONG)(first_length - offset), (CHAR*)first + offset};
+        offset = 0;
+    } else {
+        offset -= first_length;
+    }
+    bufs[count++] = WSABUF{(ULONG)(second_length - offset), (CHAR*)second + offset};
+    DWORD sent = 0;
+    if (WSASend(socket, bufs, count, &sent, 0, nullptr, nullptr) == SOCKET_ERROR) {
+        return NADJIEB_MJPEG_STREAMER_SOCKET_ERROR;
+    }
+    return (long)sent;
+#else
+    struct iovec iov[2];
+    int count = 0;
+    if (offset < first_length) {
+        iov[count++] = iovec{(void*)(first + offset), first_length - offset};
+        offset = 0;
+    } else {
+        offset -= first_length;
+    }
+    iov[count++] = iovec{(void*)(second + offset), second_length - offset};
+    return ::writev(socket, iov, count);
+#endif
+}
+
+// The pending error of the socket, 0 when an error event was only about the error queue
+static int getSocketError(SocketFD socket) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (::getsockopt(socket, SOL_SOCKET, SO_ERROR, (char*)&error, &length) == NADJIEB_MJPEG_STREAMER_SOCKET_ERROR) {
+        return NADJIEB_MJPEG_STREAMER_ERRNO;
+    }
+    return error;
+}
+
+static void shutdownSocket(SocketFD socket) {
+#ifdef NADJIEB_MJPEG_STREAMER_PLATFORM_WINDOWS
+    ::shutdown(socket, SD_BOTH);
+#else
+    ::shutdown(socket, SHUT_RDWR);
+#endif
+}
+
+// The numeric address of the peer, empty if unknown
+static std::string getPeerAddress(SocketFD socket) {
+    struct sockaddr_storage address = {};
+    socklen_t length = sizeof(address);
+    if (::getpeername(socket, (struct sockaddr*)&address, &length) == NADJIEB_MJPEG_STREAMER_SOCKET_ERROR) {
+        return std::string();
+    }
+    char text[INET6_ADDRSTRLEN] = {};
+    const void* ip = (address.ss_family == AF_INET6 ? (const void*)&((struct sockaddr_in6*)&address)->sin6_addr
+                                                     : (const void*)&((struct sockaddr_in*)&address)->sin_addr);
+    if (::inet_ntop(address.ss_family, ip, text, sizeof(text)) == nullptr) {
+        return std::string();
+    }
+    return text;
+}
+
 static int pollSockets(NADJIEB_MJPEG_STREAMER_POLLFD* fds, size_t nfds, long timeout) {
 #ifdef NADJIEB_MJPEG_STREAMER_PLATFORM_WINDOWS
     return WSAPoll(&fds[0], (ULONG)nfds, timeout);
@@ -370,11 +597,326 @@ class Runnable {
 }  // namespace utils
 }  // namespace nadjieb
 
+// #include <nadjieb/net/websocket.hpp>
+
+// #include <nadjieb/net/socket.hpp>
+
+// #include <nadjieb/utils/non_copyable.hpp>
+
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+namespace nadjieb {
+namespace net {
+enum class WebSocketOpcode : uint8_t {
+    CONTINUATION = 0x0,
+    TEXT = 0x1,
+    BINARY = 0x2,
+    CLOSE = 0x8,
+    PING = 0x9,
+    PONG = 0xA
+};
+
+// RFC 3174, only used for the handshake
+static std::array<uint8_t, 20> sha1(std::string_view data) {
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    auto rotl = [](uint32_t x, int n) { return (x << n) | (x >> (32 - n)); };
+
+    std::string message(data);
+    const uint64_t bits = static_cast<uint64_t>(data.size()) * 8;
+    message.push_back(static_cast<char>(0x80));
+    while (message.size() % 64 != 56) {
+        message.push_back('\0');
+    }
+    for (int i = 7; i >= 0; --i) {
+        message.push_back(static_cast<char>(bits >> (8 * i)));
+    }
+
+    for (size_t chunk = 0; chunk < message.size(); chunk += 64) {
+        uint32_t w[80];
+        for (int i = 0; i < 16; ++i) {
+            const auto* p = reinterpret_cast<const uint8_t*>(message.data() + chunk + 4 * i);
+            w[i] = (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+        }
+        for (int i = 16; i < 80; ++i) {
+            w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; ++i) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            const uint32_t temp = rotl(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rotl(b, 30);
+            b = a;
+            a = temp;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+
+    std::array<uint8_t, 20> digest;
+    for (int i = 0; i < 20; ++i) {
+        digest[i] = static_cast<uint8_t>(h[i / 4] >> (24 - 8 * (i % 4)));
+    }
+    return digest;
+}
+
+static std::string base64(const uint8_t* data, size_t size) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    out.reserve((size + 2) / 3 * 4);
+    for (size_t i = 0; i < size; i += 3) {
+        uint32_t n = uint32_t(data[i]) << 16;
+        if (i + 1 < size) {
+            n |= uint32_t(data[i + 1]) << 8;
+        }
+        if (i + 2 < size) {
+            n |= data[i + 2];
+        }
+        out.push_back(alphabet[(n >> 18) & 63]);
+        out.push_back(alphabet[(n >> 12) & 63]);
+        out.push_back(i + 1 < size ? alphabet[(n >> 6) & 63] : '=');
+        out.push_back(i + 2 < size ? alphabet[n & 63] : '=');
+    }
+    return out;
+}
+
+// The Sec-WebSocket-Accept value for the key of an upgrade request
+static std::string webSocketAccept(std::string_view key) {
+    std::string accept(key);
+    accept += "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    const auto digest = sha1(accept);
+    return base64(digest.data(), digest.size());
+}
+
+const static size_t LIMIT_WEBSOCKET_HEADER_SIZE = 10;
+
+// Server frames are never masked or fragmented, out needs LIMIT_WEBSOCKET_HEADER_SIZE bytes
+static size_t writeWebSocketHeader(char* out, WebSocketOpcode opcode, uint64_t size) {
+    out[0] = static_cast<char>(0x80 | static_cast<uint8_t>(opcode));
+    if (size < 126) {
+        out[1] = static_cast<char>(size);
+        return 2;
+    }
+    if (size <= 0xFFFF) {
+        out[1] = 126;
+        out[2] = static_cast<char>(size >> 8);
+        out[3] = static_cast<char>(size);
+        return 4;
+    }
+    out[1] = 127;
+    for (int i = 0; i < 8; ++i) {
+        out[2 + i] = static_cast<char>(size >> (56 - 8 * i));
+    }
+    return 10;
+}
+
+struct WebSocketMessage {
+    WebSocketOpcode opcode = WebSocketOpcode::BINARY;
+    std::string payload;
+};
+
+// Client frames, masked as they must be. Fragments are joined into one message, control
+// frames may come in between. Clients only send control messages here, so they are small.
+class WebSocketParser {
+   public:
+    enum class State { INCOMPLETE, COMPLETE, INVALID, TOO_LARGE };
+
+    const static size_t LIMIT_MESSAGE_SIZE = 65536;
+
+    void feed(const char* data, size_t size) {
+        if (offset_ > 0) {
+            buffer_.erase(0, offset_);
+            offset_ = 0;
+        }
+        buffer_.append(data, size);
+    }
+
+    // One message at a time, call it again until INCOMPLETE
+    State parse(WebSocketMessage& message) {
+        while (true) {
+            const auto* p = reinterpret_cast<const uint8_t*>(buffer_.data() + offset_);
+            const size_t available = buffer_.size() - offset_;
+            if (available < 2) {
+                return State::INCOMPLETE;
+            }
+
+            const bool fin = (p[0] & 0x80);
+            const uint8_t opcode = (p[0] & 0x0F);
+            const bool control = (opcode & 0x08);
+            if ((p[0] & 0x70) || !(p[1] & 0x80) || (opcode > 0x2 && opcode < 0x8) || opcode > 0xA) {
+                // Extensions were never negotiated, clients always mask
+                return State::INVALID;
+            }
+
+            uint64_t length = (p[1] & 0x7F);
+            size_t header_size = 2;
+            if (length == 126) {
+                header_size = 4;
+                if (available < header_size) {
+                    return State::INCOMPLETE;
+                }
+                length = (uint64_t(p[2]) << 8) | p[3];
+            } else if (length == 127) {
+                header_size = 10;
+                if (available < header_size) {
+                    return State::INCOMPLETE;
+                }
+                length = 0;
+                for (int i = 0; i < 8; ++i) {
+                    length = (length << 8) | p[2 + i];
+                }
+            }
+            if (control && (!fin || length > 125)) {
+                return State::INVALID;
+            }
+            if (length > LIMIT_MESSAGE_SIZE || (!control && fragments_.size() + length > LIMIT_MESSAGE_SIZE)) {
+                return State::TOO_LARGE;
+            }
+
+            const uint8_t* mask = p + header_size;
+            header_size += 4;
+            if (available < header_size + length) {
+                return State::INCOMPLETE;
+            }
+            std::string payload(reinterpret_cast<const char*>(p + header_size), length);
+            for (size_t i = 0; i < payload.size(); ++i) {
+                payload[i] ^= mask[i % 4];
+            }
+            offset_ += header_size + length;
+
+            if (control) {
+                message.opcode = static_cast<WebSocketOpcode>(opcode);
+                message.payload = std::move(payload);
+                return State::COMPLETE;
+            }
+            if (opcode == static_cast<uint8_t>(WebSocketOpcode::CONTINUATION)) {
+                if (!fragmented_) {
+                    return State::INVALID;
+                }
+                fragments_ += payload;
+            } else {
+                if (fragmented_) {
+                    return State::INVALID;
+                }
+                fragmented_ = true;
+                fragments_opcode_ = static_cast<WebSocketOpcode>(opcode);
+                fragments_ = std::move(payload);
+            }
+            if (fin) {
+                fragmented_ = false;
+                message.opcode = fragments_opcode_;
+                message.payload = std::move(fragments_);
+                fragments_.clear();
+                return State::COMPLETE;
+            }
+        }
+    }
+
+   private:
+    std::string buffer_;
+    size_t offset_ = 0;
+    std::string fragments_;
+    WebSocketOpcode fragments_opcode_ = WebSocketOpcode::BINARY;
+    bool fragmented_ = false;
+};
+
+// The sending side of an upgraded connection, for any thread. Frames are written whole, one
+// at a time. The listener keeps reading it and closes the socket once close() returned.
+class WebSocket : public nadjieb::utils::NonCopyable {
+   public:
+    const static int LIMIT_SEND_WAIT_MS = 5000;
+
+    WebSocket(SocketFD sockfd, std::string address) : sockfd_(sockfd), address_(std::move(address)) {}
+
+    SocketFD getSocket() const { return sockfd_; }
+
+    const std::string& getAddress() const { return address_; }
+
+    // Returns the payload size, or -1 once the connection is unusable. A full socket buffer
+    // is waited on, a frame cut short would corrupt the stream. Without wait it gives up
+    // right away while another thread is sending, the connection stays usable then.
+    long send(WebSocketOpcode opcode, const char* data, size_t size, bool wait = true) {
+        char header[LIMIT_WEBSOCKET_HEADER_SIZE];
+        const auto header_size = writeWebSocketHeader(header, opcode, size);
+
+        std::unique_lock<std::mutex> lock(mtx_, std::defer_lock);
+        if (wait) {
+            lock.lock();
+        } else if (!lock.try_lock()) {
+            return -1;
+        }
+        if (closed_) {
+            return -1;
+        }
+        const size_t total = header_size + size;
+        size_t offset = 0;
+        while (offset < total) {
+            auto sent = sendVectorViaSocket(sockfd_, header, header_size, data, size, offset);
+            if (sent == NADJIEB_MJPEG_STREAMER_SOCKET_ERROR) {
+                if (NADJIEB_MJPEG_STREAMER_ERRNO == EINTR) {
+                    continue;
+                }
+                if (NADJIEB_MJPEG_STREAMER_ERRNO == NADJIEB_MJPEG_STREAMER_EWOULDBLOCK) {
+                    NADJIEB_MJPEG_STREAMER_POLLFD pfd{sockfd_, POLLWRNORM, 0};
+                    if (pollSockets(&pfd, 1, LIMIT_SEND_WAIT_MS) > 0 && !(pfd.revents & (POLLERR | POLLHUP | POLLNVAL))) {
+                        continue;
+                    }
+                }
+                closed_ = true;
+                return -1;
+            }
+            offset += sent;
+        }
+        return static_cast<long>(size);
+    }
+
+    // Fails a send in progress right away, nothing is sent afterwards
+    void close() {
+        shutdownSocket(sockfd_);
+        std::unique_lock<std::mutex> lock(mtx_);
+        closed_ = true;
+    }
+
+   private:
+    const SocketFD sockfd_;
+    const std::string address_;
+    std::mutex mtx_;
+    bool closed_ = false;
+};
+}  // namespace net
+}  // namespace nadjieb
+
 
+#include <algorithm>
 #include <functional>
 #include <iostream>
+#include <memory>
 #include <stdexcept>
 #include <thread>
+#include <unordered_set>
 #include <vector>
 
 namespace nadjieb {
@@ -383,10 +925,20 @@ namespace net {
 struct OnMessageCallbackResponse {
     bool close_conn = false;
     bool end_listener = false;
+
+    // Sent by the listener, resuming on writability. The body is shared, not copied,
+    // and close_conn takes effect once everything is sent.
+    std::string response;
+    std::shared_ptr<const std::string> body;
+
+    // The handshake was answered already, the connection carries WebSocket frames from now on
+    bool upgrade = false;
 };
 
-using OnMessageCallback = std::function<OnMessageCallbackResponse(const SocketFD&, const std::string&)>;
+using OnMessageCallback = std::function<OnMessageCallbackResponse(const SocketFD&, const HTTPRequestParser&)>;
 using OnBeforeCloseCallback = std::function<void(const SocketFD&)>;
+// Every message of an upgraded connection, control frames included. Returns true to close it.
+using OnWebSocketMessageCallback = std::function<bool(const SocketFD&, const WebSocketMessage&)>;
 
 class Listener : public nadjieb::utils::NonCopyable, public nadjieb::utils::Runnable {
    public:
@@ -402,6 +954,11 @@ class Listener : public nadjieb::utils::NonCopyable, public nadjieb::utils::Runn
         return *this;
     }
 
+    Listener& withOnWebSocketMessageCallback(const OnWebSocketMessageCallback& callback) {
+        on_websocket_message_cb_ = callback;
+        return *this;
+    }
+
     void stop() {
         end_listener_ = true;
         if (thread_listener_.joinable()) {
@@ -425,9 +982,127 @@ class Listener : public nadjieb::utils::NonCopyable, public nadjieb::utils::Runn
         bindSocket(listen_sd_, "0.0.0.0", port);
         listenOnSocket(listen_sd_, SOMAXCONN);
 
-        fds_.emplace_back(NADJIEB_MJPEG_STREAMER_POLLFD{listen_sd_, POLLRDNORM, 0});
+#ifdef NADJIEB_MJPEG_STREAMER_PLATFORM_LINUX
+        runEpoll();
+#else
+        runPoll();
+#endif
+
+        closeAll();
+    }
+
+   private:
+    SocketFD listen_sd_ = NADJIEB_MJPEG_STREAMER_INVALID_SOCKET;
+    bool end_listener_ = true;
+    std::vector<NADJIEB_MJPEG_STREAMER_POLLFD> fds_;
+    OnMessageCallback on_message_cb_;
+    OnBeforeCloseCallback on_before_close_cb_;
+    OnWebSocketMessageCallback on_websocket_message_cb_;
+    std::thread thread_listener_;
+
+    struct ConnectionState {
+        HTTPRequestParser parser;
+        std::string out_header;
+        std::shared_ptr<const std::string> out_body;
+        size_t out_offset = 0;
+        bool close_after_out = false;
+        std::unique_ptr<WebSocketParser> websocket; // Once upgraded
+    };
 
-        std::string buff(4096, 0);
+    enum class FlushResult { DONE, PENDING, FAILED };
+
+    std::unordered_map<SocketFD, ConnectionState> states_;
+
+#ifdef NADJIEB_MJPEG_STREAMER_PLATFORM_LINUX
+    int epoll_fd_ = -1;
+    std::unordered_set<SocketFD> connections_;
+
+    const static int LIMIT_EPOLL_EVENTS = 64;
+
+    // Edge-triggered: every wakeup drains accept() or recv() until EAGAIN,
+    // adding and removing a connection is a single epoll_ctl()
+    void runEpoll() {
+        epoll_fd_ = ::epoll_create1(EPOLL_CLOEXEC);
+        panicIfUnexpected(epoll_fd_ < 0, "epoll_create1() failed");
+
+        struct epoll_event listen_event = {};
+        listen_event.events = EPOLLIN | EPOLLET;
+        listen_event.data.fd = listen_sd_;
+        panicIfUnexpected(
+            ::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_sd_, &listen_event) < 0, "epoll_ctl() failed");
+
+        struct epoll_event events[LIMIT_EPOLL_EVENTS];
+
+        state_ = nadjieb::utils::State::RUNNING;
+
+        while (!end_listener_) {
+            int event_count = ::epoll_wait(epoll_fd_, events, LIMIT_EPOLL_EVENTS, 100);
+            if (event_count < 0) {
+                panicIfUnexpected(errno != EINTR, "epoll_wait() failed");
+                continue;
+            }
+
+            for (int i = 0; i < event_count && !end_listener_; ++i) {
+                const auto fd = events[i].data.fd;
+
+                if (fd == listen_sd_) {
+                    acceptAll();
+                    continue;
+                }
+
+                // EPOLLERR also flags zero-copy completions of stream clients, the publisher reaps them
+                bool close_conn = (events[i].events & EPOLLHUP)
+                                  || ((events[i].events & EPOLLERR) && getSocketError(fd) != 0);
+                if (!close_conn && (events[i].events & EPOLLOUT)) {
+                    close_conn = onWritable(fd);
+                }
+                if (!close_conn && (events[i].events & (EPOLLIN | EPOLLRDHUP))) {
+                    close_conn = receive(fd);
+                }
+
+                if (close_conn) {
+                    closeConnection(fd);
+                }
+            }
+        }
+    }
+
+    void acceptAll() {
+        while (true) {
+            auto new_socket = acceptNewNonblockSocket(listen_sd_);
+            if (new_socket == NADJIEB_MJPEG_STREAMER_INVALID_SOCKET) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                panicIfUnexpected(errno != EAGAIN && errno != EWOULDBLOCK, "accept4() failed");
+                break;
+            }
+
+            // Edge-triggered EPOLLOUT only fires when a full socket buffer drains,
+            // that resumes pending responses without re-arming
+            struct epoll_event event = {};
+            event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            event.data.fd = new_socket;
+            if (::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, new_socket, &event) < 0) {
+                std::cerr << "epoll_ctl() failed" << std::endl;
+                closeSocket(new_socket);
+                continue;
+            }
+            connections_.insert(new_socket);
+        }
+    }
+
+    void closeConnection(SocketFD fd) {
+        on_before_close_cb_(fd);
+        ::epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+        connections_.erase(fd);
+        forgetConnection(fd);
+        closeSocket(fd);
+    }
+#endif
+
+    void runPoll() {
+        fds_.emplace_back(NADJIEB_MJPEG_STREAMER_POLLFD{listen_sd_, POLLRDNORM, 0});
 
         state_ = nadjieb::utils::State::RUNNING;
 
@@ -449,13 +1124,29 @@ class Listener : public nadjieb::utils::NonCopyable, public nadjieb::utils::Runn
 
                 if (fds_[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
                     on_before_close_cb_(fds_[i].fd);
+                    forgetConnection(fds_[i].fd);
                     closeSocket(fds_[i].fd);
                     fds_[i].fd = NADJIEB_MJPEG_STREAMER_INVALID_SOCKET;
                     compress_array = true;
                     continue;
                 }
 
-                panicIfUnexpected(fds_[i].revents != POLLRDNORM, "revents != POLLRDNORM");
+                panicIfUnexpected(
+                    (fds_[i].revents & ~(POLLRDNORM | POLLWRNORM)) != 0, "revents != POLLRDNORM | POLLWRNORM");
+
+                if ((fds_[i].revents & POLLWRNORM) && fds_[i].fd != listen_sd_) {
+                    if (onWritable(fds_[i].fd)) {
+                        on_before_close_cb_(fds_[i].fd);
+                        forgetConnection(fds_[i].fd);
+                        closeSocket(fds_[i].fd);
+                        fds_[i].fd = NADJIEB_MJPEG_STREAMER_INVALID_SOCKET;
+                        compress_array = true;
+                        continue;
+                    }
+                    if (!(fds_[i].revents & POLLRDNORM)) {
+                        continue;
+                    }
+                }
 
                 if (fds_[i].fd == listen_sd_) {
                     do {
@@ -470,84 +1161,250 @@ class Listener : public nadjieb::utils::NonCopyable, public nadjieb::utils::Runn
 
                         fds_.emplace_back(NADJIEB_MJPEG_STREAMER_POLLFD{new_socket, POLLRDNORM, 0});
                     } while (true);
-                } else {
-                    std::string data;
-                    bool close_conn = false;
+                } else if (receive(fds_[i].fd)) {
+                    on_before_close_cb_(fds_[i].fd);
+                    forgetConnection(fds_[i].fd);
+                    closeSocket(fds_[i].fd);
+                    fds_[i].fd = NADJIEB_MJPEG_STREAMER_INVALID_SOCKET;
+                    compress_array = true;
+                }
+            }
 
-                    do {
-                        auto size = readFromSocket(fds_[i].fd, &buff[0], buff.size(), 0);
-                        if (size == NADJIEB_MJPEG_STREAMER_SOCKET_ERROR) {
-                            if (NADJIEB_MJPEG_STREAMER_ERRNO != NADJIEB_MJPEG_STREAMER_EWOULDBLOCK) {
-                                std::cerr << "readFromSocket() failed" << std::endl;
-                                close_conn = true;
-                            }
-                            break;
-                        }
+            if (compress_array) {
+                compress();
+            }
+        }
+    }
 
-                        if (size == 0) {
-                            close_conn = true;
-                            break;
-                        }
+    // Reads everything available and hands each complete request to on_message_cb_,
+    // returns true to close the connection
+    bool receive(SocketFD fd) {
+        auto& state = states_[fd];
+        auto& parser = state.parser;
+        if (state.websocket != nullptr) {
+            return receiveWebSocket(fd, state);
+        }
 
-                        data += buff.substr(0, size);
-                    } while (true);
+        while (true) {
+            if (parser.spaceSize() == 0) {
+                return dispatch(fd, state);
+            }
 
-                    if (!close_conn) {
-                        auto resp = on_message_cb_(fds_[i].fd, data);
-                        if (resp.close_conn) {
-                            close_conn = resp.close_conn;
-                        }
+            auto size = readFromSocket(fd, parser.space(), parser.spaceSize(), 0);
+            if (size == NADJIEB_MJPEG_STREAMER_SOCKET_ERROR) {
+                if (NADJIEB_MJPEG_STREAMER_ERRNO != NADJIEB_MJPEG_STREAMER_EWOULDBLOCK) {
+                    std::cerr << "readFromSocket() failed" << std::endl;
+                    return true;
+                }
+                return false;
+            }
 
-                        if (resp.end_listener) {
-                            end_listener_ = resp.end_listener;
-                        }
-                    }
+            if (size == 0) {
+                return true;
+            }
 
-                    if (close_conn) {
-                        on_before_close_cb_(fds_[i].fd);
-                        closeSocket(fds_[i].fd);
-                        fds_[i].fd = NADJIEB_MJPEG_STREAMER_INVALID_SOCKET;
-                        compress_array = true;
-                    }
+            parser.commit(size);
+            if (dispatch(fd, state)) {
+                return true;
+            }
+            if (state.websocket != nullptr) {
+                // Read up to EAGAIN by now
+                return false;
+            }
+        }
+    }
+
+    // Drains the socket, the messages go to on_websocket_message_cb_ in order
+    bool receiveWebSocket(SocketFD fd, ConnectionState& state) {
+        char buffer[4096];
+        WebSocketMessage message;
+
+        while (true) {
+            while (true) {
+                auto parsed = state.websocket->parse(message);
+                if (parsed == WebSocketParser::State::INCOMPLETE) {
+                    break;
+                }
+                if (parsed != WebSocketParser::State::COMPLETE || on_websocket_message_cb_(fd, message)) {
+                    return true;
                 }
             }
 
-            if (compress_array) {
-                compress();
+            auto size = readFromSocket(fd, buffer, sizeof(buffer), 0);
+            if (size == NADJIEB_MJPEG_STREAMER_SOCKET_ERROR) {
+                if (NADJIEB_MJPEG_STREAMER_ERRNO != NADJIEB_MJPEG_STREAMER_EWOULDBLOCK) {
+                    std::cerr << "readFromSocket() failed" << std::endl;
+                    return true;
+                }
+                return false;
+            }
+            if (size == 0) {
+                return true;
             }
+            state.websocket->feed(buffer, size);
         }
+    }
 
-        closeAll();
+    // Handles the complete requests in order, one response in flight at a time
+    bool dispatch(SocketFD fd, ConnectionState& state) {
+        auto& parser = state.parser;
+
+        while (state.out_body == nullptr && state.out_header.empty()) {
+            auto parsed = parser.parse();
+            if (parsed == HTTPRequestParser::State::INCOMPLETE) {
+                return false;
+            }
+
+            if (parsed != HTTPRequestParser::State::COMPLETE) {
+                static const char bad_request[] = "HTTP/1.1 400 Bad Request\r\nConnection: close\r\n\r\n";
+                static const char too_large[]
+                    = "HTTP/1.1 431 Request Header Fields Too Large\r\nConnection: close\r\n\r\n";
+                if (parsed == HTTPRequestParser::State::INVALID) {
+                    sendViaSocket(fd, bad_request, sizeof(bad_request) - 1, 0);
+                } else {
+                    sendViaSocket(fd, too_large, sizeof(too_large) - 1, 0);
+                }
+                return true;
+            }
+
+            auto resp = on_message_cb_(fd, parser);
+            parser.consume();
+            if (resp.end_listener) {
+                end_listener_ = resp.end_listener;
+            }
+
+            if (resp.upgrade) {
+                if (on_websocket_message_cb_ == nullptr) {
+                    return true;
+                }
+                // Whatever the client sent right after the handshake is already frames
+                state.websocket = std::make_unique<WebSocketParser>();
+                const auto remaining = parser.remaining();
+                state.websocket->feed(remaining.data(), remaining.size());
+                return receiveWebSocket(fd, state);
+            }
+
+            if (resp.response.empty() && resp.body == nullptr) {
+                if (resp.close_conn) {
+                    return true;
+                }
+                continue;
+            }
+
+            state.out_header = std::move(resp.response);
+            state.out_body = std::move(resp.body);
+            state.out_offset = 0;
+            state.close_after_out = resp.close_conn;
+            auto flushed = flush(fd, state);
+            if (flushed == FlushResult::FAILED || (flushed == FlushResult::DONE && state.close_after_out)) {
+                return true;
+            }
+            if (flushed == FlushResult::PENDING) {
+                setWantWrite(fd, true);
+            }
+        }
+        return false;
     }
 
-   private:
-    SocketFD listen_sd_ = NADJIEB_MJPEG_STREAMER_INVALID_SOCKET;
-    bool end_listener_ = true;
-    std::vector<NADJIEB_MJPEG_STREAMER_POLLFD> fds_;
-    OnMessageCallback on_message_cb_;
-    OnBeforeCloseCallback on_before_close_cb_;
-    std::thread thread_listener_;
+    bool onWritable(SocketFD fd) {
+        auto it = states_.find(fd);
+        if (it == states_.end() || (it->second.out_body == nullptr && it->second.out_header.empty())) {
+            return false;
+        }
 
-    void compress() {
-        for (auto it = fds_.begin(); it != fds_.end();) {
-            if (it->fd == NADJIEB_MJPEG_STREAMER_INVALID_SOCKET) {
-                it = fds_.erase(it);
-            } else {
-                ++it;
+        auto& state = it->second;
+        auto flushed = flush(fd, state);
+        if (flushed == FlushResult::PENDING) {
+            return false;
+        }
+        setWantWrite(fd, false);
+        if (flushed == FlushResult::FAILED || state.close_after_out) {
+            return true;
+        }
+        // receive() stopped reading while the response was pending, with the parser full
+        // there may be pipelined requests left in the socket, and no edge for them
+        return (dispatch(fd, state) || receive(fd));
+    }
+
+    FlushResult flush(SocketFD fd, ConnectionState& state) {
+        static const std::string empty;
+        const auto& body = (state.out_body != nullptr ? *state.out_body : empty);
+        const auto total = state.out_header.size() + body.size();
+
+        while (state.out_offset < total) {
+            auto sent = sendVectorViaSocket(
+                fd, state.out_header.data(), state.out_header.size(), body.data(), body.size(), state.out_offset);
+            if (sent == NADJIEB_MJPEG_STREAMER_SOCKET_ERROR) {
+                if (NADJIEB_MJPEG_STREAMER_ERRNO == NADJIEB_MJPEG_STREAMER_EWOULDBLOCK) {
+                    return FlushResult::PENDING;
+                }
+                if (NADJIEB_MJPEG_STREAMER_ERRNO == EINTR) {
+                    continue;
+                }
+                return FlushResult::FAILED;
+            }
+            state.out_offset += sent;
+        }
+
+        state.out_header.clear();
+        state.out_body.reset();
+        state.out_offset = 0;
+        return FlushResult::DONE;
+    }
+
+    void setWantWrite(SocketFD fd, bool enable) {
+#ifdef NADJIEB_MJPEG_STREAMER_PLATFORM_LINUX
+        // Already registered for edge-triggered EPOLLOUT
+        (void)fd;
+        (void)enable;
+#else
+        for (auto& pfd : fds_) {
+            if (pfd.fd == fd) {
+                pfd.events = (enable ? POLLRDNORM | POLLWRNORM : POLLRDNORM);
+                break;
             }
         }
+#endif
+    }
+
+    void forgetConnection(SocketFD fd) { states_.erase(fd); }
+
+    void compress() {
+        fds_.erase(
+            std::remove_if(
+                fds_.begin(),
+                fds_.end(),
+                [](const NADJIEB_MJPEG_STREAMER_POLLFD& pfd) { return pfd.fd == NADJIEB_MJPEG_STREAMER_INVALID_SOCKET; }),
+            fds_.end());
     }
 
     void closeAll() {
         state_ = nadjieb::utils::State::TERMINATING;
         for (auto& pfd : fds_) {
-            if (pfd.fd >= 0) {
+            if (pfd.fd >= 0 && pfd.fd != listen_sd_) {
                 on_before_close_cb_(pfd.fd);
                 closeSocket(pfd.fd);
             }
         }
-
         fds_.clear();
+        states_.clear();
+
+#ifdef NADJIEB_MJPEG_STREAMER_PLATFORM_LINUX
+        for (auto fd : connections_) {
+            on_before_close_cb_(fd);
+            closeSocket(fd);
+        }
+        connections_.clear();
+        if (epoll_fd_ >= 0) {
+            ::close(epoll_fd_);
+            epoll_fd_ = -1;
+        }
+#endif
+
+        if (listen_sd_ != NADJIEB_MJPEG_STREAMER_INVALID_SOCKET) {
+            closeSocket(listen_sd_);
+            listen_sd_ = NADJIEB_MJPEG_STREAMER_INVALID_SOCKET;
+        }
         destroySocket();
         state_ = nadjieb::utils::State::TERMINATED;
     }
@@ -557,274 +1414,1932 @@ class Listener : public nadjieb::utils::NonCopyable, public nadjieb::utils::Runn
             closeAll();
             throw std::runtime_error(message);
         }
-    }
+    }
+};
+}  // namespace net
+}  // namespace nadjieb
+
+// #include <nadjieb/net/publisher.hpp>
+
+
+// #include <nadjieb/net/socket.hpp>
+
+// #include <nadjieb/net/topic.hpp>
+
+
+// #include <nadjieb/net/socket.hpp>
+
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+namespace nadjieb {
+namespace net {
+// A multipart part: the boundary and headers are serialized once per frame,
+// then every client sends both pieces with a single writev()
+struct FramePart {
+    std::string header;
+    std::string body;
+
+    // Identifies the allocation behind body, a new one whenever the body is reallocated, so
+    // a publisher can keep the memory registered with the kernel while it stays the same
+    uint64_t storage = 0;
+
+    // Content hash for validators, computed on first use since most frames never need one
+    mutable std::atomic<uint64_t> hash{0};
+
+    uint64_t getHash() const {
+        auto value = hash.load(std::memory_order_relaxed);
+        if (value == 0) {
+            // FNV-1a, zero is reserved for "not computed yet"
+            value = 14695981039346656037ULL;
+            for (unsigned char c : body) {
+                value = (value ^ c) * 1099511628211ULL;
+            }
+            value = (value == 0 ? 1 : value);
+            hash.store(value, std::memory_order_relaxed);
+        }
+        return value;
+    }
+};
+
+// Published frames are immutable and shared by every client still sending them
+using Frame = std::shared_ptr<const FramePart>;
+
+// The per-client state of a publisher, kept in the topic so a new frame reaches its clients
+// without looking any of them up
+struct Subscriber {
+    virtual ~Subscriber() = default;
+
+    SocketFD sockfd;
+};
+
+using Subscribers = std::vector<std::shared_ptr<Subscriber>>;
+
+class Topic {
+   public:
+    Frame setBuffer(const std::string& buffer) { return setBuffer(buffer.data(), buffer.size()); }
+
+    // Reuses a buffer that no client holds anymore instead of allocating a new one
+    Frame setBuffer(const char* data, size_t size, uint64_t* generation = nullptr) {
+        std::unique_lock lock(buffer_mtx_);
+
+        std::shared_ptr<FramePart> buffer;
+        for (const auto& candidate : buffers_) {
+            if (candidate.use_count() == 1) {
+                buffer = candidate;
+                break;
+            }
+        }
+        if (buffer == nullptr) {
+            buffer = std::make_shared<FramePart>();
+            if (buffers_.size() < LIMIT_BUFFERS) {
+                buffers_.push_back(buffer);
+            }
+        }
+
+        buffer->header.assign(
+            "--nadjiebmjpegstreamer\r\n"
+            "Content-Type: image/jpeg\r\n"
+            "Content-Length: ");
+        buffer->header.append(std::to_string(size));
+        buffer->header.append("\r\n\r\n");
+        const auto* storage_data = buffer->body.data();
+        const auto storage_capacity = buffer->body.capacity();
+        buffer->body.assign(data, size);
+        if (buffer->storage == 0 || buffer->body.data() != storage_data
+            || buffer->body.capacity() != storage_capacity) {
+            buffer->storage = next_storage_.fetch_add(1) + 1;
+        }
+        buffer->hash.store(0, std::memory_order_relaxed);
+        Frame frame = buffer;
+        std::atomic_store(&frame_, frame);
+        auto new_generation = generation_.fetch_add(1) + 1;
+        if (generation != nullptr) {
+            *generation = new_generation;
+        }
+        return frame;
+    }
+
+    // Lock-free for readers, so the reactors never wait on a publishing thread
+    Frame getFrame() { return std::atomic_load(&frame_); }
+
+    std::string getBuffer() {
+        auto frame = getFrame();
+        return (frame == nullptr ? std::string() : frame->body);
+    }
+
+    uint64_t getGeneration() { return generation_.load(); }
+
+    // An immutable snapshot, copied on write, so publishing never locks against (un)subscribing
+    std::shared_ptr<const Subscribers> getSubscribers() { return std::atomic_load(&subscribers_); }
+
+    void subscribe(const std::shared_ptr<Subscriber>& subscriber) {
+        std::unique_lock lock(subscribers_mtx_);
+        auto current = std::atomic_load(&subscribers_);
+        auto next = (current == nullptr ? std::make_shared<Subscribers>() : std::make_shared<Subscribers>(*current));
+        next->push_back(subscriber);
+        std::atomic_store(&subscribers_, std::shared_ptr<const Subscribers>(std::move(next)));
+        addClient();
+    }
+
+    void unsubscribe(SocketFD sockfd) {
+        std::unique_lock lock(subscribers_mtx_);
+        auto current = std::atomic_load(&subscribers_);
+        if (current == nullptr) {
+            return;
+        }
+        auto next = std::make_shared<Subscribers>();
+        next->reserve(current->size());
+        for (const auto& subscriber : *current) {
+            if (subscriber->sockfd != sockfd) {
+                next->push_back(subscriber);
+            }
+        }
+        if (next->size() != current->size()) {
+            std::atomic_store(&subscribers_, std::shared_ptr<const Subscribers>(std::move(next)));
+            removeClient();
+        }
+    }
+
+    void addClient() { ++num_clients_; }
+
+    void removeClient() { --num_clients_; }
+
+    bool hasClient() { return (num_clients_ > 0); }
+
+   private:
+    Frame frame_;
+    std::atomic<uint64_t> generation_{0};
+    std::vector<std::shared_ptr<FramePart>> buffers_;
+    std::mutex buffer_mtx_;
+    // Shared by all topics, a storage id names one allocation in the whole process
+    inline static std::atomic<uint64_t> next_storage_{0};
+
+    std::atomic<int> num_clients_{0};
+
+    std::shared_ptr<const Subscribers> subscribers_;
+    std::mutex subscribers_mtx_;
+
+    // Enough for the newest frame plus one in flight per typical client
+    const static size_t LIMIT_BUFFERS = 8;
+};
+}  // namespace net
+}  // namespace nadjieb
+
+// #include <nadjieb/net/zero_copy.hpp>
+
+
+// #include <nadjieb/net/socket.hpp>
+
+// #include <nadjieb/net/topic.hpp>
+
+
+#ifdef NADJIEB_MJPEG_STREAMER_PLATFORM_LINUX
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+
+// Older libc headers predate the uapi definitions
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+#endif
+
+#include <cstdint>
+#include <deque>
+#include <utility>
+
+namespace nadjieb {
+namespace net {
+// Sends a part with MSG_ZEROCOPY when enough of it is left to pay for the page pinning and
+// the completion notification, instead of copying it into the socket buffer once per client.
+// The kernel reads the pages until it reports the send complete on the error queue,
+// so the frames stay referenced until then and Topic does not reuse their buffers.
+class ZeroCopySender {
+   public:
+    // Parts smaller than this are copied, the default once enabled
+    const static size_t DEFAULT_THRESHOLD = 64 * 1024;
+
+    void enable(SocketFD socket) {
+#ifdef NADJIEB_MJPEG_STREAMER_PLATFORM_LINUX
+        const int one = 1;
+        enabled_ = (::setsockopt(socket, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0);
+#else
+        (void)socket;
+#endif
+    }
+
+    long send(SocketFD socket, const Frame& frame, size_t offset, size_t threshold) {
+        const auto total = frame->header.size() + frame->body.size();
+#ifdef NADJIEB_MJPEG_STREAMER_PLATFORM_LINUX
+        if (!pending_.empty()) {
+            reap(socket);
+        }
+        if (enabled_ && threshold > 0 && total - offset >= threshold) {
+            auto sent = sendZeroCopy(socket, *frame, offset);
+            if (sent >= 0) {
+                if (pending_.empty() || pending_.back().second != frame) {
+                    pending_.emplace_back(next_id_, frame);
+                } else {
+                    pending_.back().first = next_id_;
+                }
+                ++next_id_;
+                return sent;
+            }
+            // Out of optmem for pinned pages, copy this time
+            if (errno != ENOBUFS) {
+                return sent;
+            }
+        }
+#else
+        (void)threshold;
+        (void)total;
+#endif
+        return sendVectorViaSocket(
+            socket, frame->header.data(), frame->header.size(), frame->body.data(), frame->body.size(), offset);
+    }
+
+    // Drops the frames the kernel is done with
+    void reap(SocketFD socket) {
+#ifdef NADJIEB_MJPEG_STREAMER_PLATFORM_LINUX
+        while (!pending_.empty()) {
+            char control[128];
+            struct msghdr msg = {};
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            if (::recvmsg(socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+                return;
+            }
+
+            for (auto* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                      || (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))) {
+                    continue;
+                }
+                const auto* err = reinterpret_cast<const struct sock_extended_err*>(CMSG_DATA(cmsg));
+                if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                    continue;
+                }
+
+                // TCP completes in order, ee_data is the last id of the range
+                const uint32_t done = err->ee_data;
+                while (!pending_.empty() && static_cast<int32_t>(done - pending_.front().first) >= 0) {
+                    pending_.pop_front();
+                }
+
+                // The kernel fell back to copying (loopback, no scatter-gather): stop paying for the pinning
+                if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                    if (++copied_ >= LIMIT_COPIED) {
+                        enabled_ = false;
+                    }
+                } else {
+                    copied_ = 0;
+                }
+            }
+        }
+#else
+        (void)socket;
+#endif
+    }
+
+   private:
+    bool enabled_ = false;
+    uint32_t next_id_ = 0;
+    unsigned copied_ = 0;
+    std::deque<std::pair<uint32_t, Frame>> pending_;
+
+    const static unsigned LIMIT_COPIED = 8;
+
+#ifdef NADJIEB_MJPEG_STREAMER_PLATFORM_LINUX
+    static long sendZeroCopy(SocketFD socket, const FramePart& frame, size_t offset) {
+        struct iovec iov[2];
+        int count = 0;
+        if (offset < frame.header.size()) {
+            iov[count++] = iovec{(void*)(frame.header.data() + offset), frame.header.size() - offset};
+            offset = 0;
+        } else {
+            offset -= frame.header.size();
+        }
+        iov[count++] = iovec{(void*)(frame.body.data() + offset), frame.body.size() - offset};
+
+        struct msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        return ::sendmsg(socket, &msg, MSG_ZEROCOPY);
+    }
+#endif
+};
+}  // namespace net
+}  // namespace nadjieb
+
+// #include <nadjieb/utils/non_copyable.hpp>
+
+// #include <nadjieb/utils/runnable.hpp>
+
+
+#ifdef NADJIEB_MJPEG_STREAMER_PLATFORM_LINUX
+#include <sys/eventfd.h>
+#endif
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace nadjieb {
+namespace net {
+enum class PublisherMode {
+    // A pool of workers shared by all the clients
+    WORKERS,
+    // Clients sharded across event loops that own their sockets, Linux only
+    REACTORS,
+    // One thread batching the sends of every client into io_uring submissions, Linux 5.6+,
+    // from registered frame buffers on 5.13+. Falls back to WORKERS where io_uring is unavailable
+    URING
+};
+
+// Topics and the client interface, common for all the publisher modes
+class PublisherBase : public nadjieb::utils::NonCopyable, public nadjieb::utils::Runnable {
+   public:
+    virtual ~PublisherBase() = default;
+
+    virtual void stop() = 0;
+    virtual void add(const SocketFD& sockfd, const std::string& path) = 0;
+    virtual void removeClient(const SocketFD& sockfd) = 0;
+    virtual void enqueue(Topic& topic, const char* data, size_t size) = 0;
+
+    void enqueue(const std::string& path, const char* data, size_t size) { enqueue(getTopic(path), data, size); }
+
+    void enqueue(const std::string& path, const std::string& buffer) { enqueue(path, buffer.data(), buffer.size()); }
+
+    // Stays valid until stop(), saves the lookup of the path on every frame
+    Topic& getTopicHandle(const std::string& path) { return getTopic(path); }
+
+    bool pathExists(const std::string& path) {
+        std::shared_lock lock(topics_mtx_);
+        return (topics_.find(path) != topics_.end());
+    }
+
+    bool hasClient(const std::string& path) {
+        std::shared_lock lock(topics_mtx_);
+        auto it = topics_.find(path);
+        return (it != topics_.end() && it->second.hasClient());
+    }
+
+    // Parts at least this large are sent with MSG_ZEROCOPY, 0 always copies.
+    // Applies to the clients added afterwards.
+    void setZeroCopyThreshold(size_t threshold) { zero_copy_threshold_ = threshold; }
+
+    // The latest published frame of the path, nullptr before the first one
+    Frame getFrame(const std::string& path) {
+        std::shared_lock lock(topics_mtx_);
+        auto it = topics_.find(path);
+        return (it != topics_.end() ? it->second.getFrame() : nullptr);
+    }
+
+   protected:
+    std::atomic<size_t> zero_copy_threshold_{ZeroCopySender::DEFAULT_THRESHOLD};
+
+    Topic& getTopic(const std::string& path) {
+        {
+            std::shared_lock lock(topics_mtx_);
+            auto it = topics_.find(path);
+            if (it != topics_.end()) {
+                return it->second;
+            }
+        }
+        // References to the elements survive rehashing, topics are only erased on stop()
+        std::unique_lock lock(topics_mtx_);
+        return topics_[path];
+    }
+
+    void clearTopics() {
+        std::unique_lock lock(topics_mtx_);
+        topics_.clear();
+    }
+
+   private:
+    std::unordered_map<std::string, Topic> topics_;
+    std::shared_mutex topics_mtx_;
+};
+
+class Publisher : public PublisherBase {
+   public:
+    virtual ~Publisher() { stop(); }
+
+    void start(int num_workers = std::thread::hardware_concurrency()) {
+        state_ = nadjieb::utils::State::BOOTING;
+        end_publisher_ = false;
+#ifdef NADJIEB_MJPEG_STREAMER_PLATFORM_LINUX
+        wakeup_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wakeup_fd_ < 0) {
+            throw std::runtime_error("eventfd() failed\n");
+        }
+#endif
+        workers_.reserve(num_workers);
+        for (auto i = 0; i < num_workers; ++i) {
+            workers_.emplace_back(&Publisher::worker, this);
+        }
+        waiter_ = std::thread(&Publisher::waiter, this);
+        state_ = nadjieb::utils::State::RUNNING;
+    }
+
+    void stop() override {
+        state_ = nadjieb::utils::State::TERMINATING;
+        {
+            std::unique_lock<std::mutex> lock(ready_mtx_);
+            end_publisher_ = true;
+            wakeWaiter();
+        }
+        condition_.notify_all();
+        blocked_condition_.notify_all();
+
+        if (!workers_.empty()) {
+            for (auto& w : workers_) {
+                if (w.joinable()) {
+                    w.join();
+                }
+            }
+            workers_.clear();
+        }
+        if (waiter_.joinable()) {
+            waiter_.join();
+        }
+#ifdef NADJIEB_MJPEG_STREAMER_PLATFORM_LINUX
+        if (wakeup_fd_ >= 0) {
+            ::close(wakeup_fd_);
+            wakeup_fd_ = -1;
+        }
+#endif
+
+        std::unique_lock<std::mutex> lock(ready_mtx_);
+        ready_.clear();
+        ready_head_ = 0;
+        blocked_.clear();
+        lock.unlock();
+        std::unique_lock<std::mutex> clients_lock(clients_mtx_);
+        clients_.clear();
+        clients_lock.unlock();
+        clearTopics();
+        state_ = nadjieb::utils::State::TERMINATED;
+    }
+
+    void add(const SocketFD& sockfd, const std::string& path) override {
+        if (end_publisher_) {
+            return;
+        }
+
+        auto& topic = getTopic(path);
+        auto client = std::make_shared<Client>();
+        client->sockfd = sockfd;
+        client->topic = &topic;
+        client->zero_copy_threshold = zero_copy_threshold_;
+        if (client->zero_copy_threshold > 0) {
+            client->zero_copy.enable(sockfd);
+        }
+        size_t num_clients;
+        {
+            std::unique_lock<std::mutex> lock(clients_mtx_);
+            clients_[sockfd] = client;
+            num_clients = clients_.size();
+        }
+        topic.subscribe(client);
+
+        // Starts with the current frame instead of waiting for the next one. The queues grow
+        // here, with the clients, and not while frames are sent: a client is queued once at
+        // most and popReady() drops the front at half.
+        std::unique_lock<std::mutex> lock(ready_mtx_);
+        ready_.reserve(2 * num_clients);
+        blocked_.reserve(num_clients);
+        schedule(client);
+        lock.unlock();
+        condition_.notify_one();
+        blocked_condition_.notify_one();
+    }
+
+    void removeClient(const SocketFD& sockfd) override {
+        std::shared_ptr<Client> client;
+        {
+            std::unique_lock<std::mutex> lock(clients_mtx_);
+            auto it = clients_.find(sockfd);
+            if (it == clients_.end()) {
+                return;
+            }
+            client = std::move(it->second);
+            clients_.erase(it);
+        }
+        client->topic->unsubscribe(sockfd);
+
+        // The socket is closed right after this, don't let a worker write to a reused fd
+        std::unique_lock<std::mutex> lock(ready_mtx_);
+        while (true) {
+            auto state = client->state.load();
+            if (state == ClientState::SENDING) {
+                sent_condition_.wait(lock);
+                continue;
+            }
+            if (client->state.compare_exchange_weak(state, ClientState::REMOVED)) {
+                if (state == ClientState::BLOCKED) {
+                    // Nor the waiter keep polling it
+                    wakeWaiter();
+                }
+                break;
+            }
+        }
+    }
+
+    using PublisherBase::enqueue;
+
+    // Lock-free in the number of clients: one atomic per client, then a single
+    // lock to hand the idle ones to the workers
+    void enqueue(Topic& topic, const char* data, size_t size) override {
+        if (end_publisher_) {
+            return;
+        }
+
+        topic.setBuffer(data, size);
+        auto subscribers = topic.getSubscribers();
+        if (subscribers == nullptr || subscribers->empty()) {
+            return;
+        }
+
+        bool scheduled = false;
+        std::unique_lock<std::mutex> lock(ready_mtx_);
+        for (const auto& subscriber : *subscribers) {
+            // Only Publisher subscribes its own clients to the topics it owns
+            scheduled |= schedule(std::static_pointer_cast<Client>(subscriber));
+        }
+        lock.unlock();
+
+        if (scheduled) {
+            condition_.notify_all();
+        }
+    }
+
+   private:
+    enum class ClientState {
+        IDLE, // Up to date, or nothing to send
+        SCHEDULED, // In ready_
+        SENDING, // Owned by a worker
+        BLOCKED, // Waiting for POLLOUT in blocked_
+        FAILED, // The listener will close it
+        REMOVED
+    };
+
+    // No frame queue per client: at a part boundary the worker picks the newest frame of the
+    // topic, so a slow client skips frames. The part being sent is kept with its offset,
+    // so a new frame only starts at a boundary even if the socket takes several wakeups.
+    // Everything but the state is touched only by the worker that moved it to SENDING.
+    struct Client : public Subscriber {
+        Topic* topic = nullptr;
+        std::atomic<ClientState> state{ClientState::IDLE};
+        Frame current;
+        size_t offset = 0;
+        uint64_t generation = 0;
+        size_t zero_copy_threshold = 0;
+        ZeroCopySender zero_copy;
+    };
+
+    std::condition_variable condition_;
+    std::condition_variable sent_condition_;
+    std::condition_variable blocked_condition_;
+    std::vector<std::thread> workers_;
+    std::thread waiter_;
+
+    std::unordered_map<SocketFD, std::shared_ptr<Client>> clients_;
+    std::mutex clients_mtx_;
+
+    // A FIFO from ready_head_ on that keeps its storage, a std::deque allocates a block every
+    // few hundred pushes
+    std::vector<std::shared_ptr<Client>> ready_;
+    size_t ready_head_ = 0;
+    std::vector<std::shared_ptr<Client>> blocked_;
+    std::mutex ready_mtx_;
+    std::atomic<bool> end_publisher_{true};
+
+    // The waiter blocks in poll() on blocked_ and this eventfd until a socket drains or
+    // blocked_ changes. Elsewhere it polls again every LIMIT_WAITER_POLL_MS.
+    int wakeup_fd_ = -1;
+    bool waiter_polling_ = false; // With ready_mtx_
+    bool waiter_woken_ = false; // With ready_mtx_
+    static constexpr long LIMIT_WAITER_POLL_MS = 10;
+
+    // With ready_mtx_ held, one write per poll() at most
+    void wakeWaiter() {
+#ifdef NADJIEB_MJPEG_STREAMER_PLATFORM_LINUX
+        if (waiter_polling_ && !waiter_woken_) {
+            waiter_woken_ = true;
+            uint64_t one = 1;
+            (void)!::write(wakeup_fd_, &one, sizeof(one));
+        }
+#endif
+    }
+
+    // With ready_mtx_ held
+    bool hasReady() { return (ready_head_ < ready_.size()); }
+
+    // With ready_mtx_ held, and hasReady()
+    std::shared_ptr<Client> popReady() {
+        auto client = std::move(ready_[ready_head_++]);
+        if (ready_head_ == ready_.size()) {
+            ready_.clear();
+            ready_head_ = 0;
+        } else if (ready_head_ * 2 > ready_.size()) {
+            // Never drained under load, the moved-from front goes
+            ready_.erase(ready_.begin(), ready_.begin() + ready_head_);
+            ready_head_ = 0;
+        }
+        return client;
+    }
+
+    // With ready_mtx_ held
+    bool schedule(const std::shared_ptr<Client>& client) {
+        auto idle = ClientState::IDLE;
+        if (!client->state.compare_exchange_strong(idle, ClientState::SCHEDULED)) {
+            // Busy clients pick the new frame up when they are done
+            return false;
+        }
+        ready_.push_back(client);
+        return true;
+    }
+
+    void worker() {
+        std::unique_lock<std::mutex> lock(ready_mtx_);
+        while (!end_publisher_) {
+            condition_.wait(lock, [&]() { return (end_publisher_ || hasReady()); });
+            if (end_publisher_) {
+                break;
+            }
+
+            auto client = popReady();
+            auto scheduled = ClientState::SCHEDULED;
+            if (!client->state.compare_exchange_strong(scheduled, ClientState::SENDING)) {
+                continue;
+            }
+            lock.unlock();
+
+            auto next = send(*client);
+
+            lock.lock();
+            client->state = next;
+            if (next == ClientState::BLOCKED) {
+                blocked_.push_back(client);
+                blocked_condition_.notify_one();
+                wakeWaiter();
+            } else if (next == ClientState::IDLE && client->topic->getGeneration() != client->generation) {
+                // Published while the state was still SENDING
+                schedule(client);
+                condition_.notify_one();
+            }
+            sent_condition_.notify_all();
+        }
+    }
+
+    // Sends one part at most, a newer frame goes to the back of ready_ for fairness
+    ClientState send(Client& client) {
+        if (client.current == nullptr) {
+            // Part boundary, switch to the newest frame
+            auto generation = client.topic->getGeneration();
+            if (generation == client.generation) {
+                return ClientState::IDLE;
+            }
+            client.current = client.topic->getFrame();
+            client.generation = generation;
+            client.offset = 0;
+            if (client.current == nullptr) {
+                return ClientState::IDLE;
+            }
+        }
+
+        const auto total = client.current->header.size() + client.current->body.size();
+        while (client.offset < total) {
+            auto sent
+                = client.zero_copy.send(client.sockfd, client.current, client.offset, client.zero_copy_threshold);
+            if (sent == NADJIEB_MJPEG_STREAMER_SOCKET_ERROR) {
+                if (NADJIEB_MJPEG_STREAMER_ERRNO == NADJIEB_MJPEG_STREAMER_EWOULDBLOCK) {
+                    return ClientState::BLOCKED;
+                }
+                if (NADJIEB_MJPEG_STREAMER_ERRNO != EINTR) {
+                    client.current.reset();
+                    return ClientState::FAILED;
+                }
+                continue;
+            }
+            client.offset += sent;
+        }
+        client.current.reset();
+        return ClientState::IDLE;
+    }
+
+    // Hands the clients with a full socket buffer back to the workers once they drain
+    void waiter() {
+        std::vector<NADJIEB_MJPEG_STREAMER_POLLFD> fds;
+        std::vector<std::shared_ptr<Client>> polled;
+
+        std::unique_lock<std::mutex> lock(ready_mtx_);
+        while (!end_publisher_) {
+            blocked_condition_.wait(lock, [&]() {
+                return (end_publisher_ || !blocked_.empty() || polled.capacity() < blocked_.capacity());
+            });
+            if (end_publisher_) {
+                break;
+            }
+            // Woken by add() for this too
+            polled.reserve(blocked_.capacity());
+            fds.reserve(blocked_.capacity() + 1);
+
+            // Removed clients are dropped here too, their fd may already be reused
+            blocked_.erase(
+                std::remove_if(
+                    blocked_.begin(),
+                    blocked_.end(),
+                    [](const std::shared_ptr<Client>& client) { return client->state != ClientState::BLOCKED; }),
+                blocked_.end());
+            if (blocked_.empty()) {
+                continue;
+            }
+            polled = blocked_;
+            fds.clear();
+#ifdef NADJIEB_MJPEG_STREAMER_PLATFORM_LINUX
+            fds.push_back(NADJIEB_MJPEG_STREAMER_POLLFD{wakeup_fd_, POLLIN, 0});
+            const long timeout = -1;
+#else
+            const long timeout = LIMIT_WAITER_POLL_MS;
+#endif
+            const size_t first = fds.size();
+            for (const auto& client : polled) {
+                fds.push_back(NADJIEB_MJPEG_STREAMER_POLLFD{client->sockfd, POLLWRNORM, 0});
+            }
+            waiter_polling_ = true;
+            waiter_woken_ = false;
+            lock.unlock();
+
+            auto socket_count = pollSockets(fds.data(), fds.size(), timeout);
+            if (socket_count == NADJIEB_MJPEG_STREAMER_SOCKET_ERROR && NADJIEB_MJPEG_STREAMER_ERRNO != EINTR) {
+                throw std::runtime_error("pollSockets() failed\n");
+            }
+
+            lock.lock();
+            waiter_polling_ = false;
+#ifdef NADJIEB_MJPEG_STREAMER_PLATFORM_LINUX
+            if (fds[0].revents & POLLIN) {
+                uint64_t count;
+                (void)!::read(wakeup_fd_, &count, sizeof(count));
+            }
+#endif
+            if (socket_count <= 0) {
+                continue;
+            }
+
+            bool scheduled = false;
+            for (size_t i = first; i < fds.size(); ++i) {
+                if (fds[i].revents == 0) {
+                    continue;
+                }
+                auto& client = polled[i - first];
+                auto blocked = ClientState::BLOCKED;
+                // POLLERR also flags zero-copy completions, the worker reaps them before sending
+                if ((fds[i].revents & (POLLHUP | POLLNVAL))
+                    || ((fds[i].revents & POLLERR) && getSocketError(fds[i].fd) != 0)) {
+                    if (client->state.compare_exchange_strong(blocked, ClientState::FAILED)) {
+                        client->current.reset();
+                    }
+                    continue;
+                }
+                if (client->state.compare_exchange_strong(blocked, ClientState::SCHEDULED)) {
+                    ready_.push_back(client);
+                    scheduled = true;
+                }
+            }
+            // Before a worker can block them again, or they would be polled twice
+            blocked_.erase(
+                std::remove_if(
+                    blocked_.begin(),
+                    blocked_.end(),
+                    [](const std::shared_ptr<Client>& client) { return client->state != ClientState::BLOCKED; }),
+                blocked_.end());
+            if (scheduled) {
+                condition_.notify_all();
+            }
+        }
+    }
+};
+}  // namespace net
+}  // namespace nadjieb
+
+// #include <nadjieb/net/reactor_publisher.hpp>
+
+
+#ifdef NADJIEB_MJPEG_STREAMER_PLATFORM_LINUX
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace nadjieb {
+namespace net {
+// Each reactor is an event loop that owns a shard of the clients and their send state.
+// New frames are not pushed to the clients: the reactor is woken through an eventfd
+// and picks the newest frame of each topic from Topic::getFrame() at a part boundary.
+class ReactorPublisher : public PublisherBase {
+   public:
+    virtual ~ReactorPublisher() { stop(); }
+
+    void start(int num_reactors = std::thread::hardware_concurrency(), bool pin = false) {
+        state_ = nadjieb::utils::State::BOOTING;
+        end_publisher_ = false;
+        num_reactors = std::max(num_reactors, 1);
+        const int num_cpus = std::max<int>(std::thread::hardware_concurrency(), 1);
+        for (auto i = 0; i < num_reactors; ++i) {
+            reactors_.emplace_back(new Reactor(pin ? i % num_cpus : -1, zero_copy_threshold_));
+        }
+        state_ = nadjieb::utils::State::RUNNING;
+    }
+
+    void stop() override {
+        if (reactors_.empty()) {
+            return;
+        }
+        state_ = nadjieb::utils::State::TERMINATING;
+        end_publisher_ = true;
+        {
+            std::unique_lock<std::mutex> lock(reactor_by_client_mtx_);
+            reactor_by_client_.clear();
+        }
+        reactors_.clear();
+        clearTopics();
+        state_ = nadjieb::utils::State::TERMINATED;
+    }
+
+    void add(const SocketFD& sockfd, const std::string& path) override {
+        if (end_publisher_) {
+            return;
+        }
+
+        auto& topic = getTopic(path);
+        topic.addClient();
+
+        // The least loaded shard, clients stay on it until they disconnect
+        Reactor* target = reactors_[0].get();
+        for (const auto& reactor : reactors_) {
+            if (reactor->num_clients < target->num_clients) {
+                target = reactor.get();
+            }
+        }
+        target->add(sockfd, &topic);
+
+        std::unique_lock<std::mutex> lock(reactor_by_client_mtx_);
+        reactor_by_client_[sockfd] = target;
+    }
+
+    void removeClient(const SocketFD& sockfd) override {
+        std::unique_lock<std::mutex> lock(reactor_by_client_mtx_);
+        auto it = reactor_by_client_.find(sockfd);
+        if (it == reactor_by_client_.end()) {
+            return;
+        }
+        auto* reactor = it->second;
+        reactor_by_client_.erase(it);
+        lock.unlock();
+
+        auto* topic = reactor->remove(sockfd);
+        if (topic != nullptr) {
+            topic->removeClient();
+        }
+    }
+
+    using PublisherBase::enqueue;
+
+    void enqueue(Topic& topic, const char* data, size_t size) override {
+        if (end_publisher_) {
+            return;
+        }
+
+        topic.setBuffer(data, size);
+        for (const auto& reactor : reactors_) {
+            if (reactor->num_clients > 0) {
+                reactor->wakeup();
+            }
+        }
+    }
+
+   private:
+    class Reactor {
+       public:
+        std::atomic<int> num_clients{0};
+
+        Reactor(int cpu, const std::atomic<size_t>& zero_copy_threshold) : zero_copy_threshold_(zero_copy_threshold) {
+            epoll_fd_ = ::epoll_create1(EPOLL_CLOEXEC);
+            event_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (epoll_fd_ < 0 || event_fd_ < 0) {
+                throw std::runtime_error("Reactor() failed");
+            }
+
+            struct epoll_event event = {};
+            event.events = EPOLLIN;
+            event.data.fd = event_fd_;
+            ::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd_, &event);
+
+            thread_ = std::thread(&Reactor::run, this, cpu);
+        }
+
+        ~Reactor() {
+            end_ = true;
+            wakeup();
+            thread_.join();
+            ::close(event_fd_);
+            ::close(epoll_fd_);
+        }
+
+        void wakeup() {
+            uint64_t one = 1;
+            (void)!::write(event_fd_, &one, sizeof(one));
+        }
+
+        void add(SocketFD sockfd, Topic* topic) {
+            std::unique_lock<std::mutex> lock(pending_mtx_);
+            pending_.push_back(Change{sockfd, topic, true});
+            ++num_clients;
+            lock.unlock();
+            wakeup();
+        }
+
+        // Blocks until the reactor has dropped the socket, so it can be closed safely
+        Topic* remove(SocketFD sockfd) {
+            std::unique_lock<std::mutex> lock(pending_mtx_);
+            pending_.push_back(Change{sockfd, nullptr, false});
+            uint64_t ticket = ++removals_requested_;
+            wakeup();
+            removed_condition_.wait(lock, [&]() { return (removals_done_ >= ticket || end_); });
+            --num_clients;
+
+            auto it = removed_topics_.find(sockfd);
+            if (it == removed_topics_.end()) {
+                return nullptr;
+            }
+            auto* topic = it->second;
+            removed_topics_.erase(it);
+            return topic;
+        }
+
+       private:
+        struct Change {
+            SocketFD sockfd;
+            Topic* topic;
+            bool add;
+        };
+
+        struct Connection {
+            Topic* topic = nullptr;
+            Frame current;
+            size_t offset = 0;
+            uint64_t generation = 0;
+            bool writable = true;
+            bool failed = false;
+            size_t zero_copy_threshold = 0;
+            ZeroCopySender zero_copy;
+        };
+
+        int epoll_fd_ = -1;
+        int event_fd_ = -1;
+        const std::atomic<size_t>& zero_copy_threshold_;
+        std::atomic<bool> end_{false};
+        std::thread thread_;
+
+        std::mutex pending_mtx_;
+        std::vector<Change> pending_;
+        std::unordered_map<SocketFD, Topic*> removed_topics_;
+        uint64_t removals_requested_ = 0;
+        uint64_t removals_done_ = 0;
+        std::condition_variable removed_condition_;
+
+        // Owned by the reactor thread only
+        std::unordered_map<SocketFD, Connection> connections_;
+
+        const static int LIMIT_EPOLL_EVENTS = 64;
+
+        void run(int cpu) {
+            if (cpu >= 0) {
+                cpu_set_t cpus;
+                CPU_ZERO(&cpus);
+                CPU_SET(cpu, &cpus);
+                ::sched_setaffinity(0, sizeof(cpus), &cpus);
+            }
+
+            std::vector<Change> changes;
+            struct epoll_event events[LIMIT_EPOLL_EVENTS];
+
+            while (!end_) {
+                int event_count = ::epoll_wait(epoll_fd_, events, LIMIT_EPOLL_EVENTS, -1);
+                if (event_count < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::runtime_error("epoll_wait() failed");
+                }
+
+                bool new_frame = false;
+                for (int i = 0; i < event_count; ++i) {
+                    if (events[i].data.fd == event_fd_) {
+                        uint64_t count;
+                        (void)!::read(event_fd_, &count, sizeof(count));
+                        new_frame = true;
+                        continue;
+                    }
+
+                    auto it = connections_.find(events[i].data.fd);
+                    if (it == connections_.end()) {
+                        continue;
+                    }
+                    if ((events[i].events & EPOLLHUP)
+                        || ((events[i].events & EPOLLERR) && getSocketError(it->first) != 0)) {
+                        fail(it->second);
+                        continue;
+                    }
+                    if (events[i].events & EPOLLERR) {
+                        it->second.zero_copy.reap(it->first);
+                    }
+                    if (events[i].events & EPOLLOUT) {
+                        it->second.writable = true;
+                        flush(it->first, it->second);
+                    }
+                }
+
+                applyChanges(changes);
+
+                if (new_frame) {
+                    for (auto& [sockfd, connection] : connections_) {
+                        flush(sockfd, connection);
+                    }
+                }
+            }
+
+            std::unique_lock<std::mutex> lock(pending_mtx_);
+            removed_condition_.notify_all();
+        }
+
+        void applyChanges(std::vector<Change>& changes) {
+            {
+                std::unique_lock<std::mutex> lock(pending_mtx_);
+                changes.swap(pending_);
+            }
+            if (changes.empty()) {
+                return;
+            }
+
+            uint64_t removals = 0;
+            for (const auto& change : changes) {
+                if (change.add) {
+                    struct epoll_event event = {};
+                    event.events = EPOLLOUT | EPOLLET;
+                    event.data.fd = change.sockfd;
+                    ::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, change.sockfd, &event);
+                    auto& connection = connections_[change.sockfd];
+                    connection = Connection{};
+                    connection.topic = change.topic;
+                    connection.zero_copy_threshold = zero_copy_threshold_;
+                    if (connection.zero_copy_threshold > 0) {
+                        connection.zero_copy.enable(change.sockfd);
+                    }
+                    flush(change.sockfd, connection);
+                } else {
+                    auto it = connections_.find(change.sockfd);
+                    std::unique_lock<std::mutex> lock(pending_mtx_);
+                    if (it != connections_.end()) {
+                        ::epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, change.sockfd, nullptr);
+                        removed_topics_[change.sockfd] = it->second.topic;
+                        connections_.erase(it);
+                    }
+                    ++removals;
+                }
+            }
+            changes.clear();
+
+            if (removals > 0) {
+                std::unique_lock<std::mutex> lock(pending_mtx_);
+                removals_done_ += removals;
+                removed_condition_.notify_all();
+            }
+        }
+
+        void flush(SocketFD sockfd, Connection& connection) {
+            while (!connection.failed && connection.writable) {
+                if (connection.current == nullptr) {
+                    // Part boundary, switch to the newest frame if there is one
+                    auto generation = connection.topic->getGeneration();
+                    if (generation == connection.generation) {
+                        return;
+                    }
+                    connection.current = connection.topic->getFrame();
+                    connection.generation = generation;
+                    connection.offset = 0;
+                    if (connection.current == nullptr) {
+                        return;
+                    }
+                }
+
+                const auto& frame = *connection.current;
+                const auto total = frame.header.size() + frame.body.size();
+                auto sent = connection.zero_copy.send(
+                    sockfd, connection.current, connection.offset, connection.zero_copy_threshold);
+                if (sent == NADJIEB_MJPEG_STREAMER_SOCKET_ERROR) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        // Edge-triggered EPOLLOUT resumes it
+                        connection.writable = false;
+                    } else if (errno != EINTR) {
+                        fail(connection);
+                    }
+                    continue;
+                }
+
+                connection.offset += sent;
+                if (connection.offset >= total) {
+                    connection.current.reset();
+                }
+            }
+        }
+
+        // The listener sees the error too and closes the socket through removeClient()
+        void fail(Connection& connection) {
+            connection.failed = true;
+            connection.current.reset();
+        }
+    };
+
+    std::vector<std::unique_ptr<Reactor>> reactors_;
+    std::unordered_map<SocketFD, Reactor*> reactor_by_client_;
+    std::mutex reactor_by_client_mtx_;
+    std::atomic<bool> end_publisher_{true};
 };
 }  // namespace net
 }  // namespace nadjieb
+#endif
+
+// #include <nadjieb/net/uring_publisher.hpp>
 
-// #include <nadjieb/net/publisher.hpp>
 
+// #include <nadjieb/net/publisher.hpp>
 
 // #include <nadjieb/net/socket.hpp>
 
 // #include <nadjieb/net/topic.hpp>
 
 
-// #include <nadjieb/net/socket.hpp>
+#ifdef NADJIEB_MJPEG_STREAMER_PLATFORM_LINUX
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register 427
+#endif
 
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
 #include <mutex>
-#include <shared_mutex>
-#include <string>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 namespace nadjieb {
 namespace net {
-class Topic {
+// The bare minimum of io_uring over the raw syscalls, liburing is not available on every target
+class Uring : public nadjieb::utils::NonCopyable {
    public:
-    void setBuffer(const std::string& buffer) {
-        std::unique_lock lock(buffer_mtx_);
-        buffer_ = buffer;
-    }
-
-    std::string getBuffer() {
-        std::shared_lock lock(buffer_mtx_);
-        return buffer_;
+    ~Uring() {
+        if (sqes_ != nullptr) {
+            ::munmap(sqes_, sqes_size_);
+        }
+        if (cq_ptr_ != nullptr && cq_ptr_ != sq_ptr_) {
+            ::munmap(cq_ptr_, cq_size_);
+        }
+        if (sq_ptr_ != nullptr) {
+            ::munmap(sq_ptr_, sq_size_);
+        }
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
     }
 
-    void addClient(const SocketFD& sockfd) {
-        std::unique_lock client_lock(client_by_sockfd_mtx_);
-        client_by_sockfd_[sockfd] = NADJIEB_MJPEG_STREAMER_POLLFD{sockfd, POLLWRNORM, 0};
+    // False when the kernel is too old or the policy forbids io_uring
+    bool init(unsigned entries) {
+        struct io_uring_params params = {};
+        fd_ = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+        if (fd_ < 0) {
+            return false;
+        }
+        if (!(params.features & IORING_FEAT_NODROP)) {
+            // Older kernels drop completions on overflow, a lost send would stall its client
+            return false;
+        }
 
-        std::unique_lock queue_size_lock(queue_size_by_sockfd__mtx_);
-        queue_size_by_sockfd_[sockfd] = 0;
-    }
+        sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+        }
 
-    void removeClient(const SocketFD& sockfd) {
-        std::unique_lock lock(client_by_sockfd_mtx_);
-        client_by_sockfd_.erase(sockfd);
+        sq_ptr_ = mapRing(sq_size_, IORING_OFF_SQ_RING);
+        if (sq_ptr_ == nullptr) {
+            return false;
+        }
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            cq_ptr_ = sq_ptr_;
+        } else if ((cq_ptr_ = mapRing(cq_size_, IORING_OFF_CQ_RING)) == nullptr) {
+            return false;
+        }
+        sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+        sqes_ = static_cast<struct io_uring_sqe*>(mapRing(sqes_size_, IORING_OFF_SQES));
+        if (sqes_ == nullptr) {
+            return false;
+        }
 
-        std::unique_lock queue_size_lock(queue_size_by_sockfd__mtx_);
-        queue_size_by_sockfd_.erase(sockfd);
+        auto* sq = static_cast<char*>(sq_ptr_);
+        sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sq_entries_ = params.sq_entries;
+        local_tail_ = *sq_tail_;
+
+        auto* cq = static_cast<char*>(cq_ptr_);
+        cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
     }
 
-    bool hasClient() {
-        std::shared_lock lock(client_by_sockfd_mtx_);
-        return !client_by_sockfd_.empty();
+    // Room for count more entries, submitting the queued ones first when needed. Linked
+    // entries have to go to the kernel in the same submission
+    bool reserve(unsigned count) {
+        if (sq_entries_ - (local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE)) < count) {
+            enter(0);
+        }
+        return (sq_entries_ - (local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE)) >= count);
     }
 
-    std::vector<NADJIEB_MJPEG_STREAMER_POLLFD> getClients() {
-        std::shared_lock lock(client_by_sockfd_mtx_);
-
-        std::vector<NADJIEB_MJPEG_STREAMER_POLLFD> clients;
-        for (const auto& client : client_by_sockfd_) {
-            clients.push_back(client.second);
+    // A zeroed entry, submitting the queued ones first when the ring is full
+    struct io_uring_sqe* getSqe() {
+        if (!reserve(1)) {
+            return nullptr;
         }
+        auto index = local_tail_ & sq_mask_;
+        auto* sqe = &sqes_[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sq_array_[index] = index;
+        ++local_tail_;
+        ++to_submit_;
+        return sqe;
+    }
 
-        return clients;
+    // One syscall for everything queued since the last call, optionally waiting for completions
+    int enter(unsigned wait_nr) {
+        __atomic_store_n(sq_tail_, local_tail_, __ATOMIC_RELEASE);
+        auto flags = (wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0U);
+        auto submitted = static_cast<int>(::syscall(__NR_io_uring_enter, fd_, to_submit_, wait_nr, flags, nullptr, 0));
+        if (submitted > 0) {
+            to_submit_ -= std::min<unsigned>(to_submit_, static_cast<unsigned>(submitted));
+        }
+        return submitted;
     }
 
-    int getQueueSize(const SocketFD& sockfd) {
-        std::shared_lock queue_size_lock(queue_size_by_sockfd__mtx_);
-        return queue_size_by_sockfd_[sockfd];
+    // A table of count empty buffer slots, filled by updateBuffer(). Sparse tables and
+    // updates need Linux 5.13+, false before
+    bool registerBuffers(unsigned count) {
+        std::vector<struct iovec> iovecs(count, iovec{nullptr, 0});
+        return (::syscall(__NR_io_uring_register, fd_, IORING_REGISTER_BUFFERS, iovecs.data(), count) == 0);
     }
 
-    void increaseQueue(const SocketFD& sockfd) {
-        std::unique_lock queue_size_lock(queue_size_by_sockfd__mtx_);
-        ++queue_size_by_sockfd_[sockfd];
+    // Pins the memory into a slot in place of what was there, requests already queued on the
+    // old buffer keep it until they complete
+    bool updateBuffer(unsigned slot, const void* data, size_t size) {
+        struct iovec iov = {const_cast<void*>(data), size};
+        struct io_uring_rsrc_update2 update = {};
+        update.offset = slot;
+        update.data = reinterpret_cast<uint64_t>(&iov);
+        update.nr = 1;
+        return (::syscall(__NR_io_uring_register, fd_, IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update)) == 1);
     }
 
-    void decreaseQueue(const SocketFD& sockfd) {
-        std::unique_lock queue_size_lock(queue_size_by_sockfd__mtx_);
-        --queue_size_by_sockfd_[sockfd];
+    template <typename F>
+    void forEachCompletion(F&& f) {
+        auto head = *cq_head_;
+        auto tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            const auto& cqe = cqes_[head & cq_mask_];
+            f(cqe.user_data, cqe.res);
+            ++head;
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
     }
 
    private:
-    std::string buffer_;
-    std::shared_mutex buffer_mtx_;
-
-    std::unordered_map<SocketFD, NADJIEB_MJPEG_STREAMER_POLLFD> client_by_sockfd_;
-    std::shared_mutex client_by_sockfd_mtx_;
-
-    std::unordered_map<SocketFD, int> queue_size_by_sockfd_;
-    std::shared_mutex queue_size_by_sockfd__mtx_;
+    int fd_ = -1;
+    void* sq_ptr_ = nullptr;
+    void* cq_ptr_ = nullptr;
+    struct io_uring_sqe* sqes_ = nullptr;
+    size_t sq_size_ = 0;
+    size_t cq_size_ = 0;
+    size_t sqes_size_ = 0;
+
+    unsigned* sq_head_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned* sq_array_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned sq_entries_ = 0;
+    unsigned local_tail_ = 0;
+    unsigned to_submit_ = 0;
+
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    struct io_uring_cqe* cqes_ = nullptr;
+
+    void* mapRing(size_t size, off_t offset) {
+        auto* ptr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, offset);
+        return (ptr == MAP_FAILED ? nullptr : ptr);
+    }
 };
-}  // namespace net
-}  // namespace nadjieb
-
-// #include <nadjieb/utils/non_copyable.hpp>
-
-// #include <nadjieb/utils/runnable.hpp>
-
 
-#include <algorithm>
-#include <condition_variable>
-#include <mutex>
-#include <queue>
-#include <string>
-#include <thread>
-#include <unordered_map>
-#include <utility>
-#include <vector>
-
-namespace nadjieb {
-namespace net {
-class Publisher : public nadjieb::utils::NonCopyable, public nadjieb::utils::Runnable {
+// A single thread owns all the clients and sends a new frame to every one of them with a
+// single io_uring_enter(). A socket buffer that is full parks its client on a POLL_ADD
+// in the same ring, and the completions of both are reaped in batches.
+// The frame bodies are registered buffers where the kernel allows: every client sends the
+// part header with a SEND linked to a WRITE_FIXED of the body, and the pages of a body are
+// pinned once for all its clients instead of looked up again by every request.
+class UringPublisher : public PublisherBase {
    public:
-    virtual ~Publisher() { stop(); }
+    virtual ~UringPublisher() { stop(); }
 
-    void start(int num_workers = std::thread::hardware_concurrency()) {
+    // False when io_uring is unusable here, the caller falls back to another mode.
+    // Without registered_buffers, or on kernels before 5.13, the parts go out with SENDMSG
+    bool start(bool registered_buffers = true) {
         state_ = nadjieb::utils::State::BOOTING;
-        end_publisher_ = false;
-        workers_.reserve(num_workers);
-        for (auto i = 0; i < num_workers; ++i) {
-            workers_.emplace_back(&Publisher::worker, this);
+        if (!ring_.init(LIMIT_RING_ENTRIES)) {
+            state_ = nadjieb::utils::State::TERMINATED;
+            return false;
+        }
+        registered_buffers_ = (registered_buffers && ring_.registerBuffers(LIMIT_REGISTERED_BUFFERS));
+        buffer_slots_.assign(registered_buffers_ ? LIMIT_REGISTERED_BUFFERS : 0, BufferSlot());
+        if (registered_buffers_) {
+            // WRITE_FIXED has no MSG_NOSIGNAL, a client gone would raise SIGPIPE
+            initSocket();
         }
+        event_fd_ = ::eventfd(0, EFD_CLOEXEC);
+        if (event_fd_ < 0) {
+            state_ = nadjieb::utils::State::TERMINATED;
+            return false;
+        }
+        end_publisher_ = false;
+        thread_ = std::thread(&UringPublisher::run, this);
         state_ = nadjieb::utils::State::RUNNING;
+        return true;
     }
 
-    void stop() {
+    void stop() override {
+        if (!thread_.joinable()) {
+            return;
+        }
         state_ = nadjieb::utils::State::TERMINATING;
         end_publisher_ = true;
-        condition_.notify_all();
+        wakeup();
+        thread_.join();
+        ::close(event_fd_);
+        event_fd_ = -1;
+        {
+            std::unique_lock<std::mutex> lock(pending_mtx_);
+            removed_condition_.notify_all();
+        }
+        clearTopics();
+        state_ = nadjieb::utils::State::TERMINATED;
+    }
 
-        if (!workers_.empty()) {
-            for (auto& w : workers_) {
-                if (w.joinable()) {
-                    w.join();
-                }
-            }
-            workers_.clear();
+    void add(const SocketFD& sockfd, const std::string& path) override {
+        if (end_publisher_) {
+            return;
         }
 
-        topics_.clear();
-        path_by_client_.clear();
+        auto& topic = getTopic(path);
+        topic.addClient();
+
+        std::unique_lock<std::mutex> lock(pending_mtx_);
+        clients_.insert(sockfd);
+        pending_.push_back(Change{sockfd, &topic, true});
+        lock.unlock();
+        wakeup();
+    }
 
-        while (!payloads_.empty()) {
-            payloads_.pop();
+    // Blocks until no request references the socket anymore, so it can be closed safely
+    void removeClient(const SocketFD& sockfd) override {
+        std::unique_lock<std::mutex> lock(pending_mtx_);
+        if (end_publisher_ || clients_.erase(sockfd) == 0) {
+            return;
         }
-        state_ = nadjieb::utils::State::TERMINATED;
+        pending_.push_back(Change{sockfd, nullptr, false});
+        lock.unlock();
+        wakeup();
+        lock.lock();
+        removed_condition_.wait(
+            lock, [&]() { return (removed_topics_.find(sockfd) != removed_topics_.end() || end_publisher_); });
+
+        auto it = removed_topics_.find(sockfd);
+        if (it == removed_topics_.end()) {
+            return;
+        }
+        auto* topic = it->second;
+        removed_topics_.erase(it);
+        lock.unlock();
+        topic->removeClient();
     }
 
-    void add(const SocketFD& sockfd, const std::string& path) {
+    using PublisherBase::enqueue;
+
+    void enqueue(Topic& topic, const char* data, size_t size) override {
         if (end_publisher_) {
             return;
         }
 
-        topics_[path].addClient(sockfd);
+        topic.setBuffer(data, size);
+        if (topic.hasClient()) {
+            wakeup();
+        }
+    }
+
+   private:
+    struct Change {
+        SocketFD sockfd;
+        Topic* topic;
+        bool add;
+    };
+
+    // Sent from the thread only, the request points at msg and iov until it completes
+    struct Connection {
+        SocketFD sockfd;
+        Topic* topic = nullptr;
+        Frame current;
+        size_t offset = 0;
+        uint64_t generation = 0;
+        struct iovec iov[2];
+        struct msghdr msg;
+        unsigned in_flight = 0; // Two for a header linked to its body
+        bool polling = false;
+        bool blocked = false;
+        bool failed = false;
+        bool removing = false;
+    };
+
+    // A registered buffer and the frame body it holds
+    struct BufferSlot {
+        uint64_t storage = 0;
+        uint64_t used = 0;
+    };
 
-        std::unique_lock<std::mutex> lock(path_by_client_mtx_);
-        path_by_client_[sockfd] = path;
+    Uring ring_;
+    int event_fd_ = -1;
+    uint64_t event_value_ = 0;
+    std::thread thread_;
+    std::atomic<bool> end_publisher_{true};
+
+    std::mutex pending_mtx_;
+    std::unordered_set<SocketFD> clients_;
+    std::vector<Change> pending_;
+    std::unordered_map<SocketFD, Topic*> removed_topics_;
+    std::condition_variable removed_condition_;
+
+    // Owned by the thread only
+    std::unordered_map<SocketFD, std::unique_ptr<Connection>> connections_;
+    bool registered_buffers_ = false;
+    std::vector<BufferSlot> buffer_slots_;
+    uint64_t buffer_clock_ = 0;
+
+    // user_data values that are not Connection pointers
+    const static uint64_t WAKEUP_TAG = 1;
+    const static uint64_t CANCEL_TAG = 2;
+    // Set on the Connection pointer of a header send, that is at least 8 aligned
+    const static uint64_t HEADER_TAG = 1;
+    const static unsigned LIMIT_RING_ENTRIES = 1024;
+    // The newest frames of a few topics, the Topic keeps up to 8 bodies per topic
+    const static unsigned LIMIT_REGISTERED_BUFFERS = 16;
+
+    void wakeup() {
+        uint64_t one = 1;
+        (void)!::write(event_fd_, &one, sizeof(one));
     }
 
-    bool pathExists(const std::string& path) { return (topics_.find(path) != topics_.end()); }
+    void run() {
+        armWakeup();
+        std::vector<Change> changes;
+
+        while (!end_publisher_) {
+            if (ring_.enter(1) < 0 && errno != EINTR && errno != EBUSY) {
+                throw std::runtime_error("io_uring_enter() failed");
+            }
+
+            bool new_frame = false;
+            ring_.forEachCompletion([&](uint64_t user_data, int res) {
+                if (user_data == WAKEUP_TAG) {
+                    new_frame = true;
+                    return;
+                }
+                if (user_data == CANCEL_TAG) {
+                    return;
+                }
+                onCompletion(*reinterpret_cast<Connection*>(user_data & ~HEADER_TAG), res);
+            });
+
+            if (new_frame) {
+                armWakeup();
+            }
+            applyChanges(changes);
+
+            if (new_frame) {
+                for (auto& [sockfd, connection] : connections_) {
+                    send(*connection);
+                }
+            }
+        }
 
-    void removeClient(const SocketFD& sockfd) {
-        std::unique_lock<std::mutex> lock(path_by_client_mtx_);
-        topics_[path_by_client_[sockfd]].removeClient(sockfd);
+        // The requests point into the connections, let them all finish before those go away
+        for (auto& [sockfd, connection] : connections_) {
+            connection->removing = true;
+            if (connection->in_flight) {
+                cancel(*connection);
+            }
+        }
+        auto in_flight = [&]() {
+            for (const auto& [sockfd, connection] : connections_) {
+                if (connection->in_flight) {
+                    return true;
+                }
+            }
+            return false;
+        };
+        while (in_flight()) {
+            if (ring_.enter(1) < 0 && errno != EINTR && errno != EBUSY) {
+                break;
+            }
+            ring_.forEachCompletion([&](uint64_t user_data, int res) {
+                if (user_data != WAKEUP_TAG && user_data != CANCEL_TAG) {
+                    onCompletion(*reinterpret_cast<Connection*>(user_data & ~HEADER_TAG), res);
+                }
+            });
+        }
+        connections_.clear();
+    }
 
-        path_by_client_.erase(sockfd);
+    void armWakeup() {
+        auto* sqe = ring_.getSqe();
+        if (sqe == nullptr) {
+            throw std::runtime_error("io_uring submission queue overflow");
+        }
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = event_fd_;
+        sqe->addr = reinterpret_cast<uint64_t>(&event_value_);
+        sqe->len = sizeof(event_value_);
+        sqe->user_data = WAKEUP_TAG;
     }
 
-    void enqueue(const std::string& path, const std::string& buffer) {
-        if (end_publisher_) {
+    void onCompletion(Connection& connection, int res) {
+        --connection.in_flight;
+        if (connection.removing || connection.failed) {
             return;
         }
 
-        topics_[path].setBuffer(buffer);
-
-        for (const auto& client : topics_[path].getClients()) {
-            if (topics_[path].getQueueSize(client.fd) > LIMIT_QUEUE_PER_CLIENT) {
-                continue;
+        if (connection.polling) {
+            connection.polling = false;
+            if (res < 0 || ((res & (POLLERR | POLLHUP)) && getSocketError(connection.sockfd) != 0)) {
+                fail(connection);
+                return;
             }
+        } else if (res == -EAGAIN) {
+            // The socket is non-blocking for the listener, wait for room in the same ring
+            connection.blocked = true;
+        } else if (res == -ECANCELED) {
+            // A body behind a header that failed or came short, the header's result decides
+        } else if (res < 0 && res != -EINTR) {
+            fail(connection);
+            return;
+        } else if (res > 0) {
+            connection.offset += static_cast<size_t>(res);
+            if (connection.offset >= connection.current->header.size() + connection.current->body.size()) {
+                connection.current.reset();
+            }
+        }
 
-            std::unique_lock<std::mutex> payloads_lock(payloads_mtx_);
-            payloads_.emplace(path, client);
-            topics_[path].increaseQueue(client.fd);
-            payloads_lock.unlock();
-
-            condition_.notify_one();
+        if (connection.in_flight > 0) {
+            // The body linked to this header completes next
+            return;
+        }
+        if (connection.blocked) {
+            connection.blocked = false;
+            waitWritable(connection);
+            return;
         }
+        send(connection);
     }
 
-    bool hasClient(const std::string& path) { return topics_[path].hasClient(); }
+    // Queues the rest of the current part, or the newest frame at a part boundary
+    void send(Connection& connection) {
+        if (connection.in_flight || connection.failed || connection.removing) {
+            return;
+        }
+        if (connection.current == nullptr) {
+            auto generation = connection.topic->getGeneration();
+            if (generation == connection.generation) {
+                return;
+            }
+            connection.current = connection.topic->getFrame();
+            connection.generation = generation;
+            connection.offset = 0;
+            if (connection.current == nullptr) {
+                return;
+            }
+        }
 
-   private:
-    typedef std::pair<std::string, NADJIEB_MJPEG_STREAMER_POLLFD> Payload;
+        const auto& frame = *connection.current;
+        const int slot = getBufferSlot(frame);
+        if (slot >= 0) {
+            sendFixed(connection, slot);
+            return;
+        }
 
-    std::condition_variable condition_;
-    std::vector<std::thread> workers_;
-    std::queue<Payload> payloads_;
-    std::unordered_map<SocketFD, std::string> path_by_client_;
-    std::unordered_map<std::string, Topic> topics_;
-    std::mutex cv_mtx_;
-    std::mutex path_by_client_mtx_;
-    std::mutex payloads_mtx_;
-    bool end_publisher_ = true;
+        auto offset = connection.offset;
+        int count = 0;
+        if (offset < frame.header.size()) {
+            connection.iov[count++] = iovec{(void*)(frame.header.data() + offset), frame.header.size() - offset};
+            offset = 0;
+        } else {
+            offset -= frame.header.size();
+        }
+        connection.iov[count++] = iovec{(void*)(frame.body.data() + offset), frame.body.size() - offset};
+        connection.msg = {};
+        connection.msg.msg_iov = connection.iov;
+        connection.msg.msg_iovlen = count;
+
+        auto* sqe = ring_.getSqe();
+        if (sqe == nullptr) {
+            fail(connection);
+            return;
+        }
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = connection.sockfd;
+        sqe->addr = reinterpret_cast<uint64_t>(&connection.msg);
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = reinterpret_cast<uint64_t>(&connection);
+        connection.in_flight = 1;
+    }
 
-    const static int LIMIT_QUEUE_PER_CLIENT = 5;
+    // The rest of the header with a SEND, linked to a WRITE_FIXED of the rest of the body from
+    // the registered slot. MSG_WAITALL fails the link on a short header, the body is cancelled
+    void sendFixed(Connection& connection, int slot) {
+        const auto& frame = *connection.current;
+        auto offset = connection.offset;
+        const bool header = (offset < frame.header.size());
+        if (!ring_.reserve(header ? 2 : 1)) {
+            fail(connection);
+            return;
+        }
 
-    void worker() {
-        while (!end_publisher_) {
-            std::unique_lock<std::mutex> cv_lock(cv_mtx_);
+        if (header) {
+            auto* sqe = ring_.getSqe();
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = connection.sockfd;
+            sqe->addr = reinterpret_cast<uint64_t>(frame.header.data() + offset);
+            sqe->len = static_cast<unsigned>(frame.header.size() - offset);
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+            sqe->user_data = reinterpret_cast<uint64_t>(&connection) | HEADER_TAG;
+            ++connection.in_flight;
+            offset = 0;
+            if (frame.body.empty()) {
+                return;
+            }
+            sqe->flags = IOSQE_IO_LINK;
+        } else {
+            offset -= frame.header.size();
+        }
 
-            condition_.wait(cv_lock, [&]() { return (end_publisher_ || !payloads_.empty()); });
-            if (end_publisher_) {
-                break;
+        auto* sqe = ring_.getSqe();
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->fd = connection.sockfd;
+        sqe->addr = reinterpret_cast<uint64_t>(frame.body.data() + offset);
+        sqe->len = static_cast<unsigned>(frame.body.size() - offset);
+        sqe->buf_index = static_cast<uint16_t>(slot);
+        sqe->user_data = reinterpret_cast<uint64_t>(&connection);
+        ++connection.in_flight;
+    }
+
+    // The registered slot holding the frame's body, registering it in place of the least
+    // recently used one. -1 to send it with SENDMSG
+    int getBufferSlot(const FramePart& frame) {
+        if (!registered_buffers_) {
+            return -1;
+        }
+        ++buffer_clock_;
+        size_t oldest = 0;
+        for (size_t slot = 0; slot < buffer_slots_.size(); ++slot) {
+            if (buffer_slots_[slot].storage == frame.storage) {
+                buffer_slots_[slot].used = buffer_clock_;
+                return static_cast<int>(slot);
+            }
+            if (buffer_slots_[slot].used < buffer_slots_[oldest].used) {
+                oldest = slot;
             }
+        }
 
-            std::unique_lock<std::mutex> payloads_lock(payloads_mtx_);
+        if (!ring_.updateBuffer(static_cast<unsigned>(oldest), frame.body.data(), frame.body.capacity())) {
+            // Over RLIMIT_MEMLOCK for one, not worth trying again for every frame
+            std::cerr << "Can't register a frame buffer, sending without registered buffers" << std::endl;
+            registered_buffers_ = false;
+            return -1;
+        }
+        buffer_slots_[oldest].storage = frame.storage;
+        buffer_slots_[oldest].used = buffer_clock_;
+        return static_cast<int>(oldest);
+    }
 
-            Payload payload = std::move(payloads_.front());
-            payloads_.pop();
-            topics_[payload.first].decreaseQueue(payload.second.fd);
+    void waitWritable(Connection& connection) {
+        auto* sqe = ring_.getSqe();
+        if (sqe == nullptr) {
+            fail(connection);
+            return;
+        }
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = connection.sockfd;
+        sqe->poll_events = POLLOUT;
+        sqe->user_data = reinterpret_cast<uint64_t>(&connection);
+        connection.in_flight = 1;
+        connection.polling = true;
+    }
 
-            payloads_lock.unlock();
-            cv_lock.unlock();
+    void cancel(Connection& connection) {
+        // The header first, cancelling it cancels the body linked to it
+        for (auto tag : {HEADER_TAG, uint64_t(0)}) {
+            auto* sqe = ring_.getSqe();
+            if (sqe == nullptr) {
+                return;
+            }
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = reinterpret_cast<uint64_t>(&connection) | tag;
+            sqe->user_data = CANCEL_TAG;
+        }
+    }
 
-            auto buffer = topics_[payload.first].getBuffer();
-            std::string res_str
-                = "--nadjiebmjpegstreamer\r\n"
-                  "Content-Type: image/jpeg\r\n"
-                  "Content-Length: "
-                  + std::to_string(buffer.size()) + "\r\n\r\n" + buffer;
+    void fail(Connection& connection) {
+        // The listener notices the disconnect and removes the client
+        connection.failed = true;
+        connection.current.reset();
+    }
 
-            auto socket_count = pollSockets(&payload.second, 1, 1);
+    void applyChanges(std::vector<Change>& changes) {
+        {
+            std::unique_lock<std::mutex> lock(pending_mtx_);
+            changes.swap(pending_);
+        }
 
-            if (socket_count == NADJIEB_MJPEG_STREAMER_SOCKET_ERROR) {
-                throw std::runtime_error("pollSockets() failed\n");
+        uint64_t removals = 0;
+        for (const auto& change : changes) {
+            if (change.add) {
+                auto& connection = connections_[change.sockfd];
+                connection.reset(new Connection());
+                connection->sockfd = change.sockfd;
+                connection->topic = change.topic;
+                send(*connection);
+                continue;
             }
 
-            if (socket_count == 0) {
+            auto it = connections_.find(change.sockfd);
+            if (it == connections_.end()) {
                 continue;
             }
-
-            if (payload.second.revents != POLLWRNORM) {
-                throw std::runtime_error("revents != POLLWRNORM\n");
+            it->second->removing = true;
+            if (it->second->in_flight) {
+                // Finished below once the request completes, cancelled or not
+                cancel(*it->second);
             }
-
-            sendViaSocket(payload.second.fd, res_str.c_str(), res_str.size(), 0);
+        }
+        changes.clear();
+
+        std::unique_lock<std::mutex> lock(pending_mtx_);
+        for (auto it = connections_.begin(); it != connections_.end();) {
+            if (it->second->removing && !it->second->in_flight) {
+                removed_topics_[it->first] = it->second->topic;
+                it = connections_.erase(it);
+                ++removals;
+            } else {
+                ++it;
+            }
+        }
+        if (removals > 0) {
+            removed_condition_.notify_all();
         }
     }
 };
 }  // namespace net
 }  // namespace nadjieb
+#endif
 
 // #include <nadjieb/net/socket.hpp>
 
 // #include <nadjieb/utils/non_copyable.hpp>
 
 
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 
 namespace nadjieb {
+// Called from the listener thread with the target of every stream or snapshot request
+using OnSubscribeCallback = std::function<void(const std::string&)>;
+
+// Called from the listener thread with the ?viewport=WxH of a new stream client, 0x0 if it
+// didn't give one, then once more with active false when it goes away
+using OnViewportCallback = std::function<void(const nadjieb::net::SocketFD&, bool active, unsigned, unsigned)>;
+
+// WebSocket clients on the stream port, all called from the listener thread. A WebSocket
+// can be sent to from any thread until on_close returns, sends fail after that.
+struct WebSocketHandler {
+    std::function<void(const std::shared_ptr<nadjieb::net::WebSocket>&)> on_open;
+    std::function<void(const std::shared_ptr<nadjieb::net::WebSocket>&, const nadjieb::net::WebSocketMessage&)>
+        on_message;
+    std::function<void(const std::shared_ptr<nadjieb::net::WebSocket>&)> on_close;
+};
+
 class MJPEGStreamer : public nadjieb::utils::NonCopyable {
    public:
     virtual ~MJPEGStreamer() { stop(); }
 
-    void start(int port, int num_workers = std::thread::hardware_concurrency()) {
-        publisher_.start(num_workers);
-        listener_.withOnMessageCallback(on_message_cb_).withOnBeforeCloseCallback(on_before_close_cb_).runAsync(port);
+    void start(
+        int port,
+        int num_workers = std::thread::hardware_concurrency(),
+        nadjieb::net::PublisherMode mode = nadjieb::net::PublisherMode::WORKERS,
+        bool pin = false) {
+#ifdef NADJIEB_MJPEG_STREAMER_PLATFORM_LINUX
+        if (mode == nadjieb::net::PublisherMode::REACTORS) {
+            auto publisher = std::make_unique<nadjieb::net::ReactorPublisher>();
+            publisher->start(num_workers, pin);
+            publisher_ = std::move(publisher);
+        } else if (mode == nadjieb::net::PublisherMode::URING) {
+            auto publisher = std::make_unique<nadjieb::net::UringPublisher>();
+            if (publisher->start()) {
+                publisher_ = std::move(publisher);
+            } else {
+                std::cerr << "io_uring is unavailable, falling back to workers" << std::endl;
+            }
+        }
+#endif
+        if (publisher_ == nullptr) {
+            auto publisher = std::make_unique<nadjieb::net::Publisher>();
+            publisher->start(num_workers);
+            publisher_ = std::move(publisher);
+        }
+        publisher_->setZeroCopyThreshold(zero_copy_threshold_);
+        listener_.withOnMessageCallback(on_message_cb_)
+            .withOnBeforeCloseCallback(on_before_close_cb_)
+            .withOnWebSocketMessageCallback(on_websocket_message_cb_)
+            .runAsync(port);
 
         while (!isRunning()) {
             std::this_thread::sleep_for(std::chrono::milliseconds(10));
@@ -832,46 +3347,255 @@ class MJPEGStreamer : public nadjieb::utils::NonCopyable {
     }
 
     void stop() {
-        publisher_.stop();
+        if (publisher_ != nullptr) {
+            publisher_->stop();
+        }
         listener_.stop();
     }
 
-    void publish(const std::string& path, const std::string& buffer) { publisher_.enqueue(path, buffer); }
+    void publish(const std::string& path, const std::string& buffer) { publisher_->enqueue(path, buffer); }
+
+    void publish(const std::string& path, const char* data, size_t size) { publisher_->enqueue(path, data, size); }
+
+    // For the producers that publish to the same path on every frame, valid until stop()
+    nadjieb::net::Topic& getTopic(const std::string& path) { return publisher_->getTopicHandle(path); }
+
+    void publish(nadjieb::net::Topic& topic, const char* data, size_t size) { publisher_->enqueue(topic, data, size); }
 
     void setShutdownTarget(const std::string& target) { shutdown_target_ = target; }
 
-    bool isRunning() { return (publisher_.isRunning() && listener_.isRunning()); }
+    // Set it before start(), its text is served as is on target
+    void setMetricsCallback(const std::string& target, const std::function<std::string()>& callback) {
+        metrics_target_ = target;
+        metrics_cb_ = callback;
+    }
+
+    // Set it before start(), upgrade requests for target become WebSocket clients
+    void setWebSocketHandler(const std::string& target, const WebSocketHandler& handler) {
+        websocket_target_ = target;
+        websocket_handler_ = handler;
+    }
+
+    // Set it before start(), lets the producer scale the stream to what the viewers show
+    void setOnViewportCallback(const OnViewportCallback& callback) { on_viewport_cb_ = callback; }
+
+    // Set it before start(), lets the producer resume when a viewer shows up
+    void setOnSubscribeCallback(const OnSubscribeCallback& callback) { on_subscribe_cb_ = callback; }
 
-    bool hasClient(const std::string& path) { return publisher_.hasClient(path); }
+    // Stream parts at least this large are sent with MSG_ZEROCOPY where supported, 0 disables it
+    void setZeroCopyThreshold(size_t threshold) {
+        zero_copy_threshold_ = threshold;
+        if (publisher_ != nullptr) {
+            publisher_->setZeroCopyThreshold(threshold);
+        }
+    }
+
+    // Set it before start(), requests for alias are served as if they were for target
+    void setPathAlias(const std::string& alias, const std::string& target) { path_aliases_[alias] = target; }
+
+    // Serves the latest frame of snapshot_path as a single image on target
+    void setSnapshotTarget(const std::string& target, const std::string& snapshot_path) {
+        snapshot_target_ = target;
+        snapshot_path_ = snapshot_path;
+    }
+
+    bool isRunning() { return (publisher_ != nullptr && publisher_->isRunning() && listener_.isRunning()); }
+
+    bool hasClient(const std::string& path) { return publisher_->hasClient(path); }
 
    private:
     nadjieb::net::Listener listener_;
-    nadjieb::net::Publisher publisher_;
+    std::unique_ptr<nadjieb::net::PublisherBase> publisher_;
     std::string shutdown_target_ = "/shutdown";
+    std::string snapshot_target_ = "/snapshot.jpg";
+    std::string snapshot_path_ = "/stream";
+    size_t zero_copy_threshold_ = nadjieb::net::ZeroCopySender::DEFAULT_THRESHOLD;
+    std::unordered_map<std::string, std::string> path_aliases_;
+    OnSubscribeCallback on_subscribe_cb_;
+    std::string metrics_target_ = "/metrics";
+    std::function<std::string()> metrics_cb_;
+    std::string websocket_target_ = "/ws";
+    WebSocketHandler websocket_handler_;
+    // Only touched by the listener thread
+    std::unordered_map<nadjieb::net::SocketFD, std::shared_ptr<nadjieb::net::WebSocket>> websockets_;
+    OnViewportCallback on_viewport_cb_;
+    std::unordered_set<nadjieb::net::SocketFD> viewport_clients_; // Listener thread only
+
+    static bool containsToken(std::string_view value, std::string_view token) {
+        return std::search(
+                   value.begin(), value.end(), token.begin(), token.end(),
+                   [](char a, char b) { return std::tolower(a) == std::tolower(b); })
+               != value.end();
+    }
+
+    // The value of key in a query string, empty if absent
+    static std::string_view getQueryValue(std::string_view query, std::string_view key) {
+        while (!query.empty()) {
+            auto end = query.find('&');
+            auto pair = query.substr(0, end);
+            if (pair.size() > key.size() && pair.substr(0, key.size()) == key && pair[key.size()] == '=') {
+                return pair.substr(key.size() + 1);
+            }
+            query = (end == std::string_view::npos ? std::string_view() : query.substr(end + 1));
+        }
+        return std::string_view();
+    }
+
+    static bool keepAlive(const nadjieb::net::HTTPRequestParser& req) {
+        auto connection = req.getValue("Connection");
+        return (req.getVersion() == "HTTP/1.0" ? containsToken(connection, "keep-alive")
+                                               : !containsToken(connection, "close"));
+    }
+
+    nadjieb::net::OnMessageCallbackResponse metrics(const nadjieb::net::HTTPRequestParser& req) {
+        nadjieb::net::OnMessageCallbackResponse cb_res;
+        cb_res.close_conn = !keepAlive(req);
+
+        auto body = metrics_cb_();
+        nadjieb::net::HTTPResponse res;
+        res.setVersion(std::string(req.getVersion()));
+        res.setStatusCode(200);
+        res.setStatusText("OK");
+        res.setValue("Connection", cb_res.close_conn ? "close" : "keep-alive");
+        res.setValue("Cache-Control", "no-cache");
+        res.setValue("Content-Type", "text/plain; version=0.0.4");
+        res.setValue("Content-Length", std::to_string(body.size()));
+        res.setBody(body);
+        cb_res.response = res.serialize();
+        return cb_res;
+    }
+
+    nadjieb::net::OnMessageCallbackResponse upgrade(
+        const nadjieb::net::SocketFD& sockfd,
+        const nadjieb::net::HTTPRequestParser& req) {
+        nadjieb::net::OnMessageCallbackResponse cb_res;
+        nadjieb::net::HTTPResponse res;
+        res.setVersion(std::string(req.getVersion()));
+
+        auto key = req.getValue("Sec-WebSocket-Key");
+        if (req.getMethod() != "GET" || key.empty() || req.getValue("Sec-WebSocket-Version") != "13") {
+            res.setStatusCode(400);
+            res.setStatusText("Bad Request");
+            res.setValue("Sec-WebSocket-Version", "13");
+            res.setValue("Connection", "close");
+            res.setValue("Content-Length", "0");
+            cb_res.response = res.serialize();
+            cb_res.close_conn = true;
+            return cb_res;
+        }
+
+        res.setStatusCode(101);
+        res.setStatusText("Switching Protocols");
+        res.setValue("Upgrade", "websocket");
+        res.setValue("Connection", "Upgrade");
+        res.setValue("Sec-WebSocket-Accept", nadjieb::net::webSocketAccept(key));
+        auto res_str = res.serialize();
+
+        // Before anybody else can send on it, like the stream headers
+        nadjieb::net::sendViaSocket(sockfd, res_str.c_str(), res_str.size(), 0);
+
+        auto websocket = std::make_shared<nadjieb::net::WebSocket>(sockfd, nadjieb::net::getPeerAddress(sockfd));
+        websockets_[sockfd] = websocket;
+        cb_res.upgrade = true;
+        websocket_handler_.on_open(websocket);
+        return cb_res;
+    }
+
+    // Answers from the frame the stream clients are sending, the body is shared rather than copied
+    nadjieb::net::OnMessageCallbackResponse snapshot(const nadjieb::net::HTTPRequestParser& req) {
+        nadjieb::net::OnMessageCallbackResponse cb_res;
+        const std::string version(req.getVersion());
+        const bool head = (req.getMethod() == "HEAD");
+        cb_res.close_conn = !keepAlive(req);
+
+        nadjieb::net::HTTPResponse res;
+        res.setVersion(version);
+        res.setValue("Connection", cb_res.close_conn ? "close" : "keep-alive");
+        res.setValue("Access-Control-Allow-Origin", "*");
+
+        auto frame = publisher_->getFrame(snapshot_path_);
+        if (frame == nullptr) {
+            res.setStatusCode(503);
+            res.setStatusText("Service Unavailable");
+            res.setValue("Retry-After", "1");
+            res.setValue("Content-Length", "0");
+            cb_res.response = res.serialize();
+            return cb_res;
+        }
+
+        char etag[24];
+        snprintf(etag, sizeof(etag), "\"%016llx\"", static_cast<unsigned long long>(frame->getHash()));
+        res.setValue("ETag", etag);
+        res.setValue("Cache-Control", "no-cache");
+
+        auto if_none_match = req.getValue("If-None-Match");
+        if (if_none_match == "*" || if_none_match.find(etag) != std::string_view::npos) {
+            res.setStatusCode(304);
+            res.setStatusText("Not Modified");
+            cb_res.response = res.serialize();
+            return cb_res;
+        }
+
+        res.setStatusCode(200);
+        res.setStatusText("OK");
+        res.setValue("Content-Type", "image/jpeg");
+        res.setValue("Content-Length", std::to_string(frame->body.size()));
+        cb_res.response = res.serialize();
+        if (!head) {
+            cb_res.body = std::shared_ptr<const std::string>(frame, &frame->body);
+        }
+        return cb_res;
+    }
 
     nadjieb::net::OnMessageCallback on_message_cb_ = [&](const nadjieb::net::SocketFD& sockfd,
-                                                         const std::string& message) {
-        nadjieb::net::HTTPRequest req(message);
+                                                         const nadjieb::net::HTTPRequestParser& req) {
         nadjieb::net::OnMessageCallbackResponse cb_res;
+        // Routed without the query string
+        const auto full_target = req.getTarget();
+        const auto query_begin = full_target.find('?');
+        std::string target(full_target.substr(0, query_begin));
+        auto alias = path_aliases_.find(target);
+        if (alias != path_aliases_.end()) {
+            target = alias->second;
+        }
+        const auto query
+            = (query_begin == std::string_view::npos ? std::string_view() : full_target.substr(query_begin + 1));
+        const std::string version(req.getVersion());
 
-        if (req.getTarget() == shutdown_target_) {
+        if (target == shutdown_target_) {
             nadjieb::net::HTTPResponse shutdown_res;
-            shutdown_res.setVersion(req.getVersion());
+            shutdown_res.setVersion(version);
             shutdown_res.setStatusCode(200);
             shutdown_res.setStatusText("OK");
             auto shutdown_res_str = shutdown_res.serialize();
 
             nadjieb::net::sendViaSocket(sockfd, shutdown_res_str.c_str(), shutdown_res_str.size(), 0);
 
-            publisher_.stop();
+            publisher_->stop();
 
             cb_res.end_listener = true;
             return cb_res;
         }
 
+        if (target == snapshot_target_ && (req.getMethod() == "GET" || req.getMethod() == "HEAD")) {
+            if (on_subscribe_cb_) {
+                on_subscribe_cb_(target);
+            }
+            return snapshot(req);
+        }
+
+        if (metrics_cb_ && target == metrics_target_ && req.getMethod() == "GET") {
+            return metrics(req);
+        }
+
+        if (websocket_handler_.on_open && target == websocket_target_
+            && containsToken(req.getValue("Upgrade"), "websocket")) {
+            return upgrade(sockfd, req);
+        }
+
         if (req.getMethod() != "GET") {
             nadjieb::net::HTTPResponse method_not_allowed_res;
-            method_not_allowed_res.setVersion(req.getVersion());
+            method_not_allowed_res.setVersion(version);
             method_not_allowed_res.setStatusCode(405);
             method_not_allowed_res.setStatusText("Method Not Allowed");
             auto method_not_allowed_res_str = method_not_allowed_res.serialize();
@@ -883,9 +3607,9 @@ class MJPEGStreamer : public nadjieb::utils::NonCopyable {
             return cb_res;
         }
 
-        if (!publisher_.pathExists(req.getTarget())) {
+        if (!publisher_->pathExists(target)) {
             nadjieb::net::HTTPResponse not_found_res;
-            not_found_res.setVersion(req.getVersion());
+            not_found_res.setVersion(version);
             not_found_res.setStatusCode(404);
             not_found_res.setStatusText("Not Found");
             auto not_found_res_str = not_found_res.serialize();
@@ -897,7 +3621,7 @@ class MJPEGStreamer : public nadjieb::utils::NonCopyable {
         }
 
         nadjieb::net::HTTPResponse init_res;
-        init_res.setVersion(req.getVersion());
+        init_res.setVersion(version);
         init_res.setStatusCode(200);
         init_res.setStatusText("OK");
         init_res.setValue("Connection", "close");
@@ -910,12 +3634,71 @@ class MJPEGStreamer : public nadjieb::utils::NonCopyable {
 
         nadjieb::net::sendViaSocket(sockfd, init_res_str.c_str(), init_res_str.size(), 0);
 
-        publisher_.add(sockfd, req.getTarget());
+        publisher_->add(sockfd, target);
+        if (on_viewport_cb_) {
+            unsigned width = 0;
+            unsigned height = 0;
+            const std::string viewport(getQueryValue(query, "viewport"));
+            if (sscanf(viewport.c_str(), "%ux%u", &width, &height) != 2) {
+                width = height = 0;
+            }
+            viewport_clients_.insert(sockfd);
+            on_viewport_cb_(sockfd, true, width, height);
+        }
+        if (on_subscribe_cb_) {
+            on_subscribe_cb_(target);
+        }
 
         return cb_res;
     };
 
-    nadjieb::net::OnBeforeCloseCallback on_before_close_cb_
-        = [&](const nadjieb::net::SocketFD& sockfd) { publisher_.removeClient(sockfd); };
+    nadjieb::net::OnBeforeCloseCallback on_before_close_cb_ = [&](const nadjieb::net::SocketFD& sockfd) {
+        auto it = websockets_.find(sockfd);
+        if (it != websockets_.end()) {
+            auto websocket = std::move(it->second);
+            websockets_.erase(it);
+            // No send can reach the socket once it is closed and maybe reused
+            websocket->close();
+            websocket_handler_.on_close(websocket);
+            return;
+        }
+        publisher_->removeClient(sockfd);
+        if (viewport_clients_.erase(sockfd) > 0) {
+            on_viewport_cb_(sockfd, false, 0, 0);
+        }
+    };
+
+    // Control frames are answered here, a pong or close is skipped rather than have the
+    // listener thread wait for a busy sender
+    nadjieb::net::OnWebSocketMessageCallback on_websocket_message_cb_
+        = [&](const nadjieb::net::SocketFD& sockfd, const nadjieb::net::WebSocketMessage& message) {
+              auto it = websockets_.find(sockfd);
+              if (it == websockets_.end()) {
+                  return true;
+              }
+              auto& websocket = it->second;
+
+              switch (message.opcode) {
+                  case nadjieb::net::WebSocketOpcode::PING:
+                      websocket->send(
+                          nadjieb::net::WebSocketOpcode::PONG, message.payload.data(), message.payload.size(), false);
+                      return false;
+                  case nadjieb::net::WebSocketOpcode::PONG:
+                      return false;
+                  case nadjieb::net::WebSocketOpcode::CLOSE:
+                      // Echoes the status code, if any
+                      websocket->send(
+                          nadjieb::net::WebSocketOpcode::CLOSE,
+                          message.payload.data(),
+                          std::min<size_t>(message.payload.size(), 2),
+                          false);
+                      return true;
+                  default:
+                      if (websocket_handler_.on_message) {
+                          websocket_handler_.on_message(websocket, message);
+                      }
+                      return false;
+              }
+          };
 };
 }  // namespace nadjieb
@@ -0,0 +1,628 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Takes the WebSocket sends off the encode thread. Every client has a single latest-frame
+// slot and its own sender thread, so a slow client skips frames instead of stalling the
+// encoder and everybody else. A delta stream (H.264, tiles) can't skip a frame, the client
+// then waits for the next keyframe, which is requested through the key request callback.
+//
+// Framed streams put a header in front of every payload, little-endian:
+//   u8[2] magic "VF", u8 version, u8 header size, u8 codec, u8 flags, u8 channel, u8 reserved,
+//   u32 sequence, u32 encode duration in us, u64 capture time in ns (monotonic),
+//   u16 width, u16 height, u32 reserved
+// Clients skip header size bytes, so later versions can append fields. The sequence counts
+// published frames of the channel, a gap means the client missed some. A frame sent to one
+// client only, the keyframe for a new one, repeats the latest sequence of the channel.
+//
+// A framed client may answer with a report, a binary message, little-endian:
+//   u8[2] magic "VR", u8 version, u8 reserved, u32 sequence,
+//   u32 receipt to decoded in us, u32 receipt to presented in us
+// The client and server clocks are never compared, the return trip is taken to be as long as
+// the way there.
+//
+// Clients can hold the stream back: with a window a client gets at most that many frames it
+// hasn't acked, or it grants credits, a frame each. Held back frames are replaced by newer
+// ones like for any slow client, so the browser's decode queue stays short.
+//
+// Simulcast tiers are channels: a client gets the frames of the one channel it picked,
+// channel 0 unless it asks for another.
+class WsPublisher {
+public:
+    using Data = std::shared_ptr<const std::string>;
+    using KeyRequestCallback = std::function<void()>;
+    // Whatever identifies the connection to its server, libws or the stream port
+    using Key = const void *;
+    // Sends one binary message, blocking, < 0 once the connection failed
+    using Send = std::function<long(const char *, size_t)>;
+
+    static constexpr uint8_t VERSION = 1;
+    static constexpr size_t HEADER_SIZE = 32;
+    static constexpr size_t REPORT_SIZE = 16;
+    static constexpr unsigned LIMIT_CHANNELS = 4;
+
+    enum Codec : uint8_t { CODEC_JPEG = 1, CODEC_H264 = 2, CODEC_TILES = 3 };
+    static constexpr uint8_t FLAG_KEY = 1 << 0;
+
+    struct FrameInfo {
+        Codec codec = CODEC_JPEG;
+        bool key = false;
+        uint64_t capture_ns = 0;
+        uint32_t encode_us = 0;
+        uint16_t width = 0;
+        uint16_t height = 0;
+        uint8_t channel = 0; // < LIMIT_CHANNELS
+    };
+
+    struct ClientStats {
+        uint64_t id = 0; // Tells apart the clients behind one address
+        std::string address;
+        unsigned channel = 0;
+        uint64_t sent = 0;
+        uint64_t bytes = 0; // Sent
+        uint64_t dropped = 0;
+        // Of dropped, the ones replaced or skipped while no send was in progress: paced, out of
+        // credit, resyncing, or the sender not awake yet. The rest fell behind a slow link
+        uint64_t held = 0;
+        uint64_t resyncs = 0;
+        bool flow_control = false;
+        int64_t credits = 0;
+        // The send, from the sender taking the frame until it returned. Waits for pacing or
+        // credits are not in it
+        double last_lag_ms = 0;
+        double avg_lag_ms = 0;
+        double max_lag_ms = 0;
+        // From the client reports, capture until presented
+        uint64_t reports = 0;
+        double decode_ms = 0;
+        double last_glass_ms = 0;
+        double avg_glass_ms = 0;
+        double max_glass_ms = 0;
+    };
+
+    explicit WsPublisher(bool delta_stream = false) : delta_stream_(delta_stream) {}
+
+    ~WsPublisher() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (auto & [client, state] : clients_) {
+            close(*state);
+        }
+        clients_.clear();
+    }
+
+    void setDeltaStream(bool delta_stream) { delta_stream_ = delta_stream; }
+
+    // Set it before the first client, they all get the same stream
+    void setFramed(bool framed) { framed_ = framed; }
+
+    // Set it before the first client, called from publish() without any lock held
+    void setKeyRequestCallback(const KeyRequestCallback & callback) { on_key_request_ = callback; }
+
+    void add(Key client, const std::string & address, const Send & send) {
+        auto state = std::make_shared<Client>();
+        state->send = send;
+        state->stats.address = address;
+        state->stats.id = ++last_id_;
+        // A delta stream starts at a keyframe, whoever opened the connection sends or requests one
+        state->resync = delta_stream_;
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        clients_[client] = state;
+        lock.unlock();
+
+        // Owns its state, so it can outlive a remove() that gave up waiting
+        std::thread(&WsPublisher::sender, state).detach();
+    }
+
+    // The connection goes away after this, waits for a send in progress (bounded, both
+    // servers fail it once the socket is shut down)
+    void remove(Key client) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto it = clients_.find(client);
+        if (it == clients_.end()) {
+            return;
+        }
+        auto state = std::move(it->second);
+        clients_.erase(it);
+        lock.unlock();
+
+        std::unique_lock<std::mutex> client_lock(state->mutex);
+        state->closed = true;
+        state->pending = nullptr;
+        state->condition.notify_all();
+        state->condition.wait_for(client_lock, CLOSE_TIMEOUT, [&]() { return !state->sending; });
+    }
+
+    size_t size() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        return clients_.size();
+    }
+
+    // Whether anybody watches the channel, so its tier is worth encoding
+    bool hasClients(unsigned channel) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (auto & [client, state] : clients_) {
+            std::unique_lock<std::mutex> client_lock(state->mutex);
+            if (state->channel == channel) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // The client starts over on the other channel: sequences, acks and, for a delta
+    // stream, the keyframe
+    void setChannel(Key client, unsigned channel) {
+        auto state = find(client);
+        if (state == nullptr) {
+            return;
+        }
+        channel = std::min(channel, LIMIT_CHANNELS - 1);
+        std::unique_lock<std::mutex> lock(state->mutex);
+        if (state->channel == channel) {
+            return;
+        }
+        state->channel = channel;
+        state->pending = nullptr;
+        state->resync = delta_stream_;
+        state->in_flight.clear();
+        if (state->window > 0) {
+            state->credits = state->window;
+        }
+        const bool request_key = (state->resync && hasCredit(*state));
+        lock.unlock();
+
+        if (request_key && on_key_request_) {
+            on_key_request_();
+        }
+    }
+
+    // Copies once into a recycled buffer, shared by all the clients of the channel
+    void publish(const char * data, size_t size, const FrameInfo & info) {
+        auto sequence = nextSequence(info);
+        publish(copy(data, size, info, sequence), info, sequence);
+    }
+
+    // Only the reference is handed over, data must not change afterwards. Framed streams
+    // still need their copy, the header goes in front.
+    void publish(const Data & data, const FrameInfo & info) {
+        if (framed_) {
+            publish(data->data(), data->size(), info);
+            return;
+        }
+        publish(data, info, nextSequence(info));
+    }
+
+    // A frame for one client only, a keyframe for a new one. It doesn't advance the channel's
+    // sequence, the other clients would see a gap for a frame that was never theirs
+    void sendTo(Key client, const char * data, size_t size, const FrameInfo & info) {
+        auto state = find(client);
+        if (state == nullptr) {
+            return;
+        }
+        auto sequence = currentSequence(info);
+        offer(*state, copy(data, size, info, sequence), info, sequence);
+    }
+
+    // Returns false if the message is not a report
+    bool report(Key client, const unsigned char * msg, size_t size) {
+        if (size < REPORT_SIZE || msg[0] != 'V' || msg[1] != 'R' || msg[2] != VERSION) {
+            return false;
+        }
+        const uint32_t sequence = readU32(msg + 4);
+        const uint32_t decode_us = readU32(msg + 8);
+        const uint32_t present_us = readU32(msg + 12);
+        const auto now = nowNs();
+
+        auto state = find(client);
+        if (state == nullptr) {
+            return true;
+        }
+
+        std::unique_lock<std::mutex> client_lock(state->mutex);
+        const auto & sent = state->history[sequence % LIMIT_HISTORY];
+        if (sent.sequence != sequence || sent.sent_ns == 0 || sent.capture_ns == 0) {
+            // Too old, or the frame carried no capture time
+            return true;
+        }
+        // Capture to sent, the way there, then what the client took to present it
+        const uint64_t present_ns = static_cast<uint64_t>(present_us) * 1000;
+        const uint64_t round_trip_ns = now - sent.sent_ns;
+        const uint64_t way_ns = (round_trip_ns > present_ns ? (round_trip_ns - present_ns) / 2 : 0);
+        const double glass_ms = static_cast<double>(sent.sent_ns - sent.capture_ns + way_ns + present_ns) / 1e6;
+
+        auto & stats = state->stats;
+        ++stats.reports;
+        stats.decode_ms = decode_us / 1e3;
+        stats.last_glass_ms = glass_ms;
+        stats.avg_glass_ms = (stats.reports == 1 ? glass_ms : stats.avg_glass_ms * 0.9 + glass_ms * 0.1);
+        stats.max_glass_ms = std::max(stats.max_glass_ms, glass_ms);
+        return true;
+    }
+
+    // At most window frames that weren't acked yet, 0 turns flow control off. Acks need
+    // the sequence, so a framed stream.
+    void setWindow(Key client, unsigned window) {
+        updateCredits(client, [&](Client & state) {
+            window = std::min<unsigned>(window, LIMIT_WINDOW);
+            state.flow_control = (window > 0);
+            state.window = window;
+            if (window == 0) {
+                state.in_flight.clear();
+            }
+            state.credits = static_cast<int64_t>(window) - static_cast<int64_t>(state.in_flight.size());
+        });
+    }
+
+    // Every frame up to and including sequence, in publish order
+    void ack(Key client, uint32_t sequence) {
+        updateCredits(client, [&](Client & state) {
+            while (!state.in_flight.empty() && static_cast<int32_t>(state.in_flight.front() - sequence) <= 0) {
+                state.in_flight.pop_front();
+                ++state.credits;
+            }
+        });
+    }
+
+    // For clients that don't ack single frames, turns flow control on without a window
+    void grant(Key client, unsigned count) {
+        updateCredits(client, [&](Client & state) {
+            state.flow_control = true;
+            state.credits = std::min<int64_t>(state.credits + count, LIMIT_WINDOW);
+        });
+    }
+
+    // Skipping frames is only up to the publisher if each one stands alone, a delta stream has
+    // to be paced at the encoder with getTargetFps()
+    void setTargetFps(Key client, unsigned fps) {
+        auto state = find(client);
+        if (state == nullptr) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->fps = fps;
+        state->paced = (fps > 0 && !delta_stream_);
+        state->next_send = std::chrono::steady_clock::now();
+        lock.unlock();
+        state->condition.notify_all();
+    }
+
+    // The fastest any client asked for, 0 if one of them wants every frame
+    unsigned getTargetFps() {
+        unsigned fps = 0;
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (auto & [client, state] : clients_) {
+            std::unique_lock<std::mutex> client_lock(state->mutex);
+            if (state->fps == 0) {
+                return 0;
+            }
+            fps = std::max(fps, state->fps);
+        }
+        return fps;
+    }
+
+    // Same clock as FrameInfo::capture_ns
+    static uint64_t nowNs() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    std::vector<ClientStats> getStats() {
+        std::vector<ClientStats> stats;
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (auto & [client, state] : clients_) {
+            std::unique_lock<std::mutex> client_lock(state->mutex);
+            stats.push_back(state->stats);
+            stats.back().channel = state->channel;
+            stats.back().flow_control = state->flow_control;
+            stats.back().credits = state->credits;
+        }
+        return stats;
+    }
+
+    // Prometheus text format
+    std::string getMetrics() {
+        std::ostringstream out;
+        auto stats = getStats();
+        out << "ws_clients " << stats.size() << "\n";
+        for (const auto & client : stats) {
+            const std::string label
+                = "{id=\"" + std::to_string(client.id) + "\",address=\"" + client.address + "\"}";
+            out << "ws_client_channel" << label << " " << client.channel << "\n";
+            out << "ws_client_frames_sent" << label << " " << client.sent << "\n";
+            out << "ws_client_bytes_sent" << label << " " << client.bytes << "\n";
+            out << "ws_client_frames_dropped" << label << " " << client.dropped << "\n";
+            out << "ws_client_frames_held" << label << " " << client.held << "\n";
+            out << "ws_client_resyncs" << label << " " << client.resyncs << "\n";
+            out << "ws_client_lag_ms" << label << " " << client.last_lag_ms << "\n";
+            out << "ws_client_lag_avg_ms" << label << " " << client.avg_lag_ms << "\n";
+            out << "ws_client_lag_max_ms" << label << " " << client.max_lag_ms << "\n";
+            if (client.flow_control) {
+                out << "ws_client_credits" << label << " " << client.credits << "\n";
+            }
+            if (client.reports > 0) {
+                out << "ws_client_reports" << label << " " << client.reports << "\n";
+                out << "ws_client_decode_ms" << label << " " << client.decode_ms << "\n";
+                out << "ws_client_glass_to_glass_ms" << label << " " << client.last_glass_ms << "\n";
+                out << "ws_client_glass_to_glass_avg_ms" << label << " " << client.avg_glass_ms << "\n";
+                out << "ws_client_glass_to_glass_max_ms" << label << " " << client.max_glass_ms << "\n";
+            }
+        }
+        return out.str();
+    }
+
+private:
+    static constexpr size_t LIMIT_HISTORY = 64;
+
+    // What a report is matched against
+    struct Sent {
+        uint32_t sequence = 0;
+        uint64_t capture_ns = 0;
+        uint64_t sent_ns = 0;
+    };
+
+    struct Client {
+        Send send;
+        std::mutex mutex;
+        std::condition_variable condition;
+
+        Data pending;
+        uint32_t pending_sequence = 0;
+        uint64_t pending_capture_ns = 0;
+        Sent history[LIMIT_HISTORY];
+        bool resync = false; // Dropping deltas until the next keyframe
+        bool sending = false;
+        bool closed = false;
+
+        // Flow control, credits go negative when the window shrinks below what is in flight
+        bool flow_control = false;
+        unsigned window = 0;
+        int64_t credits = 0;
+        std::deque<uint32_t> in_flight; // Sent and not acked, with a window only
+
+        unsigned fps = 0;
+        bool paced = false; // By the sender, not for delta streams
+        std::chrono::steady_clock::time_point next_send;
+
+        unsigned channel = 0;
+
+        ClientStats stats;
+    };
+
+    bool delta_stream_;
+    bool framed_ = false;
+    KeyRequestCallback on_key_request_;
+    std::atomic<uint64_t> last_id_{0};
+    std::atomic<uint32_t> last_sequence_[LIMIT_CHANNELS] = {};
+
+    std::mutex mutex_;
+    std::unordered_map<Key, std::shared_ptr<Client>> clients_;
+
+    // Recycled once no client holds them anymore
+    std::vector<std::shared_ptr<std::string>> buffers_;
+    std::mutex buffers_mutex_;
+
+    static constexpr size_t LIMIT_BUFFERS = 8;
+    static constexpr unsigned LIMIT_WINDOW = 64;
+    static constexpr std::chrono::seconds CLOSE_TIMEOUT{2};
+
+    std::shared_ptr<Client> find(Key client) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto it = clients_.find(client);
+        return (it == clients_.end() ? nullptr : it->second);
+    }
+
+    uint32_t nextSequence(const FrameInfo & info) {
+        return ++last_sequence_[std::min<unsigned>(info.channel, LIMIT_CHANNELS - 1)];
+    }
+
+    uint32_t currentSequence(const FrameInfo & info) {
+        return last_sequence_[std::min<unsigned>(info.channel, LIMIT_CHANNELS - 1)].load();
+    }
+
+    static bool hasCredit(const Client & state) { return (!state.flow_control || state.credits > 0); }
+
+    // A client that had to resync while it was out of credits gets its keyframe now
+    template <typename Update>
+    void updateCredits(Key client, Update update) {
+        auto state = find(client);
+        if (state == nullptr) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(state->mutex);
+        const bool had_credit = hasCredit(*state);
+        update(*state);
+        const bool request_key = (!had_credit && hasCredit(*state) && state->resync && !state->closed);
+        lock.unlock();
+        state->condition.notify_all();
+
+        if (request_key && on_key_request_) {
+            on_key_request_();
+        }
+    }
+
+    void publish(const Data & data, const FrameInfo & info, uint32_t sequence) {
+        bool request_key = false;
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (auto & [client, state] : clients_) {
+            request_key |= offer(*state, data, info, sequence);
+        }
+        lock.unlock();
+
+        if (request_key && on_key_request_) {
+            on_key_request_();
+        }
+    }
+
+    Data copy(const char * data, size_t size, const FrameInfo & info, uint32_t sequence) {
+        std::unique_lock<std::mutex> lock(buffers_mutex_);
+        std::shared_ptr<std::string> buffer;
+        for (const auto & candidate : buffers_) {
+            if (candidate.use_count() == 1) {
+                buffer = candidate;
+                break;
+            }
+        }
+        if (buffer == nullptr) {
+            buffer = std::make_shared<std::string>();
+            if (buffers_.size() < LIMIT_BUFFERS) {
+                buffers_.push_back(buffer);
+            }
+        }
+        if (framed_) {
+            buffer->resize(HEADER_SIZE + size);
+            writeHeader(reinterpret_cast<uint8_t *>(&(*buffer)[0]), info, sequence);
+            memcpy(&(*buffer)[HEADER_SIZE], data, size);
+        } else {
+            buffer->assign(data, size);
+        }
+        return buffer;
+    }
+
+    static void writeHeader(uint8_t * out, const FrameInfo & info, uint32_t sequence) {
+        memset(out, 0, HEADER_SIZE);
+        out[0] = 'V';
+        out[1] = 'F';
+        out[2] = VERSION;
+        out[3] = HEADER_SIZE;
+        out[4] = info.codec;
+        out[5] = (info.key ? FLAG_KEY : 0);
+        out[6] = info.channel;
+        writeU32(out + 8, sequence);
+        writeU32(out + 12, info.encode_us);
+        writeU32(out + 16, static_cast<uint32_t>(info.capture_ns));
+        writeU32(out + 20, static_cast<uint32_t>(info.capture_ns >> 32));
+        out[24] = info.width & 0xff;
+        out[25] = info.width >> 8;
+        out[26] = info.height & 0xff;
+        out[27] = info.height >> 8;
+    }
+
+    static void writeU32(uint8_t * out, uint32_t value) {
+        for (int i = 0; i < 4; ++i) {
+            out[i] = (value >> (8 * i)) & 0xff;
+        }
+    }
+
+    static uint32_t readU32(const unsigned char * in) {
+        return in[0] | (in[1] << 8) | (in[2] << 16) | (static_cast<uint32_t>(in[3]) << 24);
+    }
+
+    // Returns true when the client needs a keyframe to carry on
+    bool offer(Client & state, const Data & data, const FrameInfo & info, uint32_t sequence) {
+        std::unique_lock<std::mutex> lock(state.mutex);
+        if (state.closed || state.channel != info.channel) {
+            return false;
+        }
+
+        if (state.resync && !info.key) {
+            ++state.stats.dropped;
+            ++state.stats.held;
+            return false;
+        }
+        if (state.pending != nullptr) {
+            // Fell behind, the unsent frame is replaced. Only behind a send in progress is
+            // that the link's doing, otherwise the sender holds the frame back on purpose
+            ++state.stats.dropped;
+            if (!state.sending) {
+                ++state.stats.held;
+            }
+            if (delta_stream_ && !info.key) {
+                state.pending = nullptr;
+                state.resync = true;
+                ++state.stats.resyncs;
+                // Without credits it would be replaced too, updateCredits() asks later
+                return hasCredit(state);
+            }
+        }
+
+        state.resync = false;
+        state.pending = data;
+        state.pending_sequence = sequence;
+        state.pending_capture_ns = info.capture_ns;
+        lock.unlock();
+        state.condition.notify_one();
+        return false;
+    }
+
+    static void close(Client & state) {
+        std::unique_lock<std::mutex> lock(state.mutex);
+        state.closed = true;
+        state.pending = nullptr;
+        state.condition.notify_all();
+    }
+
+    static void sender(std::shared_ptr<Client> state) {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        while (true) {
+            state->condition.wait(
+                lock, [&]() { return (state->closed || (state->pending != nullptr && hasCredit(*state))); });
+            if (state->closed) {
+                break;
+            }
+            if (state->paced && std::chrono::steady_clock::now() < state->next_send) {
+                // Newer frames keep replacing the pending one meanwhile
+                auto next_send = state->next_send;
+                state->condition.wait_until(lock, next_send, [&]() { return (state->closed || state->next_send != next_send); });
+                continue;
+            }
+
+            auto data = std::move(state->pending);
+            auto since = std::chrono::steady_clock::now();
+            const size_t size = data->size();
+            Sent sent;
+            sent.sequence = state->pending_sequence;
+            sent.capture_ns = state->pending_capture_ns;
+            state->sending = true;
+            lock.unlock();
+
+            long result = state->send(data->data(), data->size());
+            data.reset();
+            double lag_ms = std::chrono::duration < double, std::milli > (std::chrono::steady_clock::now() - since).count();
+            sent.sent_ns = nowNs();
+
+            lock.lock();
+            state->sending = false;
+            if (result < 0) {
+                // The server reports the close, that removes the client
+                state->closed = true;
+            } else {
+                state->history[sent.sequence % LIMIT_HISTORY] = sent;
+                if (state->flow_control) {
+                    --state->credits;
+                    if (state->window > 0) {
+                        state->in_flight.push_back(sent.sequence);
+                    }
+                }
+                if (state->paced) {
+                    state->next_send = std::chrono::steady_clock::now() + std::chrono::microseconds(1000000 / state->fps);
+                }
+                auto & stats = state->stats;
+                ++stats.sent;
+                stats.bytes += size;
+                stats.last_lag_ms = lag_ms;
+                stats.avg_lag_ms = (stats.sent == 1 ? lag_ms : stats.avg_lag_ms * 0.9 + lag_ms * 0.1);
+                stats.max_lag_ms = std::max(stats.max_lag_ms, lag_ms);
+            }
+            state->condition.notify_all();
+        }
+        state->sending = false;
+        state->condition.notify_all();
+    }
+};
@@ -38,8 +38,18 @@
 
 #include <thread>
 
+#include <unordered_map>
+
 #include "encode/m2m.h"
 
+#include "encode/tiles.h"
+
+#include "encode/scale.h"
+
+#include "encode/frame_cache.h"
+
+#include "encode/dmabuf.h"
+
 #include "utils/thread_safe_queue.h"
 
 #include <cutils/properties.h>
@@ -50,6 +60,8 @@
 
 #include "stream/mjpeg_streamer.hpp"
 
+#include "stream/ws_publisher.hpp"
+
 #include <atomic>
 
 #include <ws.h>
@@ -67,8 +79,46 @@ ThreadSafeQueue < us_frame_s > capture_queue;
 
 us_encoder_set encoders;
 
+Minicap::DisplayInfo displayInfo;
+
+// Minicap hands out RGBA_8888 buffers, each of these describes that layout to V4L2
+const unsigned capture_formats[] = {
+  V4L2_PIX_FMT_BGR32,
+  V4L2_PIX_FMT_ABGR32,
+  V4L2_PIX_FMT_XBGR32
+};
+unsigned encoderInputFormat = V4L2_PIX_FMT_BGR32;
+
 int isH264 = 0;
-int encoderQuality = 70;
+int isTiles = 0;
+std::atomic<int> encoderQuality(70);
+
+// Dirty-tile WebSocket stream, see encode/tiles.h for the message layout
+const unsigned tile_size = 64;
+const unsigned tile_key_interval = 300;
+us_tile_encoder_s * tile_encoder = NULL;
+us_frame_s * tiles_frame = NULL;
+
+// Simulcast, MJPEG only: a half size tier next to the full one, from the same capture and
+// a single downscale. /stream and /stream/hi or WebSocket channel 0 get the full size,
+// /stream/lo or channel 1 the half. A tier is only encoded while somebody watches it.
+const uint8_t tier_hi = 0;
+const uint8_t tier_lo = 1;
+bool simulcast = false;
+int simulcastLoQuality = 50;
+us_frame_s * scaled_frame = NULL;
+
+// Recycles encoded frame buffers, the steady state pipeline doesn't touch the heap
+const size_t frame_pool_max_idle = 64 << 20;
+us_frame_pool_s * frame_pool = NULL;
+
+// JPEG frames of the screens seen lately by their content, off unless frame_cache_mb is set
+const unsigned frame_cache_entries = 16;
+us_frame_cache_s * frame_cache = NULL;
+std::atomic<uint64_t> frame_hash_avg_ns(0);
+
+// Encoded frames never get bigger than a byte per pixel, the buffers are sized once
+size_t encoded_frame_max_size = 0;
 
 std::mutex last_encoded_frame_mutex;
 us_frame_s last_encoded_frame;
@@ -76,6 +126,135 @@ us_frame_s last_encoded_frame;
 std::atomic<bool> new_frame_captured(false);
 
 MJPEGStreamer streamer;
+// Resolved once after start, the encode thread publishes without a lookup
+nadjieb::net::Topic * stream_topic = NULL;
+nadjieb::net::Topic * stream_lo_topic = NULL;
+
+// WebSocket sends happen on per-client threads, never on the encode thread
+WsPublisher ws_publisher;
+// WebSocket clients only on the stream port, libws is not started
+bool unifiedServer = false;
+
+// Nobody watching means nothing to capture or encode, see capture_thread()
+std::atomic<int> ws_clients(0);
+const std::chrono::seconds snapshot_demand_window(5);
+std::atomic<int64_t> last_snapshot_ms(INT64_MIN / 2);
+
+int64_t steady_now_ms() {
+  return std::chrono::duration_cast < std::chrono::milliseconds > (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Polling /snapshot.jpg clients keep the JPEG path warm for a while after each request
+bool hasMjpegDemand() {
+  return streamer.hasClient("/stream") ||
+    steady_now_ms() - last_snapshot_ms.load() < std::chrono::duration_cast < std::chrono::milliseconds > (snapshot_demand_window).count();
+}
+
+bool hasLoDemand() {
+  return simulcast && (streamer.hasClient("/stream/lo") || ws_publisher.hasClients(tier_lo));
+}
+
+bool hasHiDemand() {
+  return hasMjpegDemand() || ws_publisher.hasClients(tier_hi);
+}
+
+bool hasDemand() {
+  return ws_clients.load() > 0 || hasMjpegDemand() || hasLoDemand();
+}
+
+void onSubscribe(const std::string & target) {
+  if (target == "/snapshot.jpg") {
+    last_snapshot_ms.store(steady_now_ms());
+  }
+  frameWaiter.interrupt();
+}
+
+// Canvas sizes in device pixels as the clients report them, 0x0 until they do. The capture
+// is scaled down to the largest of them, see capture_thread().
+struct Viewport {
+  unsigned width;
+  unsigned height;
+};
+std::mutex viewports_mutex;
+std::unordered_map < WsPublisher::Key, Viewport > ws_viewports;
+std::unordered_map < int, Viewport > stream_viewports;
+// Bumped whenever the capture size may have to change
+std::atomic < unsigned > capture_size_generation(0);
+
+// Scale steps for congested links, blurrier but still readable where a lower JPEG quality
+// isn't. Applied on top of the viewports, see updateResolutionStep().
+const float resolution_ladder[] = {1.0f, 0.75f, 0.5f};
+const int resolution_ladder_size = sizeof(resolution_ladder) / sizeof(resolution_ladder[0]);
+std::atomic < int > resolution_step(0);
+bool adaptiveResolution = true;
+
+// What the capture thread applied last, for the metrics
+std::atomic < unsigned > capture_width(0);
+std::atomic < unsigned > capture_height(0);
+
+// Shrinking takes a bigger change than growing, every new size costs a keyframe
+const float viewport_shrink_threshold = 0.9f;
+
+void setViewport(WsPublisher::Key client, bool active, unsigned width, unsigned height) {
+  std::lock_guard < std::mutex > lock(viewports_mutex);
+  if (active) {
+    ws_viewports[client] = Viewport {width, height};
+  } else {
+    ws_viewports.erase(client);
+  }
+  capture_size_generation++;
+  frameWaiter.interrupt();
+}
+
+void onStreamViewport(const nadjieb::net::SocketFD & sockfd, bool active, unsigned width, unsigned height) {
+  std::lock_guard < std::mutex > lock(viewports_mutex);
+  if (active) {
+    stream_viewports[sockfd] = Viewport {width, height};
+  } else {
+    stream_viewports.erase(sockfd);
+  }
+  capture_size_generation++;
+  frameWaiter.interrupt();
+}
+
+// The browsers scale to fit, so a canvas needs the frame only as large as its tighter side.
+// Native as soon as one client hasn't said, or there are none, then down the ladder.
+Minicap::DisplayInfo desiredDisplayInfo() {
+  float scale = 0;
+  bool any = false;
+  auto cover = [ & ](const Viewport & viewport) {
+    any = true;
+    if (viewport.width == 0 || viewport.height == 0) {
+      scale = 1;
+    } else {
+      scale = std::max(scale, std::min(static_cast < float > (viewport.width) / displayInfo.width,
+        static_cast < float > (viewport.height) / displayInfo.height));
+    }
+  };
+
+  std::unique_lock < std::mutex > lock(viewports_mutex);
+  for (auto & client : ws_viewports) {
+    cover(client.second);
+  }
+  for (auto & client : stream_viewports) {
+    cover(client.second);
+  }
+  lock.unlock();
+
+  if (!any || scale >= 1) {
+    scale = 1;
+  }
+  scale *= resolution_ladder[resolution_step.load()];
+
+  Minicap::DisplayInfo info = displayInfo;
+  if (scale >= 1) {
+    return info;
+  }
+  // Macroblock aligned, the encoders pad to it anyway
+  info.width = std::min(displayInfo.width, (static_cast < uint32_t > (displayInfo.width * scale) + 15) & ~15u);
+  info.height = std::min(displayInfo.height, (static_cast < uint32_t > (displayInfo.height * scale) + 15) & ~15u);
+  return info;
+}
 
 int get_system_property_int(const char * prop_name) {
   char prop_value[PROPERTY_VALUE_MAX];
@@ -86,26 +265,82 @@ int get_system_property_int(const char * prop_name) {
   }
 }
 
+std::string selectEncoderPath(unsigned output_format) {
+  char path[PROPERTY_VALUE_MAX];
+  if (property_get("persist.tesla-android.virtual-display.encoder_path", path, nullptr) > 0) {
+    return path;
+  }
+
+  us_m2m_probe_s * probe = us_m2m_probe();
+  const us_m2m_device_s * device = us_m2m_probe_select(probe, output_format,
+    capture_formats, sizeof(capture_formats) / sizeof(capture_formats[0]),
+    displayInfo.width, displayInfo.height, & encoderInputFormat);
+  if (device == NULL) {
+    fprintf(stderr, "No M2M encoder can handle %ux%u \n", displayInfo.width, displayInfo.height);
+    exit(1);
+  }
+  std::string result = device -> path;
+  us_m2m_probe_destroy(probe);
+  return result;
+}
+
+void warmupEncoder(us_m2m_encoder_s * encoder) {
+  if (us_m2m_encoder_warmup(encoder, displayInfo.width, displayInfo.height, encoderInputFormat, true) != 0) {
+    fprintf(stderr, "Failed to prepare encoder %s \n", encoder -> path);
+    exit(1);
+  }
+}
+
 void createEncoders() {
   if (isH264) {
     std::string encoder_name_h264 = "encoder_h264";
-    encoders.h264_encoder = us_m2m_h264_encoder_init(encoder_name_h264.c_str(), "/dev/video11", 20000, 30);
+    char profile[PROPERTY_VALUE_MAX];
+    property_get("persist.tesla-android.virtual-display.h264_profile", profile, "default");
+    std::string path = selectEncoderPath(V4L2_PIX_FMT_H264);
+    if (strcmp(profile, "low_latency") == 0) {
+      encoders.h264_encoder = us_m2m_h264_low_latency_encoder_init(encoder_name_h264.c_str(), path.c_str(), 20000, 30);
+    } else {
+      encoders.h264_encoder = us_m2m_h264_encoder_init(encoder_name_h264.c_str(), path.c_str(), 20000, 30);
+    }
+    warmupEncoder(encoders.h264_encoder);
   } else {
     std::string encoder_name_jpeg = "encoder_jpeg";
-    encoders.jpeg_encoder = us_m2m_mjpeg_encoder_init(encoder_name_jpeg.c_str(), "/dev/video11", encoderQuality);
+    std::string path = selectEncoderPath(V4L2_PIX_FMT_MJPEG);
+    encoders.jpeg_encoder = us_m2m_mjpeg_encoder_init(encoder_name_jpeg.c_str(), path.c_str(), encoderQuality);
+    warmupEncoder(encoders.jpeg_encoder);
+    if (isTiles) {
+      tile_encoder = us_tile_encoder_init("encoder_tiles", tile_size, encoderQuality, tile_key_interval);
+      tiles_frame = us_frame_init_pooled(frame_pool);
+    }
+    if (simulcast) {
+      // Fed from memory, the downscaled frame is no dma-buf
+      encoders.jpeg_lo_encoder = us_m2m_mjpeg_encoder_init("encoder_jpeg_lo", path.c_str(), simulcastLoQuality);
+      if (us_m2m_encoder_warmup(encoders.jpeg_lo_encoder, displayInfo.width / 2, displayInfo.height / 2, encoderInputFormat, false) != 0) {
+        fprintf(stderr, "Failed to prepare encoder %s \n", encoders.jpeg_lo_encoder -> path);
+        exit(1);
+      }
+      scaled_frame = us_frame_init_pooled(frame_pool);
+    }
   }
 }
 
-void capture_thread() {
-  Minicap::DisplayInfo displayInfo;
-
-  if (minicap_try_get_display_info(0, & displayInfo) != 0) {
-    fprintf(stderr, "Failed to get info from internal display \n");
-    exit(1);
-  }
+void pushCapturedFrame(const Minicap::Frame & capturedFrame, bool forceKey) {
+  us_frame_s encoderFrame = {};
+  encoderFrame.width = capturedFrame.width;
+  encoderFrame.height = capturedFrame.height;
+  encoderFrame.format = encoderInputFormat;
+  encoderFrame.stride = capturedFrame.stride * capturedFrame.bpp; // bytesperline
+  encoderFrame.used = capturedFrame.size;
+  encoderFrame.force_key_on_encode = forceKey;
+  encoderFrame.dma_fd = capturedFrame.dma_fd;
+  encoderFrame.grab_ts = WsPublisher::nowNs() / 1e9L;
+
+  new_frame_captured.store(true);
+  capture_queue.push(encoderFrame);
+}
 
+void capture_thread() {
   Minicap::Frame capturedFrame;
-  bool haveFrame = false;
 
   Minicap * minicap = minicap_create(0);
   if (minicap == NULL) {
@@ -130,12 +365,91 @@ void capture_thread() {
     exit(1);
   }
 
+  // Without subscribers frames are still consumed, so the producer never stalls, but not encoded.
+  // The newest one is held back to resume from within a frame. A virtual display only costs
+  // composition while its content changes, so the idle timeout is checked as frames arrive.
+  int idle_release_s = get_system_property_int("persist.tesla-android.virtual-display.idle_release_s");
+  Minicap::DisplayInfo captureInfo = displayInfo;
+  capture_width = captureInfo.width;
+  capture_height = captureInfo.height;
+  unsigned appliedViewports = capture_size_generation.load();
+  bool idle = false;
+  bool holdingFrame = false;
+  bool displayReleased = false;
+  bool forceKey = false;
+  auto idleSince = std::chrono::steady_clock::now();
+
   int err;
   while (true) {
-    if (!frameWaiter.waitForFrame()) {
+    bool demand = hasDemand();
+    if (!demand && !idle) {
+      printf("No subscribers, capture idle \n");
+      idle = true;
+      idleSince = std::chrono::steady_clock::now();
+    } else if (demand && idle) {
+      printf("Subscriber connected, capture resumed \n");
+      idle = false;
+      forceKey = true;
+      if (displayReleased) {
+        if (minicap -> applyConfigChanges() != 0) {
+          fprintf(stderr, "Unable to restart minicap with current config \n");
+          exit(1);
+        }
+        displayReleased = false;
+      } else if (holdingFrame) {
+        pushCapturedFrame(capturedFrame, true);
+        minicap -> releaseConsumedFrame( & capturedFrame);
+        holdingFrame = false;
+        forceKey = false;
+      }
+    }
+
+    if (!displayReleased && capture_size_generation.load() != appliedViewports) {
+      appliedViewports = capture_size_generation.load();
+      Minicap::DisplayInfo desired = desiredDisplayInfo();
+      if (desired.width > captureInfo.width ||
+        desired.width < captureInfo.width * viewport_shrink_threshold) {
+        printf("Capturing at %ux%u for the client viewports \n", desired.width, desired.height);
+        if (holdingFrame) {
+          minicap -> releaseConsumedFrame( & capturedFrame);
+          holdingFrame = false;
+        }
+        minicap -> setDesiredInfo(desired);
+        if (minicap -> applyConfigChanges() != 0) {
+          fprintf(stderr, "Unable to resize minicap \n");
+          exit(1);
+        }
+        frameWaiter.reset();
+        captureInfo = desired;
+        capture_width = desired.width;
+        capture_height = desired.height;
+        forceKey = true;
+      }
+    }
+
+    if (idle && !displayReleased && idle_release_s > 0 &&
+      std::chrono::steady_clock::now() - idleSince >= std::chrono::seconds(idle_release_s)) {
+      printf("Idle for %ds, releasing virtual display \n", idle_release_s);
+      minicap -> release();
+      holdingFrame = false;
+      displayReleased = true;
+      frameWaiter.reset();
+    }
+
+    int pending = frameWaiter.waitForFrame();
+    if (pending == 0) {
       fprintf(stderr, "Unable to wait for frame \n");
       exit(1);
     }
+    if (pending < 0 || displayReleased) {
+      // Subscribers changed
+      continue;
+    }
+
+    if (holdingFrame) {
+      minicap -> releaseConsumedFrame( & capturedFrame);
+      holdingFrame = false;
+    }
     if ((err = minicap -> consumePendingFrame( & capturedFrame)) != 0) {
       if (err == -EINTR) {
         fprintf(stderr, "Frame consumption interrupted by EINTR \n");
@@ -146,17 +460,13 @@ void capture_thread() {
       }
     }
 
-    us_frame_s encoderFrame;
-    encoderFrame.width = capturedFrame.width;
-    encoderFrame.height = capturedFrame.height;
-    encoderFrame.format = V4L2_PIX_FMT_BGR32;
-    encoderFrame.stride = capturedFrame.stride;
-    encoderFrame.used = capturedFrame.size;
-    encoderFrame.force_key_on_encode = false;
-    encoderFrame.dma_fd = capturedFrame.dma_fd;
+    if (idle) {
+      holdingFrame = true;
+      continue;
+    }
 
-    new_frame_captured.store(true);
-    capture_queue.push(encoderFrame);
+    pushCapturedFrame(capturedFrame, forceKey);
+    forceKey = false;
 
     minicap -> releaseConsumedFrame( & capturedFrame);
   }
@@ -169,7 +479,6 @@ void encode_frame(us_m2m_encoder_s * encoder,
   output_frame.format = format;
   output_frame.stride = 0;
   output_frame.used = 0;
-  output_frame.data = NULL;
   output_frame.force_key_on_encode = false;
 
   int compression_result = us_m2m_encoder_compress(encoder, & input_frame, & output_frame, input_frame.force_key_on_encode);
@@ -179,55 +488,316 @@ void encode_frame(us_m2m_encoder_s * encoder,
   }
 }
 
+// The WebSocket clients of a delta stream can only get fewer frames if fewer are encoded.
+// A skipped keyframe request moves on to the next frame.
+bool skipDeltaFrame(us_frame_s & input_frame, uint64_t & next_delta_ns, bool & carry_key) {
+  unsigned fps = ws_publisher.getTargetFps();
+  uint64_t now = WsPublisher::nowNs();
+  input_frame.force_key_on_encode |= carry_key;
+  if (fps > 0 && now < next_delta_ns) {
+    carry_key = input_frame.force_key_on_encode;
+    return true;
+  }
+  next_delta_ns = (fps > 0 ? now + 1000000000ull / fps : 0);
+  carry_key = false;
+  return false;
+}
+
+// Header fields of framed WebSocket streams, the encode time counts from encode_begin_ns
+WsPublisher::FrameInfo frameInfo(const us_frame_s & frame, WsPublisher::Codec codec, bool key, uint64_t encode_begin_ns) {
+  WsPublisher::FrameInfo info;
+  info.codec = codec;
+  info.key = key;
+  info.capture_ns = static_cast < uint64_t > (frame.grab_ts * 1e9L);
+  if (encode_begin_ns > 0) {
+    info.encode_us = static_cast < uint32_t > ((WsPublisher::nowNs() - encode_begin_ns) / 1000);
+  }
+  info.width = frame.width;
+  info.height = frame.height;
+  return info;
+}
+
+void encode_tiles(const us_frame_s & input_frame) {
+  uint64_t encode_begin_ns = WsPublisher::nowNs();
+  us_dmabuf_map_s map;
+  if (us_dmabuf_map( & map, input_frame.dma_fd, input_frame.used) != 0) {
+    return;
+  }
+  int n_tiles = us_tile_encoder_compress(tile_encoder, & input_frame, map.data, NULL, 0, tiles_frame);
+  us_dmabuf_unmap( & map);
+
+  if (n_tiles > 0) {
+    ws_publisher.publish(reinterpret_cast < char * > (tiles_frame -> data), tiles_frame -> used,
+      frameInfo(input_frame, WsPublisher::CODEC_TILES, tiles_frame -> key, encode_begin_ns));
+  }
+}
+
+// A screen that comes back is published from the cache. The hash reads the capture once
+// more, a hit saves the encoder round trip.
+void encode_jpeg_cached(const us_frame_s & input_frame, us_frame_s & output_frame) {
+  if (frame_cache == NULL) {
+    encode_frame(encoders.jpeg_encoder, input_frame, output_frame, V4L2_PIX_FMT_JPEG);
+    return;
+  }
+
+  uint64_t hash_begin_ns = WsPublisher::nowNs();
+  us_dmabuf_map_s map;
+  if (us_dmabuf_map( & map, input_frame.dma_fd, input_frame.used) != 0) {
+    encode_frame(encoders.jpeg_encoder, input_frame, output_frame, V4L2_PIX_FMT_JPEG);
+    return;
+  }
+  // Capture formats are all 32-bit
+  uint64_t hash = us_frame_hash(map.data, input_frame.stride, input_frame.width * 4, input_frame.height);
+  us_dmabuf_unmap( & map);
+  uint64_t hash_ns = WsPublisher::nowNs() - hash_begin_ns;
+  uint64_t avg_ns = frame_hash_avg_ns.load();
+  frame_hash_avg_ns.store(avg_ns == 0 ? hash_ns : (avg_ns * 7 + hash_ns) / 8);
+
+  const unsigned quality = encoderQuality;
+  if (us_frame_cache_get(frame_cache, hash, & input_frame, quality, & output_frame)) {
+    return;
+  }
+  encode_frame(encoders.jpeg_encoder, input_frame, output_frame, V4L2_PIX_FMT_JPEG);
+  if (output_frame.used > 0 && encoderQuality == static_cast < int > (quality)) {
+    // Not if the quality changed meanwhile, the frame may be from either setting
+    us_frame_cache_put(frame_cache, hash, & input_frame, quality, & output_frame);
+  }
+}
+
+// The low simulcast tier: the capture is read once to halve it, its own encoder converts
+// and compresses the result
+void encode_lo(const us_frame_s & input_frame, us_frame_s & encoded_frame) {
+  uint64_t encode_begin_ns = WsPublisher::nowNs();
+  us_dmabuf_map_s map;
+  if (us_dmabuf_map( & map, input_frame.dma_fd, input_frame.used) != 0) {
+    return;
+  }
+  us_scale_half_32(map.data, input_frame.stride, input_frame.width, input_frame.height, input_frame.format, scaled_frame);
+  us_dmabuf_unmap( & map);
+  scaled_frame -> grab_ts = input_frame.grab_ts;
+  scaled_frame -> force_key_on_encode = false;
+
+  encoded_frame.used = 0;
+  encode_frame(encoders.jpeg_lo_encoder, * scaled_frame, encoded_frame, V4L2_PIX_FMT_JPEG);
+  if (encoded_frame.used == 0) {
+    return;
+  }
+  streamer.publish( * stream_lo_topic, reinterpret_cast < char * > (encoded_frame.data), encoded_frame.used);
+  nadjieb::net::Frame frame = stream_lo_topic -> getFrame();
+  if (frame != nullptr) {
+    WsPublisher::FrameInfo info = frameInfo( * scaled_frame, WsPublisher::CODEC_JPEG, true, encode_begin_ns);
+    info.channel = tier_lo;
+    ws_publisher.publish(WsPublisher::Data(frame, & frame -> body), info);
+  }
+}
+
 void encode_thread() {
+  // Kept across frames so their buffers only grow during warm-up
+  us_frame_s * encoded_frame = us_frame_init_pooled(frame_pool);
+  us_frame_realloc_data(encoded_frame, encoded_frame_max_size);
+  us_frame_s * encoded_lo_frame = NULL;
+  if (simulcast) {
+    encoded_lo_frame = us_frame_init_pooled(frame_pool);
+    us_frame_realloc_data(encoded_lo_frame, encoded_frame_max_size / 4);
+  }
+  uint64_t next_delta_ns = 0;
+  bool carry_key = false;
+
   while (true) {
     us_frame_s input_frame = capture_queue.pop();
-    us_frame_s encoded_frame_h264;
-    us_frame_s encoded_frame_jpeg;
-    us_encoded_frame_set encoded_frames;
+    encoded_frame -> used = 0;
+    uint64_t encode_begin_ns = 0;
 
     if (isH264) {
-      encode_frame(encoders.h264_encoder, input_frame, encoded_frame_h264, V4L2_PIX_FMT_H264);
-      encoded_frames.h264_frame = encoded_frame_h264;
+      if (skipDeltaFrame(input_frame, next_delta_ns, carry_key)) {
+        continue;
+      }
+      encode_begin_ns = WsPublisher::nowNs();
+      encode_frame(encoders.h264_encoder, input_frame, * encoded_frame, V4L2_PIX_FMT_H264);
     } else {
-      encode_frame(encoders.jpeg_encoder, input_frame, encoded_frame_jpeg, V4L2_PIX_FMT_JPEG);
-      encoded_frames.jpeg_frame = encoded_frame_jpeg;
+      if (isTiles) {
+        if (!skipDeltaFrame(input_frame, next_delta_ns, carry_key)) {
+          if (input_frame.force_key_on_encode) {
+            us_tile_encoder_force_key(tile_encoder);
+          }
+          encode_tiles(input_frame);
+        }
+        if (!hasMjpegDemand()) {
+          // Full frames are only needed by MJPEG viewers in this mode
+          continue;
+        }
+      }
+      if (simulcast) {
+        if (hasLoDemand()) {
+          encode_lo(input_frame, * encoded_lo_frame);
+        }
+        if (!hasHiDemand()) {
+          continue;
+        }
+      }
+      encode_begin_ns = WsPublisher::nowNs();
+      encode_jpeg_cached(input_frame, * encoded_frame);
     }
 
-    if (encoded_frame_jpeg.data != nullptr || encoded_frame_h264.data != nullptr) {
+    if (encoded_frame -> used > 0) {
       if (isH264) {
-        free(encoded_frames.h264_frame.data);
+        ws_publisher.publish(reinterpret_cast < char * > (encoded_frame -> data), encoded_frame -> used,
+          frameInfo(input_frame, WsPublisher::CODEC_H264, encoded_frame -> key, encode_begin_ns));
       } else {
         last_encoded_frame_mutex.lock();
-        if (last_encoded_frame.data != nullptr) {
-        	free(last_encoded_frame.data);
-        }
-        last_encoded_frame = encoded_frames.jpeg_frame;
-        last_encoded_frame.data = static_cast < uint8_t * > (malloc(encoded_frames.jpeg_frame.used));
-        memcpy(last_encoded_frame.data, encoded_frames.jpeg_frame.data, last_encoded_frame.used);
+        us_frame_copy(encoded_frame, & last_encoded_frame);
         last_encoded_frame_mutex.unlock();
 
-        std::string frameData(reinterpret_cast < char * > (encoded_frames.jpeg_frame.data), encoded_frames.jpeg_frame.used);
-        streamer.publish("/stream", frameData);
-	ws_sendframe_bin(NULL, reinterpret_cast < char * > (encoded_frames.jpeg_frame.data), encoded_frames.jpeg_frame.used);
-
-        free(encoded_frames.jpeg_frame.data);
+        streamer.publish( * stream_topic, reinterpret_cast < char * > (encoded_frame -> data), encoded_frame -> used);
+        if (!isTiles) {
+          // The very buffer the MJPEG clients are sending, not another copy
+          nadjieb::net::Frame frame = stream_topic -> getFrame();
+          if (frame != nullptr) {
+            ws_publisher.publish(WsPublisher::Data(frame, & frame -> body),
+              frameInfo(input_frame, WsPublisher::CODEC_JPEG, true, encode_begin_ns));
+          }
+        }
       }
     } else {
       std::cout << "encode_thread(): Encoded frame data is null" << std::endl;
     }
-    free(input_frame.data);
   }
 }
 
+void setEncoderQuality(int quality) {
+  // Both the broadcast thread and the WebSocket clients end up here
+  static std::mutex quality_mutex;
+  std::lock_guard < std::mutex > lock(quality_mutex);
+  if (quality <= 0 || quality > 100 || quality == encoderQuality) {
+    return;
+  }
+  encoderQuality = quality;
+  if (!isH264) {
+    // Applied live with VIDIOC_S_CTRL, the encoder is not rebuilt
+    us_m2m_encoder_set_quality(encoders.jpeg_encoder, encoderQuality);
+    if (isTiles) {
+      us_tile_encoder_set_quality(tile_encoder, encoderQuality);
+    }
+  }
+}
+
+// Only a changed property is applied, so it doesn't undo what a client asked for since
+void updateEncoderQuality() {
+  static int propertyQuality = encoderQuality;
+  int quality = get_system_property_int("persist.tesla-android.virtual-display.quality");
+  if (quality == propertyQuality) {
+    return;
+  }
+  propertyQuality = quality;
+  setEncoderQuality(quality);
+}
+
+// Once a second from the WebSocket send statistics. A client whose sends fall behind, frames
+// replaced while one was still going out, or take long takes the whole stream a step down,
+// the shared encoder can't do better. Frames a client holds back with fps or flow control
+// don't count. Up again only after a while without trouble, and if sending the bigger
+// frames, judging by the time the current ones take, still leaves half of the frame interval.
+void updateResolutionStep() {
+  struct Sample {
+    uint64_t sent;
+    uint64_t dropped; // Behind a send in progress only
+  };
+  static std::unordered_map < uint64_t, Sample > previous;
+  static int healthy_s = 0;
+  static int hold_s = 0;
+  const int up_after_s = 5;
+  const int hold_after_change_s = 3;
+
+  std::unordered_map < uint64_t, Sample > current;
+  bool congested = false;
+  bool healthy = true;
+  bool active = false;
+  int step = resolution_step.load();
+  float up_ratio = (step > 0 ? resolution_ladder[step - 1] / resolution_ladder[step] : 1.0f);
+
+  for (const auto & client : ws_publisher.getStats()) {
+    current[client.id] = Sample {client.sent, client.dropped - client.held};
+    auto it = previous.find(client.id);
+    if (it == previous.end()) {
+      continue;
+    }
+    uint64_t sent = client.sent - it -> second.sent;
+    uint64_t dropped = current[client.id].dropped - it -> second.dropped;
+    uint64_t offered = sent + dropped;
+    if (offered < 5) {
+      // Too few frames to tell, e.g. a static screen
+      continue;
+    }
+    active = true;
+    float drop_ratio = static_cast < float > (dropped) / offered;
+    if (drop_ratio > 0.25f || client.avg_lag_ms > 200) {
+      congested = true;
+    } else if (drop_ratio > 0.05f || client.avg_lag_ms * up_ratio * up_ratio > 500.0 / offered) {
+      healthy = false;
+    }
+  }
+  previous.swap(current);
+
+  if (hold_s > 0) {
+    hold_s--;
+    return;
+  }
+  if (congested && step + 1 < resolution_ladder_size) {
+    step++;
+  } else if (active && healthy && !congested && step > 0 && ++healthy_s >= up_after_s) {
+    step--;
+  } else {
+    if (!healthy || congested) {
+      healthy_s = 0;
+    }
+    return;
+  }
+
+  printf("Resolution step %d (%d%%) \n", step, static_cast < int > (resolution_ladder[step] * 100));
+  resolution_step = step;
+  healthy_s = 0;
+  hold_s = hold_after_change_s;
+  capture_size_generation++;
+  frameWaiter.interrupt();
+}
+
+std::string captureMetrics() {
+  std::string out;
+  out += "capture_resolution_step " + std::to_string(resolution_step.load()) + "\n";
+  out += "capture_resolution_percent " + std::to_string(static_cast < int > (resolution_ladder[resolution_step.load()] * 100)) + "\n";
+  out += "capture_width " + std::to_string(capture_width.load()) + "\n";
+  out += "capture_height " + std::to_string(capture_height.load()) + "\n";
+  if (frame_cache != NULL) {
+    us_frame_cache_stats_s stats;
+    us_frame_cache_get_stats(frame_cache, & stats);
+    uint64_t lookups = stats.hits + stats.misses;
+    out += "frame_cache_hits " + std::to_string(stats.hits) + "\n";
+    out += "frame_cache_misses " + std::to_string(stats.misses) + "\n";
+    out += "frame_cache_hit_ratio " + std::to_string(lookups > 0 ? static_cast < double > (stats.hits) / lookups : 0) + "\n";
+    out += "frame_cache_evictions " + std::to_string(stats.evictions) + "\n";
+    out += "frame_cache_entries " + std::to_string(stats.entries) + "\n";
+    out += "frame_cache_bytes " + std::to_string(stats.bytes) + "\n";
+    out += "frame_cache_hash_avg_us " + std::to_string(frame_hash_avg_ns.load() / 1000) + "\n";
+  }
+  return out;
+}
+
 void broadcast_thread() {
   while (true) {
     std::this_thread::sleep_for(std::chrono::seconds(1));
+    updateEncoderQuality();
+    if (adaptiveResolution) {
+      updateResolutionStep();
+    }
+    us_frame_pool_log_stats(frame_pool);
+    if (!unifiedServer) {
+      // Drops the libws clients that missed 5 pongs in a row
+      ws_ping(NULL, 5);
+    }
     if (!new_frame_captured.load()) {
         last_encoded_frame_mutex.lock();
-        if (last_encoded_frame.data != nullptr) {
-            std::string frameData(reinterpret_cast<char*>(last_encoded_frame.data), last_encoded_frame.used);
-            streamer.publish("/stream", frameData);
+        if (last_encoded_frame.used > 0) {
+            streamer.publish(*stream_topic, reinterpret_cast<char*>(last_encoded_frame.data), last_encoded_frame.used);
         }
         last_encoded_frame_mutex.unlock();
     }
@@ -235,52 +805,244 @@ void broadcast_thread() {
     }
 }
 
-void ws_on_connection_opened(ws_cli_conn_t *client) {
-  char *cli;
-  cli = ws_getaddress(client);
-  printf("Connection opened, addr: %s\n", cli);
+// A WebSocket client fell behind on a delta stream and skips ahead to the next keyframe
+void onKeyRequest() {
+  if (isH264 && encoders.h264_encoder != NULL) {
+    us_m2m_encoder_force_key(encoders.h264_encoder);
+  } else if (isTiles && tile_encoder != NULL) {
+    us_tile_encoder_force_key(tile_encoder);
+  }
+}
+
+// Both WebSocket servers end up here, a client is known by its connection pointer
+void onWsOpened(WsPublisher::Key client, const std::string & address, const WsPublisher::Send & send) {
+  printf("Connection opened, addr: %s\n", address.c_str());
+  ws_publisher.add(client, address, send);
+  setViewport(client, true, 0, 0);
+  ws_clients++;
+  frameWaiter.interrupt();
+
+  if (isH264) {
+    // There are no periodic IDRs in the low latency profile, the new decoder needs one now
+    onKeyRequest();
+    return;
+  }
+
+  if (isTiles) {
+    if (tile_encoder == NULL) {
+      // Connected during startup, the first tile message is a keyframe anyway
+      return;
+    }
+    // The client needs a full canvas to composite the following tiles on
+    us_frame_s * key_frame = us_frame_init_pooled(frame_pool);
+    if (us_tile_encoder_compress_ref_key(tile_encoder, key_frame) == 0) {
+      WsPublisher::FrameInfo info;
+      info.codec = WsPublisher::CODEC_TILES;
+      info.key = true;
+      info.width = tile_encoder -> width;
+      info.height = tile_encoder -> height;
+      ws_publisher.sendTo(client, reinterpret_cast < char * > (key_frame -> data), key_frame -> used, info);
+    }
+    us_frame_destroy(key_frame);
+    return;
+  }
 
   if (!new_frame_captured.load()) {
      last_encoded_frame_mutex.lock();
-     if (last_encoded_frame.data != nullptr) {
-         std::string frameData(reinterpret_cast<char*>(last_encoded_frame.data), last_encoded_frame.used);
-         ws_sendframe_bin(NULL, reinterpret_cast<char*>(last_encoded_frame.data), last_encoded_frame.used);
+     if (last_encoded_frame.used > 0) {
+         ws_publisher.sendTo(client, reinterpret_cast<char*>(last_encoded_frame.data), last_encoded_frame.used,
+           frameInfo(last_encoded_frame, WsPublisher::CODEC_JPEG, true, 0));
      }
      last_encoded_frame_mutex.unlock();
   }
   new_frame_captured.store(false);
 }
 
+void onWsClosed(WsPublisher::Key client, const std::string & address) {
+  printf("Connection closed, addr: %s\n", address.c_str());
+  ws_publisher.remove(client);
+  setViewport(client, false, 0, 0);
+  ws_clients--;
+}
+
+// Text control messages, a command and an optional number:
+//   keyframe      a keyframe now (delta streams)
+//   window N      at most N frames in flight that weren't acked, 0 turns flow control off
+//   ack SEQ       acks every frame up to the sequence from the frame header (framed streams)
+//   credit N      N more frames, flow control without acks
+//   fps N         at most N frames a second, 0 for all of them
+//   quality N     encoder quality, shared by all the clients (JPEG, tiles)
+//   viewport W H  canvas size in device pixels, the capture shrinks to the largest one
+//   tier N        simulcast tier, 0 full size, 1 half size
+void onWsMessage(WsPublisher::Key client, const unsigned char * msg, uint64_t size, bool binary) {
+  if (binary) {
+    // Decode and present times of a framed stream client
+    ws_publisher.report(client, msg, size);
+    return;
+  }
+  if (size >= 64) {
+    return;
+  }
+
+  char text[64];
+  memcpy(text, msg, size);
+  text[size] = '\0';
+  char command[16];
+  unsigned long value = 0;
+  unsigned long value2 = 0;
+  if (sscanf(text, "%15s %lu %lu", command, & value, & value2) < 1) {
+    return;
+  }
+
+  if (strcmp(command, "keyframe") == 0) {
+    onKeyRequest();
+  } else if (strcmp(command, "window") == 0) {
+    ws_publisher.setWindow(client, value);
+  } else if (strcmp(command, "ack") == 0) {
+    ws_publisher.ack(client, static_cast < uint32_t > (value));
+  } else if (strcmp(command, "credit") == 0) {
+    ws_publisher.grant(client, value);
+  } else if (strcmp(command, "fps") == 0) {
+    ws_publisher.setTargetFps(client, value);
+  } else if (strcmp(command, "quality") == 0) {
+    setEncoderQuality(static_cast < int > (value));
+  } else if (strcmp(command, "viewport") == 0) {
+    setViewport(client, true, value, value2);
+  } else if (strcmp(command, "tier") == 0 && simulcast) {
+    ws_publisher.setChannel(client, std::min < unsigned long > (value, tier_lo));
+    frameWaiter.interrupt();
+  }
+}
+
+void ws_on_connection_opened(ws_cli_conn_t *client) {
+  onWsOpened(client, ws_getaddress(client), [client](const char * data, size_t size) {
+    return static_cast < long > (ws_sendframe_bin(client, data, size));
+  });
+}
+
 void ws_on_connection_closed(ws_cli_conn_t *client) {
-  char *cli;
-  cli = ws_getaddress(client);
-  printf("Connection closed, addr: %s\n", cli);
+  onWsClosed(client, ws_getaddress(client));
+}
+
+void ws_on_message(ws_cli_conn_t *client,
+       const unsigned char *msg,
+       uint64_t size,
+       int type) {
+  if (type == WS_FR_OP_BIN || type == WS_FR_OP_TXT) {
+    onWsMessage(client, msg, size, type == WS_FR_OP_BIN);
+  }
 }
 
-void ws_on_message(__attribute__ ((unused)) ws_cli_conn_t *client,
-       __attribute__ ((unused)) const unsigned char *msg,
-       __attribute__ ((unused)) uint64_t size,
-       __attribute__ ((unused)) int type) {
-  ws_ping(NULL, 5);
+// The same clients on the stream port, ws://<host>:9090/ws
+nadjieb::WebSocketHandler streamPortWebSocketHandler() {
+  using WebSocket = std::shared_ptr < nadjieb::net::WebSocket > ;
+  nadjieb::WebSocketHandler handler;
+  handler.on_open = [](const WebSocket & websocket) {
+    onWsOpened(websocket.get(), websocket -> getAddress(), [websocket](const char * data, size_t size) {
+      return websocket -> send(nadjieb::net::WebSocketOpcode::BINARY, data, size);
+    });
+  };
+  handler.on_message = [](const WebSocket & websocket, const nadjieb::net::WebSocketMessage & message) {
+    onWsMessage(websocket.get(), reinterpret_cast < const unsigned char * > (message.payload.data()),
+      message.payload.size(), message.opcode == nadjieb::net::WebSocketOpcode::BINARY);
+  };
+  handler.on_close = [](const WebSocket & websocket) {
+    onWsClosed(websocket.get(), websocket -> getAddress());
+  };
+  return handler;
 }
 
 int main(__attribute__((unused)) int argc, __attribute__((unused)) char ** argv) {
   minicap_start_thread_pool();
-  streamer.start(9090, 4);
-
-  struct ws_events evs;
-  evs.onopen    = &ws_on_connection_opened;
-  evs.onclose   = &ws_on_connection_closed;
-  evs.onmessage = &ws_on_message;
-  ws_socket(&evs, 9091, 1, 1000);
 
   isH264 = get_system_property_int("persist.tesla-android.virtual-display.is_h264");
+  isTiles = get_system_property_int("persist.tesla-android.virtual-display.is_tiles") == 1 && !isH264;
   encoderQuality = get_system_property_int("persist.tesla-android.virtual-display.quality");
 
+  ws_publisher.setDeltaStream(isH264 || isTiles);
+  simulcast = get_system_property_int("persist.tesla-android.virtual-display.simulcast") == 1 && !isH264 && !isTiles;
+  int lo_quality = get_system_property_int("persist.tesla-android.virtual-display.simulcast_lo_quality");
+  if (lo_quality > 0 && lo_quality <= 100) {
+    simulcastLoQuality = lo_quality;
+  }
+  adaptiveResolution = get_system_property_int("persist.tesla-android.virtual-display.adaptive_resolution") != 0;
+  ws_publisher.setKeyRequestCallback(onKeyRequest);
+  // Sequence, capture time, encode time and size in front of every WebSocket payload
+  ws_publisher.setFramed(get_system_property_int("persist.tesla-android.virtual-display.ws_framed") == 1);
+
+  // Large parts skip the per-client copy into the socket buffer, 0 always copies
+  int zero_copy_kb = get_system_property_int("persist.tesla-android.virtual-display.zero_copy_kb");
+  if (zero_copy_kb >= 0) {
+    streamer.setZeroCopyThreshold(static_cast < size_t > (zero_copy_kb) << 10);
+  }
+
+  streamer.setOnSubscribeCallback(onSubscribe);
+  streamer.setOnViewportCallback(onStreamViewport);
+  streamer.setMetricsCallback("/metrics", []() { return captureMetrics() + ws_publisher.getMetrics(); });
+  streamer.setWebSocketHandler("/ws", streamPortWebSocketHandler());
+  if (simulcast) {
+    streamer.setPathAlias("/stream/hi", "/stream");
+  }
+
+  if (get_system_property_int("persist.tesla-android.virtual-display.huge_pages") == 1) {
+    us_g_memory_flags |= US_MEMORY_HUGE;
+  }
+  if (get_system_property_int("persist.tesla-android.virtual-display.mlock") == 1) {
+    us_g_memory_flags |= US_MEMORY_LOCK;
+  }
+
+  int frame_pool_mb = get_system_property_int("persist.tesla-android.virtual-display.frame_pool_mb");
+  frame_pool = us_frame_pool_init("frame_pool", frame_pool_mb > 0 ? static_cast < size_t > (frame_pool_mb) << 20 : frame_pool_max_idle);
+
+  if (minicap_try_get_display_info(0, & displayInfo) != 0) {
+    fprintf(stderr, "Failed to get info from internal display \n");
+    exit(1);
+  }
+
+  // The encode thread and the last frame copy, faulted in before capture starts
+  encoded_frame_max_size = static_cast < size_t > (displayInfo.width) * displayInfo.height;
+  us_frame_pool_prefill(frame_pool, encoded_frame_max_size, 2);
+
   last_encoded_frame.data = nullptr;
+  last_encoded_frame.pool = frame_pool;
+  us_frame_realloc_data( & last_encoded_frame, encoded_frame_max_size);
+
+  // Not for H.264, a cached frame can't be spliced into the stream
+  int frame_cache_mb = get_system_property_int("persist.tesla-android.virtual-display.frame_cache_mb");
+  if (frame_cache_mb > 0 && !isH264) {
+    frame_cache = us_frame_cache_init("frame_cache", frame_cache_entries, static_cast < size_t > (frame_cache_mb) << 20, frame_pool);
+  }
 
   createEncoders();
 
+  // The servers start last, a client that connects right away asks the encoders for a
+  // keyframe
+  //
+  // Sharded event loops, pinned one per core, scale better with many viewers
+  int mjpeg_reactors = get_system_property_int("persist.tesla-android.virtual-display.mjpeg_reactors");
+  if (mjpeg_reactors > 0) {
+    streamer.start(9090, mjpeg_reactors, nadjieb::net::PublisherMode::REACTORS, true);
+  } else if (get_system_property_int("persist.tesla-android.virtual-display.mjpeg_uring") == 1) {
+    // One submission per frame for all the viewers, the worker pool if the kernel says no
+    streamer.start(9090, 4, nadjieb::net::PublisherMode::URING);
+  } else {
+    streamer.start(9090, 4);
+  }
+  stream_topic = & streamer.getTopic("/stream");
+  if (simulcast) {
+    stream_lo_topic = & streamer.getTopic("/stream/lo");
+  }
+
+  // Everything on 9090 then, one accept path and no libws threads
+  unifiedServer = get_system_property_int("persist.tesla-android.virtual-display.unified_server") == 1;
+  if (!unifiedServer) {
+    struct ws_events evs;
+    evs.onopen    = &ws_on_connection_opened;
+    evs.onclose   = &ws_on_connection_closed;
+    evs.onmessage = &ws_on_message;
+    ws_socket(&evs, 9091, 1, 1000);
+  }
+
   std::thread captureT(capture_thread);
   std::thread encodeT(encode_thread);
   std::thread broadcastT(broadcast_thread);